@@ -5,6 +5,10 @@
 #include <stdbool.h>
 #include "data_structure.h"
 #include "utils.h"
+#include "numa.h"
+#include "page_map.h"
+#include "fast_lists.h"
+#include "budget.h"
 #include <unistd.h>
 #include <sys/mman.h>
 #include <assert.h>
@@ -33,6 +37,10 @@
     avoid internal fragmentation caused by first-fit when it chooses a block much larger 
     than what the allocation needs.
 
+    - Heap Allocation: takes a block from the boundary-tag heap, trying in order
+    first-fit (again after consolidating the fast lists), the free space on top
+    of the heap and sbrk.
+
     - Sbrk Allocation: It's the algorithm that allows extension of our heap memory.
     The problem with allocating this way is that most of the time the memory reserved by sbrk 
     will not be contiguous with our already-allocated heap. Therefore, the algorithm save the 
@@ -72,7 +80,18 @@ static inline size_t align(size_t n) {
 }
 
 
-static Block* coalesce(Block* block) {
+// The free neighbors of a block that is being freed, and the tags they had when
+// they were read (see coalesce())
+typedef struct FreeNeighbors {
+    Block *prev;                // NULL if the previous block can't be merged
+    Block *next;                // NULL if the next block can't be merged
+    size_t prev_header;
+    size_t next_header;
+} FreeNeighbors;
+
+// Find the free neighbors of a used block. Returns the size of the merged block.
+// Note: no lock is held, coalesce() checks the tags again under the list locks
+static size_t find_free_neighbors(Block *block, FreeNeighbors *n) {
     /*
     Step 1) Check if the adjacent blocks are valid and not in use.
         Besides checking if the blocks are not in use, we have to verify that the 
@@ -83,74 +102,182 @@ static Block* coalesce(Block* block) {
         between the old heap and the new space. In this case, the physical calculation of
         the blocks through the footer will fail if we don't properly validate
         the memory zone we calculated.
+
+        The tags are read without locks, so they can be stale: they only tell
+        which lists heap_free_block() has to lock, and coalesce() checks them again.
+        Only tags that are always tags are read here: the header of the next block
+        (it can only be merged with the blocks after it, since this block is used)
+        and the footer just before this block. The header of the previous block is
+        read by coalesce(), under the lock of its list: without the lock a stale
+        footer could point it in the middle of the payload of another block.
+        The tags of the used neighbors can be written by their owners, this is
+        why they are only read as whole words (see load_header()).
     */
+    size_t new_size = get_size(block);
+    n->prev = NULL;
+    n->next = NULL;
+
     Block *next_block = get_next_physical_block(block);
 
-    bool next_is_free = false;
+    // Both neighbors are read below: their loads are started together, so that
+    // the two cache misses overlap instead of happening one after the other
+    prefetch_block(next_block);
+    prefetch_block((unsigned char*)block - sizeof(Footer));
 
+    // --- Case 1: Merge with next ---
     if (is_valid_heap_address(next_block)) {
-        next_is_free = !is_used(next_block);
+        size_t header = load_header(next_block);
+        if (!(header & 1)) {
+            n->next = next_block;
+            n->next_header = header;
+            new_size += header & SIZE_MASK;
+        }
     }
 
-    Block *prev_block = NULL;
-    bool prev_is_free = false;
-
     //Check if we're not at the start of the static heap or at the start of the
     //  new allocated memory by sbrk
-    // We need to check both: not at heap_start AND not at gap_end (start of sbrk region)
-    bool at_region_start = ((unsigned char*)block == (unsigned char*)heap_start) ||
-                           (gap_end != NULL && (unsigned char*)block == gap_end);
+    // We need to check both: not at heap_state.start AND not at heap_state.gap_end (start of sbrk region)
+    bool at_region_start = ((unsigned char*)block == (unsigned char*)heap_state.start) ||
+                           (heap_state.gap_end != NULL && (unsigned char*)block == heap_state.gap_end);
 
+    // --- Case 2: Merge with previous ---
     if (!at_region_start) {
         Footer* prev_footer_addr = (Footer*)((unsigned char*)block - sizeof(Footer));
         
         // Check also if the footer is in a valid heap memory (not in the gap)
         if (is_valid_heap_address(prev_footer_addr)) {
-            
-            prev_block = get_prev_physical_block(block);
-            
-            if (is_valid_heap_address(prev_block) && !is_used(prev_block)) {
-                prev_is_free = true;
+            Footer prev_footer = load_footer(prev_footer_addr);
+
+            if (!(prev_footer & 1)) {
+                Block *prev_block = (Block*)((unsigned char*)block - (prev_footer & SIZE_MASK));
+
+                if (is_valid_heap_address(prev_block)) {
+                    n->prev = prev_block;
+                    n->prev_header = prev_footer;
+                    new_size += prev_footer & SIZE_MASK;
+                }
             }
         }
     }
 
-    // Step 2) Generate the new block
+    return new_size;
+}
+
+// Merge a used block with the free neighbors found by find_free_neighbors().
+// Returns the merged block (still marked as used), or NULL if a neighbor changed
+// since it was read: the caller unlocks and looks for the neighbors again.
+// Note: the locks of the lists of the neighbors must be held
+static Block* coalesce(Block* block, const FreeNeighbors *n) {
+    /*
+        A free block is marked as free and inserted while holding the lock of its
+        list, and it leaves the free state (first_fit(), which also writes the footer)
+        only under that lock: with the lock held, a neighbor whose tags are still
+        the ones read before is the same free block, and it's in that list.
+        The footer of the previous block is read again first: while it's the same
+        free footer, the block that ends here is the free block of that size, so its
+        header can be read. Its header must match the footer before it's merged,
+        so a corrupted footer can't make us read the payload of a used block as a
+        header.
+        A neighbor that was used when it was read and is freed in the meantime is
+        not merged: its thread sees this block as used too, so the two free
+        blocks stay side by side until the next compaction pass (handles.h).
+    */
     size_t new_size = get_size(block);
 
-    // --- Case 1: Merge with next ---
-    if (next_is_free) {
-        remove_from_free_list(next_block);
-        new_size += get_size(next_block);
+    if (n->next != NULL && load_header(n->next) != n->next_header) return NULL;
+    if (n->prev != NULL &&
+        (load_footer((Footer*)((unsigned char*)block - sizeof(Footer))) != n->prev_header ||
+         load_header(n->prev) != n->prev_header)) {
+        return NULL;
     }
 
-    // --- Case 2: Merge with previous ---
-    if (prev_is_free) {
-        remove_from_free_list(prev_block);
-        new_size += get_size(prev_block);
+    if (n->next != NULL) {
+        remove_from_free_list(n->next);
+        new_size += n->next_header & SIZE_MASK;
+    }
+    if (n->prev != NULL) {
+        remove_from_free_list(n->prev);
+        new_size += n->prev_header & SIZE_MASK;
         // The address of the new block is the one of the previous block since
         // it comes first in terms of addresses
-        block = prev_block;
+        block = n->prev;
     }
-    
-    setup_block(block, new_size, false);
+
+    // Step 2) Generate the new block. It's still marked as used:
+    // the caller inserts it in the segregated lists.
+    set_header(block, new_size, true);
 
     return block;
 }
 
+// Give a used block back to the segregated lists, merging it with its free neighbors.
+// Only the lists of the free neighbors and of the merged block are locked (at most
+// three), in ascending order like every thread that holds more than one list lock.
+static void heap_free_block(Block *block) {
+    for (;;) {
+        FreeNeighbors n;
+        size_t merged_size = find_free_neighbors(block, &n);
+
+        bool locked[NUM_LISTS] = { false };
+        locked[get_list_index(merged_size)] = true;
+        if (n.prev != NULL) locked[get_list_index(n.prev_header & SIZE_MASK)] = true;
+        if (n.next != NULL) locked[get_list_index(n.next_header & SIZE_MASK)] = true;
+        for (int i = 0; i < NUM_LISTS; i++) {
+            if (locked[i]) lock_list(i);
+        }
+
+        Block *merged = coalesce(block, &n);
+        if (merged != NULL) {
+            setup_block(merged, get_size(merged), false);
+            insert_into_free_list(merged);
+        }
+
+        for (int i = NUM_LISTS - 1; i >= 0; i--) {
+            if (locked[i]) unlock_list(i);
+        }
+        if (merged != NULL) return;
+    }
+}
+
+// Free for real all the blocks of the fast lists (see fast_lists.h), merging them
+// with their neighbors. Returns false if the fast lists were empty.
+static bool fast_consolidate() {
+    bool found = false;
+    for (int i = 0; i < (int)FAST_NUM_LISTS; i++) {
+        Block *chain = fast_detach(i);
+        while (chain != NULL) {
+            Block *next = get_next_free(chain);
+            heap_free_block(chain);
+            chain = next;
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Find a free block of sufficient size and take it out of its list.
+// The block is returned already marked as used.
 static Block* first_fit(size_t size) {
     int start_idx = get_list_index(size);
 
     for (int i = start_idx; i < NUM_LISTS; i++) {
-        Block *current = segregatedLists[i];
+        lock_list(i);
+        Block *current = segregatedLists[i].head;
         
         while (current != NULL) {
+            check_header(current, "my_malloc");
             // Return a block of sufficient size
             if (get_size(current) >= size) {
+                remove_from_free_list(current);
+                set_used(current, true);
+                // The footer too, so coalesce() doesn't see the block as free
+                store_footer(get_footer(current), load_header(current));
+                unlock_list(i);
                 return current;
             }
-            current = current->next_free;
+            current = get_next_free(current);
         }
+        unlock_list(i);
     }
     
     return NULL;
@@ -166,20 +293,71 @@ static void split_block(Block *block, size_t needed_size) {
     // which would lead to fragmentation.
     if (current_size >= needed_size + min_block_size) {
         
-        setup_block(block, needed_size, true);
-        
         //Create a new block with the remaining space.
         // First, we calculate where the second block starts.
         // It will start at the end of the new block.
         Block *new_block = (Block*)((unsigned char*)block + needed_size);
         size_t new_size = current_size - needed_size;
+
+        // The header of the second block is written (as used) before the first block
+        // is shrunk, so a heap walk (see heap_compact()) never finds a stale header:
+        // the shrunk header is stored with release order
+        set_header(new_block, new_size, true);
+        __atomic_store_n(&block->header, make_header(block, (needed_size & SIZE_MASK) | 1),
+                         __ATOMIC_RELEASE);
+        store_footer(get_footer(block), load_header(block));
         
-        setup_block(new_block, new_size, false);
-        
-        insert_into_free_list(new_block);
+        release_free_block(new_block, new_size);
     }
 }
 
+// ---------------- Trimmed pages ---------------------
+// The pages that heap_compact() gives back above the top of the heap leave the
+// memory budget, and are charged again when the top grows over them.
+// Note: the growth lock must be held by all these functions
+
+// First page of the heap counted in the budget: the sbrk region
+static uintptr_t heap_charged_start() {
+    uintptr_t page_size = (uintptr_t)get_page_size();
+    unsigned char *start = (heap_state.gap_end != NULL) ? heap_state.gap_end : heap + HEAP_TOTAL_SIZE;
+    return ((uintptr_t)start + page_size - 1) & ~(page_size - 1);
+}
+
+// The pages from first_page to last_page were given back: take them out of the budget.
+// The pages trimmed before are among them, since the top only went down.
+static void heap_trim_pages(uintptr_t first_page, uintptr_t last_page) {
+    uintptr_t charged = heap_charged_start();
+    if (first_page < charged) first_page = charged;
+    if (first_page >= last_page) return;
+
+    size_t trimmed = (heap_state.trim_start != NULL) ? (size_t)(heap_state.trim_end - heap_state.trim_start) : 0;
+    budget_uncharge((last_page - first_page) - trimmed);
+    heap_state.trim_start = (unsigned char*)first_page;
+    heap_state.trim_end = (unsigned char*)last_page;
+}
+
+// Bytes of the trimmed pages reached by moving the top up to new_top
+static size_t heap_trimmed_below(unsigned char *new_top) {
+    if (heap_state.trim_start == NULL || new_top <= heap_state.trim_start) return 0;
+    uintptr_t page_size = (uintptr_t)get_page_size();
+    uintptr_t reused = ((uintptr_t)new_top + page_size - 1) & ~(page_size - 1);
+    if (reused > (uintptr_t)heap_state.trim_end) reused = (uintptr_t)heap_state.trim_end;
+    return reused - (uintptr_t)heap_state.trim_start;
+}
+
+// The first bytes of the trimmed pages have been charged again
+static void heap_untrim(size_t bytes) {
+    heap_state.trim_start += bytes;
+    if (heap_state.trim_start == heap_state.trim_end) {
+        heap_state.trim_start = NULL;
+        heap_state.trim_end = NULL;
+    }
+}
+
+// Minimum growth of the heap through sbrk, 0 = one page (MY_MALLOC_CONF, see config.h)
+static size_t sbrk_min_growth = 0;
+
+// Note: the growth lock must be held
 static void* sbrk_allocation(size_t total_size) {
     /* Step 1) Calculate how much to enlarge the heap
                 Since sbrk works with pages, we will calculate 
@@ -187,7 +365,13 @@ static void* sbrk_allocation(size_t total_size) {
     */
     size_t page_size = (size_t)get_page_size();
 
+    // The heap grows by at least one page, or by sbrk_min_growth bytes if it's
+    // bigger (fewer sbrk calls for programs that grow the heap a lot)
     size_t size_to_alloc = total_size;
+    size_t min_growth = __atomic_load_n(&sbrk_min_growth, __ATOMIC_RELAXED);
+    if (size_to_alloc < min_growth) {
+        size_to_alloc = min_growth;
+    }
     if (size_to_alloc < page_size) {
         size_to_alloc = page_size;
     }
@@ -195,52 +379,138 @@ static void* sbrk_allocation(size_t total_size) {
     // Round up to a multiple of a page using the technique also used in the align algorithm
     size_t sbrk_size = (size_to_alloc + page_size - 1) & ~(page_size - 1);
 
-    // Step 2) Call sbrk
+    // Step 2) Call sbrk, if the memory budget allows it.
+    // The pages trimmed at the top are used again too: the new block starts on them,
+    // or they become the free block left before the gap.
+    size_t reused = heap_trimmed_below(heap_state.end);
+    if (!budget_charge(sbrk_size + reused)) {
+        return NULL;
+    }
     void *request = sbrk(sbrk_size);
     if (request == (void*)-1) {
+        budget_uncharge(sbrk_size + reused);
         return NULL; // Out Of Memory error
     }
 
+#ifdef COMPRESSED_LINKS
+    // The 32-bit links can't reach blocks below the static heap or beyond
+    // COMPRESSED_LINKS_RANGE from it
+    if ((unsigned char*)request < heap ||
+        (size_t)((unsigned char*)request + sbrk_size - heap) > COMPRESSED_LINKS_RANGE) {
+        if (sbrk(0) == (unsigned char*)request + sbrk_size) sbrk(-(intptr_t)sbrk_size);
+        budget_uncharge(sbrk_size + reused);
+        return NULL;
+    }
+#endif
+
+    // Place the new pages on the node of the thread that is growing the heap
+    numa_bind_to_local_node(request, sbrk_size);
+
+    // Register the new pages as part of the heap, so my_free recognizes them.
+    // If the page map can't grow the memory can't be used: it's given back if possible.
+    if (!page_map_set_range(request, sbrk_size, page_map_entry(NULL, PAGE_KIND_HEAP))) {
+        if (sbrk(0) == (unsigned char*)request + sbrk_size) sbrk(-(intptr_t)sbrk_size);
+        budget_uncharge(sbrk_size + reused);
+        return NULL;
+    }
+    heap_untrim(reused);
+
     /* Step 3) There may be a hole between the current heap size and the program break
                set by sbrk. This can happen when some other data are stored in the BSS
                section after the end of the heap, and therefore there would be a gap
-               between heap_top and the returned sbrk address.
+               between heap_state.top and the returned sbrk address.
     */
-    if (request != heap_end) {
-        assert(gap_start == NULL);
+    Block *rest = NULL;
+    size_t remaining = 0;
+
+    if (request != heap_state.end) {
+        assert(heap_state.gap_start == NULL);
         //Create a free block with remaining static heap space if possible
-        size_t remaining = heap_end - heap_top;
+        remaining = heap_state.end - heap_state.top;
         size_t needed_for_free_block = sizeof(Block) + sizeof(Footer);
         
         if (remaining >= needed_for_free_block) {
-            Block *rest = (Block*)heap_top;
-            setup_block(rest, remaining, false);
-            insert_into_free_list(rest);
+            // The block is inserted in the free lists at the end, once the gap
+            // pointers and the new heap_state.top are visible to the other threads
+            rest = (Block*)heap_state.top;
             
-            gap_start = heap_end;
+            heap_state.gap_start = heap_state.end;
         } else {
             //TODO: modify the code to convert the remaining space between the gap and the
-            // heap_top into a free block
-            gap_start = heap_top;
+            // heap_state.top into a free block
+            heap_state.gap_start = heap_state.top;
         }
         
-        gap_end = (unsigned char *)request;
+        heap_state.gap_end = (unsigned char *)request;
 
         //Move the heap pointers to fit the new memory space
-        heap_top = (unsigned char *)request;
-        heap_end = (unsigned char *)request + sbrk_size;
+        heap_state.top = (unsigned char *)request;
+        heap_state.end = (unsigned char *)request + sbrk_size;
     } else {
-        //Memory is contiguous, just extend heap_end
-        heap_end += sbrk_size;
+        //Memory is contiguous, just extend heap_state.end
+        heap_state.end += sbrk_size;
     }
 
-    Block* block = (Block*)heap_top;
+    Block* block = (Block*)heap_state.top;
     
     setup_block(block, total_size, true);
 
-    heap_top += total_size;
+    set_heap_top(heap_state.top + total_size);
+
+    if (rest != NULL) {
+        release_free_block(rest, remaining);
+    }
     
     return (void*)block->payload;
 }
 
-#endif
\ No newline at end of file
+// Take a block of total_size bytes from the heap, marked as used
+static Block* heap_allocation(size_t total_size) {
+    // The block is already taken out of the free lists and marked as used
+    Block *block = first_fit(total_size);
+
+    // Before growing the heap, the small blocks of the fast lists are merged:
+    // they may form a block big enough
+    if (block == NULL && fast_consolidate()) {
+        block = first_fit(total_size);
+    }
+    
+    if (block != NULL) {
+        split_block(block, total_size);
+
+        return block;
+    }
+
+    // If there are no blocks available for that data, a new block is created
+    // on top of the heap
+    pthread_mutex_lock(&heap_state.growth_lock);
+
+    if (heap_state.top + total_size <= heap_state.end) {
+        // Pages given back by heap_compact() get memory again, if the budget allows it
+        size_t reused = heap_trimmed_below(heap_state.top + total_size);
+        if (reused > 0 && !budget_charge(reused)) {
+            pthread_mutex_unlock(&heap_state.growth_lock);
+            return NULL;
+        }
+        heap_untrim(reused);
+
+        block = (Block*)heap_state.top;
+        
+        setup_block(block, total_size, true);
+
+        set_heap_top(heap_state.top + total_size);
+
+        pthread_mutex_unlock(&heap_state.growth_lock);
+        
+        return block;
+    }
+
+    // Sbrk allocation
+    void *payload = sbrk_allocation(total_size);
+
+    pthread_mutex_unlock(&heap_state.growth_lock);
+
+    return (payload != NULL) ? get_block_from_payload(payload) : NULL;
+}
+
+#endif
@@ -1,13 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <time.h>
 #include "heap_allocator.h"
 #include "debug_utilities.h"
 
-//gcc allocator.c -o allocator -Wall
+//gcc allocator.c -o allocator -Wall -pthread
 
 /*
     ------ PARAMETRIC TESTS FOR THE ALLOCATOR --------
@@ -21,6 +26,29 @@
     - fragmentation: Test allocator behavior under fragmentation patterns
     - stress_small: Stress test with many small allocations
     - large_blocks: Test multiple large allocations via mmap
+    - threads: Test concurrent allocations from many threads
+    - fork_safety: Test fork() while other threads are allocating
+    - ownership: Test pointer classification through the page map
+    - spans: Test mid-size allocations from the page heap
+    - compaction: Test relocatable handles and heap compaction
+    - persistent: Test the persistent heap backed by a file
+    - shared_heap: Test the shared-memory heap with many processes
+    - slabs: Test the out-of-line metadata mode (slabs)
+    - fast_lists: Test the lock-free singly-linked fast lists
+    - prefetch: Benchmark the prefetching of the free lists
+    - guarded: Test the sampled allocations with guard pages
+    - header_checks: Test the header checksums and the double free detection
+    - compaction_threads: Test heap compaction while other threads allocate and free
+    - thread_caches: Test the per-thread caches: flush at thread exit and scavenge of idle bins
+    - safe_linking: Test the mangling of the free list links
+    - quarantine: Test the quarantine of freed blocks
+    - cpu_cache: Test the per-cpu cache: cpu selection, bin limits, refill and drain
+    - budget: Test the memory budget with its soft and hard limit
+    - memory_monitor: Test the cgroup and memory pressure monitor
+    - mallctl: Test the name-based introspection and control of my_mallctl
+    - config: Test the runtime configuration and the statistics
+    - leak_report: Test the leak report grouped by allocation site
+    - numa: Test the NUMA policy of the memory obtained from the kernel
     
     Usage:
         ./allocator <test1> [params...]
@@ -73,6 +101,127 @@ typedef struct {
     int free_order;  // 0=FIFO, 1=LIFO, 2=random
 } LargeBlocksParams;
 
+typedef struct {
+    int num_threads;
+    int iterations;
+    size_t max_size;
+} ThreadsParams;
+
+typedef struct {
+    int num_threads;
+    int num_forks;
+} ForkSafetyParams;
+
+typedef struct {
+    size_t small_size;
+    size_t large_size;
+} OwnershipParams;
+
+typedef struct {
+    size_t span_size;
+    int num_spans;
+} SpansParams;
+
+typedef struct {
+    size_t handle_size;
+    int num_handles;
+} CompactionParams;
+
+typedef struct {
+    size_t heap_size;
+    int num_nodes;
+} PersistentParams;
+
+typedef struct {
+    int num_workers;
+    int num_allocs;
+} SharedHeapParams;
+
+typedef struct {
+    size_t object_size;
+    int num_objects;
+} SlabsParams;
+
+typedef struct {
+    int num_threads;
+    int num_blocks;
+    int iterations;
+} FastListsParams;
+
+typedef struct {
+    size_t block_size;
+    int num_blocks;
+    int rounds;
+} PrefetchParams;
+
+typedef struct {
+    size_t object_size;
+    int num_objects;
+} GuardedParams;
+
+typedef struct {
+    size_t block_size;
+    int num_blocks;
+} HeaderChecksParams;
+
+typedef struct {
+    size_t block_size;
+    int num_blocks;
+} SafeLinkingParams;
+
+typedef struct {
+    size_t block_size;
+    size_t budget;
+    int num_blocks;
+} QuarantineParams;
+
+typedef struct {
+    size_t block_size;
+    int num_blocks;
+} LeakReportParams;
+
+typedef struct {
+    size_t threshold;
+    int num_blocks;
+} ConfigParams;
+
+typedef struct {
+    size_t span_size;
+    int num_blocks;
+} MallctlParams;
+
+typedef struct {
+    int interval_ms;
+    int percent;
+} MemoryMonitorParams;
+
+typedef struct {
+    size_t block_size;
+    int num_blocks;
+} BudgetParams;
+
+typedef struct {
+    size_t payload;
+    int extra;
+} CpuCacheParams;
+
+typedef struct {
+    size_t payload;
+    int num_blocks;
+    unsigned int interval;
+} ThreadCachesParams;
+
+typedef struct {
+    int num_threads;
+    int iterations;
+    int num_passes;
+} CompactionThreadsParams;
+
+typedef struct {
+    size_t block_size;
+    int num_blocks;
+} NumaParams;
+
 /* ==================== DEFAULT PARAMETERS ==================== */
 
 static bool verbose_mode = false;
@@ -118,6 +267,127 @@ LargeBlocksParams default_large_blocks_params = {
     .free_order = 1  // LIFO
 };
 
+ThreadsParams default_threads_params = {
+    .num_threads = 8,
+    .iterations = 20000,
+    .max_size = 2048
+};
+
+ForkSafetyParams default_fork_params = {
+    .num_threads = 4,
+    .num_forks = 50
+};
+
+OwnershipParams default_ownership_params = {
+    .small_size = 64,
+    .large_size = 256 * 1024
+};
+
+SpansParams default_spans_params = {
+    .span_size = 16 * 1024,
+    .num_spans = 8
+};
+
+CompactionParams default_compaction_params = {
+    .handle_size = 200,
+    .num_handles = 32
+};
+
+PersistentParams default_persistent_params = {
+    .heap_size = 1024 * 1024,
+    .num_nodes = 1000
+};
+
+SharedHeapParams default_shared_heap_params = {
+    .num_workers = 4,
+    .num_allocs = 500
+};
+
+SlabsParams default_slabs_params = {
+    .object_size = 48,
+    .num_objects = 2000
+};
+
+FastListsParams default_fast_lists_params = {
+    .num_threads = 4,
+    .num_blocks = 256,
+    .iterations = 100000
+};
+
+PrefetchParams default_prefetch_params = {
+    .block_size = 320,
+    .num_blocks = 20000,
+    .rounds = 5
+};
+
+GuardedParams default_guarded_params = {
+    .object_size = 100,
+    .num_objects = 100
+};
+
+HeaderChecksParams default_header_checks_params = {
+    .block_size = 64,
+    .num_blocks = 500
+};
+
+SafeLinkingParams default_safe_linking_params = {
+    .block_size = 1024,
+    .num_blocks = 64
+};
+
+QuarantineParams default_quarantine_params = {
+    .block_size = 200,
+    .budget = 16384,
+    .num_blocks = 500
+};
+
+LeakReportParams default_leak_report_params = {
+    .block_size = 64,
+    .num_blocks = 300
+};
+
+ConfigParams default_config_params = {
+    .threshold = 65536,
+    .num_blocks = 1000
+};
+
+MallctlParams default_mallctl_params = {
+    .span_size = 16384,
+    .num_blocks = 64
+};
+
+MemoryMonitorParams default_memory_monitor_params = {
+    .interval_ms = 5,
+    .percent = 90
+};
+
+BudgetParams default_budget_params = {
+    .block_size = 262144,
+    .num_blocks = 32
+};
+
+CpuCacheParams default_cpu_cache_params = {
+    .payload = 40,
+    .extra = 8
+};
+
+ThreadCachesParams default_thread_caches_params = {
+    .payload = 40,
+    .num_blocks = 16,
+    .interval = 64
+};
+
+CompactionThreadsParams default_compaction_threads_params = {
+    .num_threads = 4,
+    .iterations = 20000,
+    .num_passes = 200
+};
+
+NumaParams default_numa_params = {
+    .block_size = 16384,
+    .num_blocks = 64
+};
+
 /* ==================== HELPER FUNCTION ==================== */
 
 void print_help() {
@@ -177,6 +447,150 @@ void print_help() {
     printf("     num=<count>           (default: %d)\n", default_large_blocks_params.num_blocks);
     printf("     order=<0|1|2>         (0=FIFO, 1=LIFO, 2=random, default: %d)\n\n", default_large_blocks_params.free_order);
     
+    printf("8. threads\n");
+    printf("   Tests concurrent allocations and frees from many threads\n");
+    printf("   Parameters:\n");
+    printf("     threads=<count>       (default: %d)\n", default_threads_params.num_threads);
+    printf("     iterations=<count>    (default: %d)\n", default_threads_params.iterations);
+    printf("     max_size=<bytes>      (default: %zu)\n\n", default_threads_params.max_size);
+    
+    printf("9. fork_safety\n");
+    printf("   Tests fork() while other threads are allocating\n");
+    printf("   Parameters:\n");
+    printf("     threads=<count>       (default: %d)\n", default_fork_params.num_threads);
+    printf("     forks=<count>         (default: %d)\n\n", default_fork_params.num_forks);
+    
+    printf("10. ownership\n");
+    printf("   Tests my_owns and my_free with foreign pointers\n");
+    printf("   Parameters:\n");
+    printf("     small=<bytes>         (default: %zu)\n", default_ownership_params.small_size);
+    printf("     large=<bytes>         (default: %zu)\n\n", default_ownership_params.large_size);
+    
+    printf("11. spans\n");
+    printf("   Tests allocation, merging and reuse of page heap spans\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_spans_params.span_size);
+    printf("     num=<count>           (default: %d)\n\n", default_spans_params.num_spans);
+    
+    printf("12. compaction\n");
+    printf("   Tests handles and the compaction of a fragmented heap\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_compaction_params.handle_size);
+    printf("     num=<count>           (default: %d)\n\n", default_compaction_params.num_handles);
+    
+    printf("13. persistent\n");
+    printf("   Tests data surviving a close and reopen of a persistent heap\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_persistent_params.heap_size);
+    printf("     nodes=<count>         (default: %d)\n\n", default_persistent_params.num_nodes);
+    
+    printf("14. shared_heap\n");
+    printf("   Tests allocation from many processes and recovery after a crash\n");
+    printf("   Parameters:\n");
+    printf("     workers=<count>       (default: %d)\n", default_shared_heap_params.num_workers);
+    printf("     allocs=<count>        (default: %d)\n\n", default_shared_heap_params.num_allocs);
+    
+    printf("15. slabs\n");
+    printf("   Tests small objects without inline headers, served by slabs\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_slabs_params.object_size);
+    printf("     count=<count>         (default: %d)\n\n", default_slabs_params.num_objects);
+    
+    printf("16. fast_lists\n");
+    printf("   Tests concurrent push and pop on a fast list and its consolidation\n");
+    printf("   Parameters:\n");
+    printf("     threads=<count>       (default: %d)\n", default_fast_lists_params.num_threads);
+    printf("     blocks=<count>        (default: %d)\n", default_fast_lists_params.num_blocks);
+    printf("     iterations=<count>    (default: %d)\n\n", default_fast_lists_params.iterations);
+    
+    printf("17. prefetch\n");
+    printf("   Times allocations from long free lists with and without prefetching\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_prefetch_params.block_size);
+    printf("     count=<count>         (default: %d)\n", default_prefetch_params.num_blocks);
+    printf("     rounds=<count>        (default: %d)\n\n", default_prefetch_params.rounds);
+    
+    printf("18. guarded\n");
+    printf("   Tests overflow, use-after-free and double free detection in the guarded pool\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_guarded_params.object_size);
+    printf("     count=<count>         (default: %d)\n\n", default_guarded_params.num_objects);
+    
+    printf("19. header_checks\n");
+    printf("   Tests that corrupted headers and double frees are caught\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_header_checks_params.block_size);
+    printf("     count=<count>         (default: %d)\n\n", default_header_checks_params.num_blocks);
+    
+    printf("20. safe_linking\n");
+    printf("   Tests that free list links are mangled and that forged links are caught\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_safe_linking_params.block_size);
+    printf("     count=<count>         (default: %d)\n\n", default_safe_linking_params.num_blocks);
+    
+    printf("21. quarantine\n");
+    printf("   Tests delayed reuse, poisoning and the byte budget of the quarantine\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_quarantine_params.block_size);
+    printf("     budget=<bytes>        (default: %zu)\n", default_quarantine_params.budget);
+    printf("     count=<count>         (default: %d)\n\n", default_quarantine_params.num_blocks);
+    
+    printf("22. leak_report\n");
+    printf("   Tests that the blocks still allocated are found and grouped by site\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_leak_report_params.block_size);
+    printf("     count=<count>         (default: %d)\n\n", default_leak_report_params.num_blocks);
+    
+    printf("23. config\n");
+    printf("   Tests MY_MALLOC_CONF options, size-class statistics and usable sizes\n");
+    printf("   Parameters:\n");
+    printf("     threshold=<bytes>     (default: %zu)\n", default_config_params.threshold);
+    printf("     count=<count>         (default: %d)\n\n", default_config_params.num_blocks);
+    
+    printf("24. mallctl\n");
+    printf("   Tests reading and writing options, counters and actions by name\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_mallctl_params.span_size);
+    printf("     count=<count>         (default: %d)\n\n", default_mallctl_params.num_blocks);
+    
+    printf("25. memory_monitor\n");
+    printf("   Tests trimming when a fake cgroup is close to its limit or under pressure\n");
+    printf("   Parameters:\n");
+    printf("     interval=<ms>         (default: %d)\n", default_memory_monitor_params.interval_ms);
+    printf("     percent=<percent>     (default: %d)\n\n", default_memory_monitor_params.percent);
+    
+    printf("26. budget\n");
+    printf("   Tests failing growth over the hard limit and reclaim callbacks over the soft one\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_budget_params.block_size);
+    printf("     count=<count>         (default: %d)\n\n", default_budget_params.num_blocks);
+    
+    printf("27. cpu_cache\n");
+    printf("   Tests the cache chosen on each cpu, the capacity of a bin, LIFO pops and the flush\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_cpu_cache_params.payload);
+    printf("     extra=<count>         (default: %d)\n\n", default_cpu_cache_params.extra);
+    
+    printf("28. thread_caches\n");
+    printf("   Tests that an exiting thread gives its cached blocks back and that idle bins are halved\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_thread_caches_params.payload);
+    printf("     count=<count>         (default: %d)\n", default_thread_caches_params.num_blocks);
+    printf("     interval=<frees>      (default: %u)\n\n", default_thread_caches_params.interval);
+    
+    printf("29. compaction_threads\n");
+    printf("   Tests compaction passes running while threads use blocks and pinned handles\n");
+    printf("   Parameters:\n");
+    printf("     threads=<count>       (default: %d)\n", default_compaction_threads_params.num_threads);
+    printf("     iterations=<count>    (default: %d)\n", default_compaction_threads_params.iterations);
+    printf("     passes=<count>        (default: %d)\n\n", default_compaction_threads_params.num_passes);
+    
+    printf("30. numa\n");
+    printf("   Tests that the pages of the heap growth and of mmap blocks are bound to the local node\n");
+    printf("   Parameters:\n");
+    printf("     size=<bytes>          (default: %zu)\n", default_numa_params.block_size);
+    printf("     count=<count>         (default: %d)\n\n", default_numa_params.num_blocks);
+    
     printf("EXAMPLES:\n");
     printf("  ./allocator mmap_threshold\n");
     printf("  ./allocator mmap_threshold size_below=32768 size_above=524288\n");
@@ -194,7 +608,30 @@ int is_test_name(const char *arg) {
            strcmp(arg, "coalescing") == 0 ||
            strcmp(arg, "fragmentation") == 0 ||
            strcmp(arg, "stress_small") == 0 ||
-           strcmp(arg, "large_blocks") == 0;
+           strcmp(arg, "large_blocks") == 0 ||
+           strcmp(arg, "threads") == 0 ||
+           strcmp(arg, "fork_safety") == 0 ||
+           strcmp(arg, "ownership") == 0 ||
+           strcmp(arg, "spans") == 0 ||
+           strcmp(arg, "compaction") == 0 ||
+           strcmp(arg, "persistent") == 0 ||
+           strcmp(arg, "shared_heap") == 0 ||
+           strcmp(arg, "slabs") == 0 ||
+           strcmp(arg, "fast_lists") == 0 ||
+           strcmp(arg, "prefetch") == 0 ||
+           strcmp(arg, "guarded") == 0 ||
+           strcmp(arg, "header_checks") == 0 ||
+           strcmp(arg, "safe_linking") == 0 ||
+           strcmp(arg, "quarantine") == 0 ||
+           strcmp(arg, "leak_report") == 0 ||
+           strcmp(arg, "config") == 0 ||
+           strcmp(arg, "mallctl") == 0 ||
+           strcmp(arg, "memory_monitor") == 0 ||
+           strcmp(arg, "budget") == 0 ||
+           strcmp(arg, "cpu_cache") == 0 ||
+           strcmp(arg, "thread_caches") == 0 ||
+           strcmp(arg, "compaction_threads") == 0 ||
+           strcmp(arg, "numa") == 0;
 }
 
 int is_parameter(const char *arg) {
@@ -355,313 +792,2756 @@ void parse_large_blocks_params(LargeBlocksParams *params, int argc, char *argv[]
     }
 }
 
-/* ==================== TEST IMPLEMENTATIONS ==================== */
-
-void test_mmap_threshold(MmapThresholdParams params) {
-    printf("=== Test: mmap_threshold ===\n");
-    printf("Parameters: size_below=%zu, size_at=%zu, size_above=%zu\n\n",
-           params.size_below_threshold, params.size_at_threshold, params.size_above_threshold);
-    
-    printf("Allocating size below threshold (%zu bytes)...\n", params.size_below_threshold);
-    void *p1 = my_malloc(params.size_below_threshold);
-    assert(p1 != NULL);
-    memset(p1, 'A', params.size_below_threshold);
-    printf("  Success: %p\n", p1);
-    if (verbose_mode) print_memory();
-    
-    printf("Allocating size at threshold (%zu bytes)...\n", params.size_at_threshold);
-    void *p2 = my_malloc(params.size_at_threshold);
-    assert(p2 != NULL);
-    memset(p2, 'B', params.size_at_threshold);
-    printf("  Success: %p\n", p2);
-    if (verbose_mode) print_memory();
-    
-    printf("Allocating size above threshold (%zu bytes)...\n", params.size_above_threshold);
-    void *p3 = my_malloc(params.size_above_threshold);
-    assert(p3 != NULL);
-    memset(p3, 'C', params.size_above_threshold);
-    printf("  Success: %p\n", p3);
-    if (verbose_mode) print_memory();
-    
-    my_free(p1);
-    my_free(p2);
-    my_free(p3);
-    if (verbose_mode) print_memory();
-    printf("Test PASSED\n\n");
-}
-
-void test_alignment(AlignmentParams params) {
-    printf("=== Test: alignment ===\n");
-    printf("Parameters: testing %d sizes\n\n", params.num_sizes);
-    
-    void *ptrs[params.num_sizes];
-    
-    // Detect actual alignment from first allocation
-    void *test = my_malloc(1);
-    uintptr_t test_addr = (uintptr_t)test;
-    size_t actual_alignment = 1;
-    for (size_t pow = 1; pow <= 256; pow *= 2) {
-        if (test_addr % pow == 0) {
-            actual_alignment = pow;
+void parse_threads_params(ThreadsParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "threads") == 0) {
+                params->num_threads = atoi(value);
+            } else if (strcmp(key, "iterations") == 0) {
+                params->iterations = atoi(value);
+            } else if (strcmp(key, "max_size") == 0) {
+                params->max_size = atol(value);
+            }
         }
+        *end_idx = i + 1;
     }
-    my_free(test);
-    if (verbose_mode) print_memory();
-    
-    printf("Detected allocator alignment: %zu bytes\n\n", actual_alignment);
-    
-    for (int i = 0; i < params.num_sizes; i++) {
-        ptrs[i] = my_malloc(params.sizes[i]);
-        assert(ptrs[i] != NULL);
-        
-        uintptr_t addr = (uintptr_t)ptrs[i];
-        int aligned = (addr % actual_alignment == 0);
+}
+
+void parse_fork_params(ForkSafetyParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
         
-        printf("Size %zu: %p (aligned to %zu: %s)\n", params.sizes[i], ptrs[i], actual_alignment, aligned ? "YES" : "NO");
-        assert(aligned);
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
         
-        memset(ptrs[i], 'A' + i, params.sizes[i]);
-    }
-    if (verbose_mode) print_memory();
-    
-    for (int i = 0; i < params.num_sizes; i++) {
-        my_free(ptrs[i]);
+        if (key && value) {
+            if (strcmp(key, "threads") == 0) {
+                params->num_threads = atoi(value);
+            } else if (strcmp(key, "forks") == 0) {
+                params->num_forks = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
     }
-    if (verbose_mode) print_memory();
-    printf("Test PASSED\n\n");
 }
 
-void test_split_reuse(SplitReuseParams params) {
-    printf("=== Test: split_reuse ===\n");
-    printf("Parameters: initial=%zu, realloc=%zu\n\n",
-           params.initial_size, params.realloc_size);
+void parse_ownership_params(OwnershipParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "small") == 0) {
+                params->small_size = atol(value);
+            } else if (strcmp(key, "large") == 0) {
+                params->large_size = atol(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_spans_params(SpansParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->span_size = atol(value);
+            } else if (strcmp(key, "num") == 0) {
+                params->num_spans = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_compaction_params(CompactionParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->handle_size = atol(value);
+            } else if (strcmp(key, "num") == 0) {
+                params->num_handles = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_persistent_params(PersistentParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->heap_size = atol(value);
+            } else if (strcmp(key, "nodes") == 0) {
+                params->num_nodes = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_shared_heap_params(SharedHeapParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "workers") == 0) {
+                params->num_workers = atoi(value);
+            } else if (strcmp(key, "allocs") == 0) {
+                params->num_allocs = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_slabs_params(SlabsParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->object_size = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_objects = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_fast_lists_params(FastListsParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "threads") == 0) {
+                params->num_threads = atoi(value);
+            } else if (strcmp(key, "blocks") == 0) {
+                params->num_blocks = atoi(value);
+            } else if (strcmp(key, "iterations") == 0) {
+                params->iterations = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_prefetch_params(PrefetchParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->block_size = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_blocks = atoi(value);
+            } else if (strcmp(key, "rounds") == 0) {
+                params->rounds = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_guarded_params(GuardedParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->object_size = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_objects = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_header_checks_params(HeaderChecksParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->block_size = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_blocks = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_safe_linking_params(SafeLinkingParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->block_size = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_blocks = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_quarantine_params(QuarantineParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->block_size = atol(value);
+            } else if (strcmp(key, "budget") == 0) {
+                params->budget = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_blocks = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_leak_report_params(LeakReportParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->block_size = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_blocks = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_config_params(ConfigParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "threshold") == 0) {
+                params->threshold = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_blocks = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_mallctl_params(MallctlParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->span_size = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_blocks = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_memory_monitor_params(MemoryMonitorParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "interval") == 0) {
+                params->interval_ms = atoi(value);
+            } else if (strcmp(key, "percent") == 0) {
+                params->percent = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_budget_params(BudgetParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->block_size = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_blocks = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_cpu_cache_params(CpuCacheParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->payload = atol(value);
+            } else if (strcmp(key, "extra") == 0) {
+                params->extra = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_thread_caches_params(ThreadCachesParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->payload = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_blocks = atoi(value);
+            } else if (strcmp(key, "interval") == 0) {
+                params->interval = atol(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_compaction_threads_params(CompactionThreadsParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "threads") == 0) {
+                params->num_threads = atoi(value);
+            } else if (strcmp(key, "iterations") == 0) {
+                params->iterations = atoi(value);
+            } else if (strcmp(key, "passes") == 0) {
+                params->num_passes = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+void parse_numa_params(NumaParams *params, int argc, char *argv[], int start_idx, int *end_idx) {
+    *end_idx = start_idx;
+    for (int i = start_idx; i < argc; i++) {
+        if (is_test_name(argv[i])) break;
+        if (!is_parameter(argv[i])) break;
+        
+        char *key = strtok(argv[i], "=");
+        char *value = strtok(NULL, "=");
+        
+        if (key && value) {
+            if (strcmp(key, "size") == 0) {
+                params->block_size = atol(value);
+            } else if (strcmp(key, "count") == 0) {
+                params->num_blocks = atoi(value);
+            }
+        }
+        *end_idx = i + 1;
+    }
+}
+
+/* ==================== TEST IMPLEMENTATIONS ==================== */
+
+void test_mmap_threshold(MmapThresholdParams params) {
+    printf("=== Test: mmap_threshold ===\n");
+    printf("Parameters: size_below=%zu, size_at=%zu, size_above=%zu\n\n",
+           params.size_below_threshold, params.size_at_threshold, params.size_above_threshold);
+    
+    printf("Allocating size below threshold (%zu bytes)...\n", params.size_below_threshold);
+    void *p1 = my_malloc(params.size_below_threshold);
+    assert(p1 != NULL);
+    memset(p1, 'A', params.size_below_threshold);
+    printf("  Success: %p\n", p1);
+    if (verbose_mode) print_memory();
+    
+    printf("Allocating size at threshold (%zu bytes)...\n", params.size_at_threshold);
+    void *p2 = my_malloc(params.size_at_threshold);
+    assert(p2 != NULL);
+    memset(p2, 'B', params.size_at_threshold);
+    printf("  Success: %p\n", p2);
+    if (verbose_mode) print_memory();
+    
+    printf("Allocating size above threshold (%zu bytes)...\n", params.size_above_threshold);
+    void *p3 = my_malloc(params.size_above_threshold);
+    assert(p3 != NULL);
+    memset(p3, 'C', params.size_above_threshold);
+    printf("  Success: %p\n", p3);
+    if (verbose_mode) print_memory();
+    
+    my_free(p1);
+    my_free(p2);
+    my_free(p3);
+    if (verbose_mode) print_memory();
+    printf("Test PASSED\n\n");
+}
+
+void test_alignment(AlignmentParams params) {
+    printf("=== Test: alignment ===\n");
+    printf("Parameters: testing %d sizes\n\n", params.num_sizes);
+    
+    void *ptrs[params.num_sizes];
+    
+    // Detect actual alignment from first allocation
+    void *test = my_malloc(1);
+    uintptr_t test_addr = (uintptr_t)test;
+    size_t actual_alignment = 1;
+    for (size_t pow = 1; pow <= 256; pow *= 2) {
+        if (test_addr % pow == 0) {
+            actual_alignment = pow;
+        }
+    }
+    my_free(test);
+    if (verbose_mode) print_memory();
+    
+    printf("Detected allocator alignment: %zu bytes\n\n", actual_alignment);
+    
+    for (int i = 0; i < params.num_sizes; i++) {
+        ptrs[i] = my_malloc(params.sizes[i]);
+        assert(ptrs[i] != NULL);
+        
+        uintptr_t addr = (uintptr_t)ptrs[i];
+        int aligned = (addr % actual_alignment == 0);
+        
+        printf("Size %zu: %p (aligned to %zu: %s)\n", params.sizes[i], ptrs[i], actual_alignment, aligned ? "YES" : "NO");
+        assert(aligned);
+        
+        memset(ptrs[i], 'A' + i, params.sizes[i]);
+    }
+    if (verbose_mode) print_memory();
+    
+    for (int i = 0; i < params.num_sizes; i++) {
+        my_free(ptrs[i]);
+    }
+    if (verbose_mode) print_memory();
+    printf("Test PASSED\n\n");
+}
+
+void test_split_reuse(SplitReuseParams params) {
+    printf("=== Test: split_reuse ===\n");
+    printf("Parameters: initial=%zu, realloc=%zu\n\n",
+           params.initial_size, params.realloc_size);
+    
+    printf("Step 1: Allocate initial block (%zu bytes)...\n", params.initial_size);
+    void *p1 = my_malloc(params.initial_size);
+    assert(p1 != NULL);
+    memset(p1, 'A', params.initial_size);
+    printf("  Allocated at %p\n", p1);
+    
+    printf("Step 2: Free the block...\n");
+    my_free(p1);
+    if (verbose_mode) print_memory();
+    
+    printf("Step 3: Allocate smaller block (%zu bytes)...\n", params.realloc_size);
+    void *p2 = my_malloc(params.realloc_size);
+    assert(p2 != NULL);
+    memset(p2, 'B', params.realloc_size);
+    printf("  Allocated at %p\n", p2);
+    
+    if (p2 == p1) {
+        printf("SUCCESS: Reuse detected (same address)\n");
+    } else {
+        printf("INFO: Different address (allocator may have different policy)\n");
+    }
+
+    if (verbose_mode) print_memory();
+    
+    my_free(p2);
+    printf("Test PASSED\n\n");
+}
+
+void test_coalescing(CoalescingParams params) {
+    printf("=== Test: coalescing ===\n");
+    printf("Parameters: block_size=%zu, num_blocks=%d, order=%d\n\n",
+           params.block_size, params.num_blocks, params.free_order);
+    
+    void *blocks[params.num_blocks];
+    
+    printf("Step 1: Allocating %d blocks of %zu bytes...\n", params.num_blocks, params.block_size);
+    for (int i = 0; i < params.num_blocks; i++) {
+        blocks[i] = my_malloc(params.block_size);
+        assert(blocks[i] != NULL);
+        memset(blocks[i], 'A' + i, params.block_size);
+        printf("  Block %d: %p\n", i, blocks[i]);
+    }
+    if (verbose_mode) print_memory();
+    
+    printf("Step 2: Freeing blocks in order %d...\n", params.free_order);
+    if (params.free_order == 0) {  // FIFO
+        for (int i = 0; i < params.num_blocks; i++) {
+            my_free(blocks[i]);
+        }
+        printf("  Freed in FIFO order\n");
+    } else if (params.free_order == 1) {  // LIFO
+        for (int i = params.num_blocks - 1; i >= 0; i--) {
+            my_free(blocks[i]);
+        }
+        printf("  Freed in LIFO order\n");
+    } else {  // Alternating
+        for (int i = 0; i < params.num_blocks; i += 2) {
+            my_free(blocks[i]);
+        }
+        for (int i = 1; i < params.num_blocks; i += 2) {
+            my_free(blocks[i]);
+        }
+        printf("  Freed in alternating order\n");
+    }
+    if (verbose_mode) print_memory();
+    
+    printf("Step 3: Allocating merged block of %zu bytes...\n", (size_t)params.block_size * params.num_blocks);
+    void *merged = my_malloc((size_t)params.block_size * params.num_blocks);
+    assert(merged != NULL);
+    memset(merged, 'Z', (size_t)params.block_size * params.num_blocks);
+    printf("  Merged block allocated at %p\n", merged);
+    
+    if (verbose_mode) print_memory();
+
+    my_free(merged);
+    printf("Test PASSED\n\n");
+}
+
+void test_fragmentation(FragmentationParams params) {
+    printf("=== Test: fragmentation ===\n");
+    printf("Parameters: large=%zu, small=%zu, medium=%zu, iterations=%d\n\n",
+           params.large_size, params.small_size, params.medium_size, params.pattern_iterations);
+    
+    void **large_blocks = malloc(sizeof(void*) * params.pattern_iterations);
+    void **small_blocks = malloc(sizeof(void*) * params.pattern_iterations);
+    
+    for (int iter = 0; iter < params.pattern_iterations; iter++) {
+        printf("Iteration %d: ", iter + 1);
+        
+        // Allocate large block
+        large_blocks[iter] = my_malloc(params.large_size);
+        assert(large_blocks[iter] != NULL);
+        memset(large_blocks[iter], 'L', params.large_size);
+        
+        // Allocate small blocks
+        small_blocks[iter] = my_malloc(params.small_size);
+        assert(small_blocks[iter] != NULL);
+        memset(small_blocks[iter], 'S', params.small_size);
+        
+        // Allocate and free medium block to create fragmentation
+        void *medium = my_malloc(params.medium_size);
+        assert(medium != NULL);
+        memset(medium, 'M', params.medium_size);
+        my_free(medium);
+        if (verbose_mode) print_memory();
+        
+        printf("Large: %p, Small: %p\n", large_blocks[iter], small_blocks[iter]);
+    }
+    
+    printf("Freeing large blocks to create fragmentation gaps...\n");
+    for (int iter = 0; iter < params.pattern_iterations; iter++) {
+        my_free(large_blocks[iter]);
+    }
+    if (verbose_mode) print_memory();
+    
+    printf("Attempting to allocate medium blocks in fragmented space...\n");
+    for (int iter = 0; iter < params.pattern_iterations; iter++) {
+        void *medium = my_malloc(params.medium_size);
+        assert(medium != NULL);
+        memset(medium, 'M', params.medium_size);
+        my_free(medium);
+    }
+    if (verbose_mode) print_memory();
+    
+    for (int iter = 0; iter < params.pattern_iterations; iter++) {
+        my_free(small_blocks[iter]);
+    }
+    if (verbose_mode) print_memory();
+    
+    free(large_blocks);
+    free(small_blocks);
+    printf("Test PASSED\n\n");
+}
+
+void test_stress_small(StressSmallParams params) {
+    printf("=== Test: stress_small ===\n");
+    printf("Parameters: size=%zu, count=%d, free_pct=%d%%\n\n",
+           params.small_alloc_size, params.num_allocations, params.free_percentage);
+    
+    void **ptrs = malloc(sizeof(void*) * params.num_allocations);
+    assert(ptrs != NULL);
+    
+    printf("Allocating %d blocks of %zu bytes...\n", params.num_allocations, params.small_alloc_size);
+    for (int i = 0; i < params.num_allocations; i++) {
+        ptrs[i] = my_malloc(params.small_alloc_size);
+        assert(ptrs[i] != NULL);
+        memset(ptrs[i], (char)('A' + (i % 26)), params.small_alloc_size);
+        
+        if ((i + 1) % 50 == 0) {
+            printf("  Allocated %d blocks\n", i + 1);
+        }
+    }
+    if (verbose_mode) print_memory();
+    
+    printf("Freeing %d%% of allocated blocks...\n", params.free_percentage);
+    int blocks_to_free = (params.num_allocations * params.free_percentage) / 100;
+    for (int i = 0; i < blocks_to_free; i++) {
+        int idx = (i * 2) % params.num_allocations;  // Free every other block
+        if (ptrs[idx] != NULL) {
+            my_free(ptrs[idx]);
+            ptrs[idx] = NULL;
+        }
+    }
+    if (verbose_mode) print_memory();
+    
+    printf("Re-allocating freed space...\n");
+    for (int i = 0; i < params.num_allocations; i++) {
+        if (ptrs[i] == NULL) {
+            ptrs[i] = my_malloc(params.small_alloc_size);
+            assert(ptrs[i] != NULL);
+            memset(ptrs[i], (char)('A' + (i % 26)), params.small_alloc_size);
+        }
+    }
+    if (verbose_mode) print_memory();
+    
+    printf("Freeing all remaining blocks...\n");
+    for (int i = 0; i < params.num_allocations; i++) {
+        if (ptrs[i] != NULL) {
+            my_free(ptrs[i]);
+        }
+    }
+    if (verbose_mode) print_memory();
+    
+    free(ptrs);
+    printf("Test PASSED\n\n");
+}
+
+void test_large_blocks(LargeBlocksParams params) {
+    printf("=== Test: large_blocks ===\n");
+    printf("Parameters: num=%d, order=%d\n\n", params.num_blocks, params.free_order);
+    
+    void **blocks = malloc(sizeof(void*) * params.num_blocks);
+    assert(blocks != NULL);
+    
+    printf("Allocating %d large blocks via mmap...\n", params.num_blocks);
+    for (int i = 0; i < params.num_blocks; i++) {
+        blocks[i] = my_malloc(params.block_sizes[i]);
+        assert(blocks[i] != NULL);
+        memset(blocks[i], 'A' + i, params.block_sizes[i]);
+        printf("  Block %d (%zu bytes): %p\n", i, params.block_sizes[i], blocks[i]);
+    }
+    if (verbose_mode) print_memory();
+    
+    printf("Freeing blocks in order %d...\n", params.free_order);
+    if (params.free_order == 0) {  // FIFO
+        for (int i = 0; i < params.num_blocks; i++) {
+            my_free(blocks[i]);
+        }
+        printf("  Freed in FIFO order\n");
+    } else if (params.free_order == 1) {  // LIFO
+        for (int i = params.num_blocks - 1; i >= 0; i--) {
+            my_free(blocks[i]);
+        }
+        printf("  Freed in LIFO order\n");
+    } else {  // Random-like pattern
+        for (int i = 0; i < params.num_blocks; i += 2) {
+            my_free(blocks[i]);
+        }
+        for (int i = 1; i < params.num_blocks; i += 2) {
+            my_free(blocks[i]);
+        }
+        printf("  Freed in random-like order\n");
+    }
+    if (verbose_mode) print_memory();
+    
+    free(blocks);
+    printf("Test PASSED\n\n");
+}
+
+#define THREADS_TEST_SLOTS 64
+
+typedef struct {
+    int id;
+    ThreadsParams params;
+    int errors;
+} ThreadsWorker;
+
+// Each worker allocates and frees blocks of random sizes in random slots.
+// Every block is filled with a pattern that depends on the worker and the slot,
+// and the pattern is checked before freeing it: if two threads get the same
+// memory, or the metadata overwrites a payload, the check fails.
+void *threads_worker(void *arg) {
+    ThreadsWorker *worker = (ThreadsWorker*)arg;
+    void *ptrs[THREADS_TEST_SLOTS] = { NULL };
+    size_t sizes[THREADS_TEST_SLOTS] = { 0 };
+    unsigned int seed = 12345u + (unsigned int)worker->id * 7919u;
+
+    for (int it = 0; it < worker->params.iterations; it++) {
+        seed = seed * 1103515245u + 12345u;
+        int slot = (seed >> 16) % THREADS_TEST_SLOTS;
+        unsigned char pattern = (unsigned char)(worker->id * THREADS_TEST_SLOTS + slot);
+
+        if (ptrs[slot] != NULL) {
+            unsigned char *bytes = (unsigned char*)ptrs[slot];
+            for (size_t b = 0; b < sizes[slot]; b++) {
+                if (bytes[b] != pattern) {
+                    worker->errors++;
+                    break;
+                }
+            }
+            my_free(ptrs[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            seed = seed * 1103515245u + 12345u;
+            sizes[slot] = 1 + (seed >> 8) % worker->params.max_size;
+            ptrs[slot] = my_malloc(sizes[slot]);
+            if (ptrs[slot] == NULL) {
+                worker->errors++;
+                continue;
+            }
+            memset(ptrs[slot], pattern, sizes[slot]);
+        }
+    }
+
+    for (int slot = 0; slot < THREADS_TEST_SLOTS; slot++) {
+        my_free(ptrs[slot]);
+    }
+    return NULL;
+}
+
+void test_threads(ThreadsParams params) {
+    printf("=== Test: threads ===\n");
+    printf("Parameters: threads=%d, iterations=%d, max_size=%zu\n\n",
+           params.num_threads, params.iterations, params.max_size);
+    
+    pthread_t *tids = malloc(sizeof(pthread_t) * params.num_threads);
+    ThreadsWorker *workers = malloc(sizeof(ThreadsWorker) * params.num_threads);
+    assert(tids != NULL && workers != NULL);
+    
+    printf("Starting %d threads...\n", params.num_threads);
+    for (int i = 0; i < params.num_threads; i++) {
+        workers[i].id = i;
+        workers[i].params = params;
+        workers[i].errors = 0;
+        assert(pthread_create(&tids[i], NULL, threads_worker, &workers[i]) == 0);
+    }
+    
+    int errors = 0;
+    for (int i = 0; i < params.num_threads; i++) {
+        pthread_join(tids[i], NULL);
+        errors += workers[i].errors;
+    }
+    if (verbose_mode) print_memory();
+    
+    printf("All threads finished, corrupted or failed allocations: %d\n", errors);
+    assert(errors == 0);
+    
+    free(tids);
+    free(workers);
+    printf("Test PASSED\n\n");
+}
+
+static volatile bool fork_test_stop = false;
+
+// Keeps allocating and freeing blocks of every kind (cache, lists, sbrk, mmap)
+// until the test asks to stop
+void *fork_worker(void *arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    void *ptrs[16] = { NULL };
+
+    while (!fork_test_stop) {
+        seed = seed * 1103515245u + 12345u;
+        int slot = (seed >> 16) % 16;
+        if (ptrs[slot] != NULL) {
+            my_free(ptrs[slot]);
+            ptrs[slot] = NULL;
+        } else {
+            size_t size = (slot == 0) ? 200 * 1024 : 1 + (seed >> 8) % 4096;
+            ptrs[slot] = my_malloc(size);
+        }
+    }
+
+    for (int slot = 0; slot < 16; slot++) {
+        my_free(ptrs[slot]);
+    }
+    return NULL;
+}
+
+void test_fork_safety(ForkSafetyParams params) {
+    printf("=== Test: fork_safety ===\n");
+    printf("Parameters: threads=%d, forks=%d\n\n", params.num_threads, params.num_forks);
+    
+    pthread_t *tids = malloc(sizeof(pthread_t) * params.num_threads);
+    assert(tids != NULL);
+    
+    fork_test_stop = false;
+    printf("Starting %d allocating threads...\n", params.num_threads);
+    for (int i = 0; i < params.num_threads; i++) {
+        assert(pthread_create(&tids[i], NULL, fork_worker, (void*)(uintptr_t)(i + 1)) == 0);
+    }
+    
+    printf("Forking %d times...\n", params.num_forks);
+    int failures = 0;
+    for (int f = 0; f < params.num_forks; f++) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        
+        if (pid == 0) {
+            // If a lock was left locked the child deadlocks: the alarm kills it
+            alarm(5);
+            void *ptrs[32];
+            for (int i = 0; i < 32; i++) {
+                size_t size = (i == 0) ? 300 * 1024 : (size_t)(i + 1) * 64;
+                ptrs[i] = my_malloc(size);
+                if (ptrs[i] == NULL) _exit(1);
+                memset(ptrs[i], 'C', size);
+            }
+            for (int i = 0; i < 32; i++) {
+                my_free(ptrs[i]);
+            }
+            _exit(0);
+        }
+        
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failures++;
+        }
+    }
+    
+    fork_test_stop = true;
+    for (int i = 0; i < params.num_threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    if (verbose_mode) print_memory();
+    
+    printf("Children that deadlocked or failed: %d\n", failures);
+    assert(failures == 0);
+    
+    free(tids);
+    printf("Test PASSED\n\n");
+}
+
+void test_ownership(OwnershipParams params) {
+    printf("=== Test: ownership ===\n");
+    printf("Parameters: small=%zu, large=%zu\n\n", params.small_size, params.large_size);
+    
+    void *small = my_malloc(params.small_size);
+    void *large = my_malloc(params.large_size);
+    assert(small != NULL && large != NULL);
+    
+    int on_stack = 0;
+    void *foreign = malloc(params.small_size);
+    assert(foreign != NULL);
+    
+    printf("Small block %p owned: %s\n", small, my_owns(small) ? "YES" : "NO");
+    assert(my_owns(small));
+    printf("Large block %p owned: %s\n", large, my_owns(large) ? "YES" : "NO");
+    assert(my_owns(large));
+    assert(my_owns((unsigned char*)large + params.large_size - 1));
+    printf("Stack variable %p owned: %s\n", (void*)&on_stack, my_owns(&on_stack) ? "YES" : "NO");
+    assert(!my_owns(&on_stack));
+    printf("libc malloc block %p owned: %s\n", foreign, my_owns(foreign) ? "YES" : "NO");
+    assert(!my_owns(foreign));
+    assert(!my_owns(NULL));
+    
+    printf("Freeing foreign pointers (they must be ignored)...\n");
+    my_free(&on_stack);
+    my_free(foreign);
+    my_free((unsigned char*)large + 64);
+    if (verbose_mode) print_memory();
+    
+    my_free(small);
+    my_free(large);
+    printf("Large block owned after free: %s\n", my_owns(large) ? "YES" : "NO");
+    assert(!my_owns(large));
+    
+    free(foreign);
+    printf("Test PASSED\n\n");
+}
+
+void test_spans(SpansParams params) {
+    printf("=== Test: spans ===\n");
+    printf("Parameters: size=%zu, num=%d\n\n", params.span_size, params.num_spans);
+    
+    void **ptrs = malloc(params.num_spans * sizeof(void*));
+    assert(ptrs != NULL);
+    
+    for (int i = 0; i < params.num_spans; i++) {
+        ptrs[i] = my_malloc(params.span_size);
+        assert(ptrs[i] != NULL);
+        // Spans start at a page boundary
+        assert(((uintptr_t)ptrs[i] & (SPAN_PAGE_SIZE - 1)) == 0);
+        assert(my_owns(ptrs[i]));
+        assert(my_owns((unsigned char*)ptrs[i] + params.span_size - 1));
+        memset(ptrs[i], i, params.span_size);
+        printf("Span %d allocated at %p\n", i, ptrs[i]);
+    }
+    
+    for (int i = 0; i < params.num_spans; i++) {
+        unsigned char *bytes = ptrs[i];
+        assert(bytes[0] == (unsigned char)i && bytes[params.span_size - 1] == (unsigned char)i);
+    }
+    
+    // Free every other span first, then the rest: the second half of the
+    // frees must merge the spans with both neighbors
+    for (int i = 0; i < params.num_spans; i += 2) my_free(ptrs[i]);
+    if (verbose_mode) print_memory();
+    for (int i = 1; i < params.num_spans; i += 2) my_free(ptrs[i]);
+    if (verbose_mode) print_memory();
+    
+    // All the pages are free again: a span as big as all the previous ones
+    // must fit in the same memory
+    size_t total = params.span_size * params.num_spans;
+    if (total < MMAP_THRESHOLD) {
+        void *big = my_malloc(total);
+        assert(big != NULL);
+        printf("Merged span of %zu bytes allocated at %p\n", total, big);
+        memset(big, 0xAB, total);
+        my_free(big);
+    }
+    
+    free(ptrs);
+    printf("Test PASSED\n\n");
+}
+
+void test_compaction(CompactionParams params) {
+    printf("=== Test: compaction ===\n");
+    printf("Parameters: size=%zu, num=%d\n\n", params.handle_size, params.num_handles);
+    
+    // A normal block must be left where it is
+    char *fixed = my_malloc(64);
+    assert(fixed != NULL);
+    strcpy(fixed, "not movable");
+    
+    Handle **handles = malloc(params.num_handles * sizeof(Handle*));
+    assert(handles != NULL);
+    
+    printf("Step 1: Allocating %d handles of %zu bytes...\n", params.num_handles, params.handle_size);
+    for (int i = 0; i < params.num_handles; i++) {
+        handles[i] = handle_alloc(params.handle_size);
+        assert(handles[i] != NULL);
+        memset(handle_deref(handles[i]), i, params.handle_size);
+    }
+    
+    printf("Step 2: Freeing every other handle to fragment the heap...\n");
+    for (int i = 0; i < params.num_handles; i += 2) {
+        handle_free(handles[i]);
+        handles[i] = NULL;
+    }
+    
+    // The first live handle is pinned: it must not move
+    Handle *pinned = handles[1];
+    void *pinned_addr = handle_pin(pinned);
+    
+    void *last_addr = handle_deref(handles[params.num_handles - 1]);
+    unsigned char *top_before = get_heap_top();
+    if (verbose_mode) print_memory();
+    
+    printf("Step 3: Compacting...\n");
+    size_t released = heap_compact();
+    unsigned char *top_after = get_heap_top();
+    printf("  heap_top: %p -> %p, released %zu bytes\n", (void*)top_before, (void*)top_after, released);
+    printf("  Last handle: %p -> %p\n", last_addr, handle_deref(handles[params.num_handles - 1]));
+    if (verbose_mode) print_memory();
+    
+    assert(top_after <= top_before);
+    assert(handle_deref(pinned) == pinned_addr);
+    assert(strcmp(fixed, "not movable") == 0);
+    
+    // The data must follow the handles
+    for (int i = 1; i < params.num_handles; i += 2) {
+        unsigned char *data = handle_deref(handles[i]);
+        assert(data[0] == (unsigned char)i && data[params.handle_size - 1] == (unsigned char)i);
+    }
+    
+    handle_unpin(pinned);
+    for (int i = 1; i < params.num_handles; i += 2) {
+        handle_free(handles[i]);
+    }
+    my_free(fixed);
+    free(handles);
+    printf("Test PASSED\n\n");
+}
+
+typedef struct PersistentNode {
+    pheap_off_t next;
+    int value;
+} PersistentNode;
+
+static PBlock* get_pblock(void *ptr) {
+    assert(ptr != NULL);
+    return (PBlock*)((unsigned char*)ptr - offsetof(PBlock, payload));
+}
+
+void test_persistent(PersistentParams params) {
+    printf("=== Test: persistent ===\n");
+    printf("Parameters: size=%zu, nodes=%d\n\n", params.heap_size, params.num_nodes);
+    
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/allocator_pheap_%d", (int)getpid());
+    unlink(path);
+    
+    PHeap heap;
+    printf("Step 1: Creating %s and building a list of %d nodes...\n", path, params.num_nodes);
+    assert(pheap_open(&heap, path, params.heap_size, NULL));
+    void *first_base = heap.base;
+    
+    // The list is linked with offsets, so it survives a different base
+    pheap_off_t head = 0;
+    for (int i = 0; i < params.num_nodes; i++) {
+        PersistentNode *node = pheap_malloc(&heap, sizeof(PersistentNode));
+        assert(node != NULL);
+        node->value = i;
+        node->next = head;
+        head = pheap_to_offset(&heap, node);
+    }
+    pheap_set_root(&heap, pheap_from_offset(&heap, head));
+    
+    // The file is locked while the heap is open
+    PHeap other;
+    assert(!pheap_open(&other, path, params.heap_size, NULL));
+    pheap_close(&heap);
+    
+    printf("Step 2: Reopening the heap...\n");
+    assert(pheap_open(&heap, path, 0, NULL));
+    printf("  Mapped at %p (first time at %p)\n", (void*)heap.base, first_base);
+    
+    int expected = params.num_nodes - 1;
+    PersistentNode *node = pheap_root(&heap);
+    while (node != NULL) {
+        assert(node->value == expected);
+        expected--;
+        PersistentNode *next = pheap_from_offset(&heap, node->next);
+        // Freeing and allocating again must reuse the same memory
+        pheap_free(&heap, node);
+        node = next;
+    }
+    assert(expected == -1);
+    printf("  All %d nodes found and freed\n", params.num_nodes);
+    
+    pheap_off_t top = heap.base->top;
+    void *big = pheap_malloc(&heap, params.num_nodes * sizeof(PersistentNode));
+    assert(big != NULL && heap.base->top == top);
+    pheap_free(&heap, big);
+    
+    printf("Step 3: A corrupted block is reported and stays allocated...\n");
+    PBlock *first = get_pblock(pheap_malloc(&heap, sizeof(PersistentNode)));
+    PBlock *second = get_pblock(pheap_malloc(&heap, sizeof(PersistentNode)));
+    // The tags don't depend on the process, so another process can read them
+    assert(first->header == (pblock_size(first) | 1));
+    pheap_free(&heap, first->payload);
+    Footer *footer = (Footer*)second - 1;
+    Footer saved_footer = *footer;
+    // The previous block would start before the data of the heap
+    *footer = pheap_to_offset(&heap, second) & SIZE_MASK;
+    pheap_free(&heap, second->payload);
+    assert(pblock_used(second));
+    // The footer doesn't match the header of the previous block
+    *footer = saved_footer + 2 * sizeof(word_t);
+    pheap_free(&heap, second->payload);
+    assert(pblock_used(second));
+    *footer = saved_footer;
+    // Misaligned
+    pheap_free(&heap, second->payload + 1);
+    assert(pblock_used(second));
+    pheap_free(&heap, second->payload);
+    assert(pheap_check(&heap));
+    
+    pheap_close(&heap);
+    unlink(path);
+    printf("Test PASSED\n\n");
+}
+
+void test_shared_heap(SharedHeapParams params) {
+    printf("=== Test: shared_heap ===\n");
+    printf("Parameters: workers=%d, allocs=%d\n\n", params.num_workers, params.num_allocs);
+    
+    char name[64];
+    snprintf(name, sizeof(name), "/allocator_sheap_%d", (int)getpid());
+    sheap_unlink(name);
+    
+    PHeap heap;
+    assert(sheap_open(&heap, name, 4 * 1024 * 1024));
+    
+    // The root is an array with the offset of the blocks allocated by every worker
+    size_t num_slots = (size_t)params.num_workers * params.num_allocs;
+    pheap_off_t *slots = pheap_malloc(&heap, num_slots * sizeof(pheap_off_t));
+    assert(slots != NULL);
+    memset(slots, 0, num_slots * sizeof(pheap_off_t));
+    pheap_set_root(&heap, slots);
+    
+    printf("Step 1: %d processes allocating in the shared heap...\n", params.num_workers);
+    for (int w = 0; w < params.num_workers; w++) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            // The worker maps the heap again, maybe at another address
+            PHeap mine;
+            if (!sheap_open(&mine, name, 0)) _exit(1);
+            pheap_off_t *my_slots = (pheap_off_t*)pheap_root(&mine) + (size_t)w * params.num_allocs;
+            for (int i = 0; i < params.num_allocs; i++) {
+                int *value = pheap_malloc(&mine, sizeof(int) * (1 + i % 16));
+                if (value == NULL) _exit(1);
+                *value = w * params.num_allocs + i;
+                my_slots[i] = pheap_to_offset(&mine, value);
+                // Free some blocks to mix free and used memory
+                if (i % 3 == 0) {
+                    pheap_free(&mine, value);
+                    my_slots[i] = 0;
+                }
+            }
+            sheap_close(&mine);
+            _exit(0);
+        }
+    }
+    
+    int failures = 0;
+    for (int w = 0; w < params.num_workers; w++) {
+        int status;
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failures++;
+    }
+    assert(failures == 0);
+    
+    for (size_t i = 0; i < num_slots; i++) {
+        if (slots[i] != 0) assert(*(int*)pheap_from_offset(&heap, slots[i]) == (int)i);
+    }
+    printf("  Every object found through its offset\n");
+    
+    printf("Step 2: A process dies while holding the lock, in the middle of a free...\n");
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        PHeap mine;
+        if (!sheap_open(&mine, name, 0)) _exit(1);
+        pheap_lock(&mine);
+        // The block is marked as free but never inserted in the lists
+        PBlock *block = (PBlock*)((unsigned char*)pheap_from_offset(&mine, ((pheap_off_t*)pheap_root(&mine))[1]) -
+                                  offsetof(PBlock, payload));
+        pblock_setup(block, pblock_size(block), false);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    slots[1] = 0;
+    
+    assert(pheap_check(&heap));
+    printf("  Recoveries: %lu\n", (unsigned long)heap.base->recoveries);
+    assert(heap.base->recoveries == 1);
+    
+    for (size_t i = 0; i < num_slots; i++) {
+        pheap_free(&heap, pheap_from_offset(&heap, slots[i]));
+    }
+    assert(pheap_check(&heap));
+    
+    printf("Step 3: The owner dies and the lock is released without recovery...\n");
+    pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        pthread_mutex_lock(&heap.base->lock);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    // Unlocking without pthread_mutex_consistent makes the lock unrecoverable
+    assert(pthread_mutex_lock(&heap.base->lock) == EOWNERDEAD);
+    pthread_mutex_unlock(&heap.base->lock);
+    assert(pheap_lock(&heap) == ENOTRECOVERABLE);
+    assert(pheap_malloc(&heap, 16) == NULL);
+    assert(!pheap_check(&heap));
+    
+    sheap_close(&heap);
+    sheap_unlink(name);
+    printf("Test PASSED\n\n");
+}
+
+void test_slabs(SlabsParams params) {
+    printf("=== Test: slabs ===\n");
+    printf("Parameters: size=%zu, count=%d\n\n", params.object_size, params.num_objects);
+    
+    set_out_of_line_metadata(true);
+    
+    void **ptrs = malloc(params.num_objects * sizeof(void*));
+    assert(ptrs != NULL);
     
-    printf("Step 1: Allocate initial block (%zu bytes)...\n", params.initial_size);
-    void *p1 = my_malloc(params.initial_size);
-    assert(p1 != NULL);
-    memset(p1, 'A', params.initial_size);
-    printf("  Allocated at %p\n", p1);
+    printf("Step 1: Allocating %d objects...\n", params.num_objects);
+    for (int i = 0; i < params.num_objects; i++) {
+        ptrs[i] = my_malloc(params.object_size);
+        assert(ptrs[i] != NULL);
+        assert(((uintptr_t)ptrs[i] & 15) == 0);
+        assert(my_owns(ptrs[i]));
+        memset(ptrs[i], i & 0xFF, params.object_size);
+    }
     
-    printf("Step 2: Free the block...\n");
-    my_free(p1);
+    // No header between two objects: the second one starts right after the first one
+    size_t distance = (unsigned char*)ptrs[1] - (unsigned char*)ptrs[0];
+    printf("  Distance between two objects: %zu bytes\n", distance);
+    assert(distance == (size_t)slab_class_sizes[slab_class_index(align(params.object_size))]);
     if (verbose_mode) print_memory();
     
-    printf("Step 3: Allocate smaller block (%zu bytes)...\n", params.realloc_size);
-    void *p2 = my_malloc(params.realloc_size);
-    assert(p2 != NULL);
-    memset(p2, 'B', params.realloc_size);
-    printf("  Allocated at %p\n", p2);
+    for (int i = 0; i < params.num_objects; i++) {
+        unsigned char *bytes = ptrs[i];
+        assert(bytes[0] == (i & 0xFF) && bytes[params.object_size - 1] == (i & 0xFF));
+    }
+    
+    printf("Step 2: Freeing half of the objects, and one of them twice...\n");
+    for (int i = 0; i < params.num_objects; i += 2) {
+        my_free(ptrs[i]);
+        assert(!my_owns(ptrs[i]));
+    }
+    // The double free is reported and ignored
+    my_free(ptrs[0]);
+    
+    printf("Step 3: Allocating again in the free slots...\n");
+    for (int i = 0; i < params.num_objects; i += 2) {
+        ptrs[i] = my_malloc(params.object_size);
+        assert(ptrs[i] != NULL && my_owns(ptrs[i]));
+    }
+    
+    for (int i = 0; i < params.num_objects; i++) {
+        my_free(ptrs[i]);
+    }
+    
+    set_out_of_line_metadata(false);
+    free(ptrs);
+    printf("Test PASSED\n\n");
+}
+
+typedef struct {
+    size_t block_size;
+    int iterations;
+    size_t popped;
+} FastListsWorker;
+
+static void* fast_lists_worker(void *arg) {
+    FastListsWorker *w = arg;
+    Block *mine[8];
+    int held = 0;
+    
+    // Pop a few blocks and push them back, so the head keeps changing
+    for (int i = 0; i < w->iterations; i++) {
+        if (held < 8 && (i % 3 != 2 || held == 0)) {
+            Block *b = fast_pop(w->block_size);
+            if (b != NULL) {
+                mine[held++] = b;
+                w->popped++;
+            }
+        } else {
+            fast_push(mine[--held]);
+        }
+    }
+    while (held > 0) fast_push(mine[--held]);
+    return NULL;
+}
+
+void test_fast_lists(FastListsParams params) {
+    printf("=== Test: fast_lists ===\n");
+    printf("Parameters: threads=%d, blocks=%d, iterations=%d\n\n",
+           params.num_threads, params.num_blocks, params.iterations);
+    
+    assert(params.num_blocks > 0);
+    size_t payload = 40;
+    void **ptrs = malloc(params.num_blocks * sizeof(void*));
+    assert(ptrs != NULL);
+    for (int i = 0; i < params.num_blocks; i++) {
+        ptrs[i] = my_malloc(payload);
+        assert(ptrs[i] != NULL);
+    }
+    size_t block_size = get_size(get_block_from_payload(ptrs[0]));
+    int idx = fast_list_index(block_size);
+    
+    // A block reused from the heap may be a bit bigger than needed (it's not split
+    // if the rest is too small): only the blocks of the same size go in the list
+    int pushed = 0;
+    for (int i = 0; i < params.num_blocks; i++) {
+        if (get_size(get_block_from_payload(ptrs[i])) != block_size) {
+            my_free(ptrs[i]);
+            ptrs[i] = NULL;
+            continue;
+        }
+        assert(fast_push(get_block_from_payload(ptrs[i])));
+        pushed++;
+    }
+    printf("Step 1: Pushed %d blocks of %zu bytes\n", pushed, block_size);
+    
+    // LIFO: the last block pushed is the first one popped
+    Block *last = fast_pop(block_size);
+    assert(last != NULL && get_size(last) == block_size);
+    fast_push(last);
+    assert(fast_pop(block_size) == last);
+    fast_push(last);
+    
+    printf("Step 2: %d threads popping and pushing concurrently...\n", params.num_threads);
+    pthread_t *tids = malloc(params.num_threads * sizeof(pthread_t));
+    FastListsWorker *workers = calloc(params.num_threads, sizeof(FastListsWorker));
+    assert(tids != NULL && workers != NULL);
+    for (int t = 0; t < params.num_threads; t++) {
+        workers[t].block_size = block_size;
+        workers[t].iterations = params.iterations;
+        assert(pthread_create(&tids[t], NULL, fast_lists_worker, &workers[t]) == 0);
+    }
+    size_t popped = 0;
+    for (int t = 0; t < params.num_threads; t++) {
+        pthread_join(tids[t], NULL);
+        popped += workers[t].popped;
+    }
+    printf("  Pops: %zu\n", popped);
+    
+    // No block was lost or duplicated: each one is found exactly once
+    int count = 0;
+    Block *chain = fast_detach(idx);
+    for (Block *b = chain; b != NULL; b = get_next_free(b)) {
+        int found = 0;
+        for (int i = 0; i < params.num_blocks; i++) {
+            if (ptrs[i] != NULL && b == get_block_from_payload(ptrs[i])) found++;
+        }
+        assert(found == 1);
+        assert(is_used(b));
+        count++;
+    }
+    printf("  Blocks in the list at the end: %d\n", count);
+    assert(count == pushed);
+    
+    printf("Step 3: Consolidating...\n");
+    for (Block *b = chain; b != NULL; ) {
+        Block *next = get_next_free(b);
+        fast_push(b);
+        b = next;
+    }
+    assert(fast_consolidate());
+    assert(fast_detach(idx) == NULL);
+    
+    free(tids);
+    free(workers);
+    free(ptrs);
+    printf("Test PASSED\n\n");
+}
+
+// Free every other block (the ones in between keep them from merging) in the given
+// order, then time the allocation of the same number of blocks from the list
+static double prefetch_round(void **blocks, const int *order, PrefetchParams params) {
+    for (int i = 0; i < params.num_blocks; i++) {
+        my_free(blocks[2 * order[i]]);
+    }
+    
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < params.num_blocks; i++) {
+        blocks[2 * i] = my_malloc(params.block_size);
+        assert(blocks[2 * i] != NULL);
+        *(int*)blocks[2 * i] = i;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    for (int i = 0; i < params.num_blocks; i++) {
+        assert(*(int*)blocks[2 * i] == i);
+    }
+    return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+void test_prefetch(PrefetchParams params) {
+    printf("=== Test: prefetch ===\n");
+    printf("Parameters: size=%zu, count=%d, rounds=%d\n\n",
+           params.block_size, params.num_blocks, params.rounds);
+    
+    void **blocks = malloc(2 * params.num_blocks * sizeof(void*));
+    assert(blocks != NULL);
+    for (int i = 0; i < 2 * params.num_blocks; i++) {
+        blocks[i] = my_malloc(params.block_size);
+        assert(blocks[i] != NULL);
+        *(int*)blocks[i] = i;
+    }
+    
+    // LIFO and FIFO leave the list in address order, which the hardware prefetcher
+    // can follow by itself; in random order every link is a miss
+    int *orders[3];
+    for (int p = 0; p < 3; p++) {
+        orders[p] = malloc(params.num_blocks * sizeof(int));
+        assert(orders[p] != NULL);
+        for (int i = 0; i < params.num_blocks; i++) {
+            orders[p][i] = (p == 0) ? params.num_blocks - 1 - i : i;
+        }
+    }
+    srand(42);
+    for (int i = params.num_blocks - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int tmp = orders[2][i];
+        orders[2][i] = orders[2][j];
+        orders[2][j] = tmp;
+    }
+    
+    printf("Step 1: Timing %d allocations from the free lists (best of %d rounds)...\n",
+           params.num_blocks, params.rounds);
+    const char *patterns[] = { "LIFO", "FIFO", "Random" };
+    for (int p = 0; p < 3; p++) {
+        double best[2] = { 1e30, 1e30 };
+        // The two modes are alternated, so they see the same state of the heap
+        for (int r = 0; r < params.rounds; r++) {
+            for (int mode = 0; mode < 2; mode++) {
+                set_prefetch(mode == 1);
+                double ms = prefetch_round(blocks, orders[p], params);
+                if (ms < best[mode]) best[mode] = ms;
+            }
+        }
+        printf("  %-6s: without prefetch %.3f ms, with prefetch %.3f ms (%.1f%%)\n",
+               patterns[p], best[0], best[1], 100.0 * (best[0] - best[1]) / best[0]);
+        free(orders[p]);
+    }
+    set_prefetch(true);
+    
+    // The blocks in between must not have been touched
+    for (int i = 1; i < 2 * params.num_blocks; i += 2) {
+        assert(*(int*)blocks[i] == i);
+    }
+    for (int i = 0; i < 2 * params.num_blocks; i++) {
+        my_free(blocks[i]);
+    }
+    free(blocks);
+    
+    printf("Test PASSED\n\n");
+}
+
+// Run the bad access in a child with stderr redirected to a pipe: the child must
+// die with SIGSEGV and the report must contain the expected kind of error
+static void guarded_expect_fault(size_t size, bool use_after_free, const char *expected) {
+    int fds[2];
+    assert(pipe(fds) == 0);
+    
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDERR_FILENO);
+        set_guarded_sample_rate(1);
+        volatile unsigned char *ptr = my_malloc(size);
+        if (use_after_free) {
+            my_free((void*)ptr);
+            ptr[0] = 1;
+        } else {
+            // The object is at the start or at the end of its page: writing up to
+            // a page after its start always reaches a guard page
+            for (long i = 0; i <= get_page_size(); i++) ptr[i] = 1;
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    
+    char report[8192];
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(fds[0], report + len, sizeof(report) - 1 - len)) > 0) len += (size_t)n;
+    report[len] = '\0';
+    close(fds[0]);
+    
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+    assert(strstr(report, expected) != NULL);
+    assert(strstr(report, "allocated at") != NULL);
+    printf("  Child killed by SIGSEGV, report: %s\n", expected);
+}
+
+void test_guarded(GuardedParams params) {
+    printf("=== Test: guarded ===\n");
+    printf("Parameters: size=%zu, count=%d\n\n", params.object_size, params.num_objects);
+    
+    long page_size = get_page_size();
+    set_guarded_sample_rate(1);
+    
+    printf("Step 1: Allocating a sampled object...\n");
+    unsigned char *obj = my_malloc(params.object_size);
+    assert(obj != NULL);
+    assert(page_map_kind(page_map_get(obj)) == PAGE_KIND_GUARDED);
+    assert(((uintptr_t)obj & 15) == 0);
+    assert(my_owns(obj) && my_owns(obj + params.object_size - 1));
+    // At the start of the page, or ending at the end of the page
+    size_t aligned_size = (params.object_size + 15) & ~(size_t)15;
+    assert((uintptr_t)obj % page_size == 0 || ((uintptr_t)obj + aligned_size) % page_size == 0);
+    memset(obj, 0xAB, params.object_size);
+    
+    printf("Step 2: Filling the pool with %d objects...\n", params.num_objects);
+    void **ptrs = malloc(params.num_objects * sizeof(void*));
+    assert(ptrs != NULL);
+    int guarded = 0;
+    for (int i = 0; i < params.num_objects; i++) {
+        ptrs[i] = my_malloc(params.object_size);
+        assert(ptrs[i] != NULL);
+        if (page_map_kind(page_map_get(ptrs[i])) == PAGE_KIND_GUARDED) guarded++;
+        memset(ptrs[i], i & 0xFF, params.object_size);
+    }
+    printf("  %d sampled, the others served as usual when the pool is full\n", guarded);
+    assert(guarded <= GUARDED_NUM_SLOTS - 1);
+    for (int i = 0; i < params.num_objects; i++) {
+        my_free(ptrs[i]);
+    }
+    free(ptrs);
+    
+    printf("Step 3: Freeing it, the slot must not be reused right away...\n");
+    uintptr_t obj_page = (uintptr_t)obj & ~(uintptr_t)(page_size - 1);
+    my_free(obj);
+    assert(!my_owns(obj));
+    void *next = my_malloc(params.object_size);
+    assert(((uintptr_t)next & ~(uintptr_t)(page_size - 1)) != obj_page);
+    my_free(next);
+    
+    printf("Step 4: Double free (must be reported and ignored)...\n");
+    my_free(obj);
+    set_guarded_sample_rate(0);
+    
+    printf("Step 5: Bad accesses in child processes...\n");
+    guarded_expect_fault(params.object_size, false, "heap-buffer-overflow");
+    guarded_expect_fault(params.object_size, true, "use-after-free");
+    
+    printf("Test PASSED\n\n");
+}
+
+// Overwrite the header of a block in a child process, then run the given operation:
+// the child must be aborted with the report of the corrupted header
+static void header_checks_expect_abort(size_t size, bool on_free) {
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        unsigned char *ptr = my_malloc(size);
+        Block *block = get_block_from_payload(ptr);
+        if (on_free) {
+            // An underflow that writes a plausible size on the header
+            block->header += 16;
+            my_free(ptr);
+        } else {
+            // An overflow from the previous block, on the block just inserted in
+            // a free list (it may have been merged with its neighbors)
+            my_free(ptr);
+            Block *head = segregatedLists[get_list_index(get_size(block))].head;
+            memset((unsigned char*)head, 0x41, sizeof(size_t));
+            for (int i = 0; i < 64; i++) my_malloc(size);
+        }
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+void test_header_checks(HeaderChecksParams params) {
+    printf("=== Test: header_checks ===\n");
+    printf("Parameters: size=%zu, count=%d\n\n", params.block_size, params.num_blocks);
+    
+    set_header_checks(true);
+    
+    printf("Step 1: Allocating and freeing %d blocks with the checks enabled...\n", params.num_blocks);
+    void **ptrs = malloc(params.num_blocks * sizeof(void*));
+    assert(ptrs != NULL);
+    for (int i = 0; i < params.num_blocks; i++) {
+        ptrs[i] = my_malloc(params.block_size + (size_t)(i % 8) * 8);
+        assert(ptrs[i] != NULL);
+        Block *block = get_block_from_payload(ptrs[i]);
+        assert(header_valid(block) && is_used(block) && !(block->header & CACHED_FLAG));
+        assert(*get_footer(block) == block->header);
+    }
+    for (int i = 0; i < params.num_blocks; i += 2) my_free(ptrs[i]);
+    for (int i = 0; i < params.num_blocks; i += 2) {
+        ptrs[i] = my_malloc(params.block_size);
+        assert(header_valid(get_block_from_payload(ptrs[i])));
+    }
+    
+    printf("Step 2: Double frees (must be reported and ignored)...\n");
+    // The block goes in a per-cpu cache or in a fast list
+    void *small = ptrs[0];
+    my_free(small);
+    my_free(small);
+    void *again = my_malloc(params.block_size);
+    void *other = my_malloc(params.block_size);
+    assert(again != other);
+    // A block that goes straight back to the segregated lists
+    void *big = my_malloc(2048);
+    void *guard = my_malloc(16);
+    my_free(big);
+    my_free(big);
+    ptrs[0] = again;
+    my_free(other);
+    my_free(guard);
+    
+    for (int i = 0; i < params.num_blocks; i++) my_free(ptrs[i]);
+    free(ptrs);
+    
+    printf("Step 3: Corrupted headers in child processes (must abort)...\n");
+    header_checks_expect_abort(params.block_size, true);
+    printf("  Corrupted header caught by my_free\n");
+    header_checks_expect_abort(2048, false);
+    printf("  Corrupted header caught by a free list pop\n");
+    
+    set_header_checks(false);
+    
+    printf("Test PASSED\n\n");
+}
+
+void test_safe_linking(SafeLinkingParams params) {
+    printf("=== Test: safe_linking ===\n");
+    printf("Parameters: size=%zu, count=%d\n\n", params.block_size, params.num_blocks);
+    
+    // Every other block is freed, so the free ones don't merge and stay linked
+    printf("Step 1: Freeing %d blocks of %zu bytes...\n", params.num_blocks, params.block_size);
+    void **ptrs = malloc(2 * params.num_blocks * sizeof(void*));
+    assert(ptrs != NULL);
+    for (int i = 0; i < 2 * params.num_blocks; i++) {
+        ptrs[i] = my_malloc(params.block_size);
+        assert(ptrs[i] != NULL);
+    }
+    for (int i = 0; i < 2 * params.num_blocks; i += 2) {
+        my_free(ptrs[i]);
+    }
+    
+    printf("Step 2: Checking that the stored links are not plain pointers...\n");
+    int linked = 0;
+    for (int i = 2; i < 2 * params.num_blocks; i += 2) {
+        Block *block = get_block_from_payload(ptrs[i]);
+        Block *next = get_next_free(block);
+        if (next != get_block_from_payload(ptrs[i - 2])) continue;
+        linked++;
+#ifdef COMPRESSED_LINKS
+        assert(block->next_link != encode_link(next));
+#else
+        assert(block->next_free != next);
+#endif
+    }
+    printf("  %d links checked\n", linked);
+    assert(linked > 0);
+    
+#ifndef COMPRESSED_LINKS
+    printf("Step 3: Forging a link after free in a child process (must abort)...\n");
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        // A use after free that writes a plain pointer where the link is
+        Block *head = get_block_from_payload(ptrs[2 * params.num_blocks - 2]);
+        head->next_free = get_block_from_payload(ptrs[1]);
+        for (int i = 0; i < params.num_blocks; i++) my_malloc(params.block_size);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    printf("  Forged link caught\n");
+#endif
+    
+    for (int i = 0; i < 2 * params.num_blocks; i += 2) {
+        ptrs[i] = my_malloc(params.block_size);
+        assert(ptrs[i] != NULL);
+    }
+    for (int i = 0; i < 2 * params.num_blocks; i++) {
+        my_free(ptrs[i]);
+    }
+    free(ptrs);
+    
+    printf("Test PASSED\n\n");
+}
+
+void test_quarantine(QuarantineParams params) {
+    printf("=== Test: quarantine ===\n");
+    printf("Parameters: size=%zu, budget=%zu, count=%d\n\n",
+           params.block_size, params.budget, params.num_blocks);
+    
+    set_quarantine(params.budget, true);
+    
+    printf("Step 1: A freed block is not reused while it's in quarantine...\n");
+    unsigned char *ptr = my_malloc(params.block_size);
+    assert(ptr != NULL);
+    memset(ptr, 0x11, params.block_size);
+    my_free(ptr);
+    // The poison covers the payload after the link
+    for (size_t i = sizeof(word_t); i < params.block_size; i++) {
+        assert(ptr[i] == QUARANTINE_POISON);
+    }
+    void *again = my_malloc(params.block_size);
+    assert(again != ptr);
+    my_free(again);
+    
+    printf("Step 2: Freeing %d blocks, the quarantine stays within the budget...\n", params.num_blocks);
+    void **ptrs = malloc(params.num_blocks * sizeof(void*));
+    assert(ptrs != NULL);
+    for (int i = 0; i < params.num_blocks; i++) {
+        ptrs[i] = my_malloc(params.block_size + (size_t)(i % 4) * 32);
+        assert(ptrs[i] != NULL);
+    }
+    size_t peak = 0;
+    for (int i = 0; i < params.num_blocks; i++) {
+        my_free(ptrs[i]);
+        assert(quarantine_bytes <= params.budget);
+        if (quarantine_bytes > peak) peak = quarantine_bytes;
+    }
+    printf("  Peak: %zu bytes in quarantine\n", peak);
+    assert(peak > params.budget / 2);
+    free(ptrs);
+    
+    printf("Step 3: A write after free is reported when the block leaves the quarantine...\n");
+    size_t corruptions = quarantine_corruptions;
+    unsigned char *victim = my_malloc(params.block_size);
+    my_free(victim);
+    victim[params.block_size / 2] = 0x42;
+    // Disabling the quarantine frees all its blocks
+    set_quarantine(0, true);
+    assert(quarantine_bytes == 0 && quarantine_head == NULL);
+    assert(quarantine_corruptions == corruptions + 1);
+    
+    printf("Test PASSED\n\n");
+}
+
+// Every block of the test is allocated here, so they all have the same site
+__attribute__((noinline))
+static void* leak_test_alloc(int i, size_t size) {
+    // Heap blocks, spans and mmap blocks
+    size_t sizes[] = { size, SPAN_THRESHOLD, MMAP_THRESHOLD };
+    return my_malloc(sizes[i % 3]);
+}
+
+void test_leak_report(LeakReportParams params) {
+    printf("=== Test: leak_report ===\n");
+    printf("Parameters: size=%zu, count=%d\n\n", params.block_size, params.num_blocks);
+    
+    FILE *out = tmpfile();
+    assert(out != NULL);
+    
+    printf("Step 1: Counting the blocks left by the previous tests...\n");
+    size_t before = my_leak_report(out);
+    printf("  %zu blocks still allocated\n", before);
+    
+    printf("Step 2: Allocating %d sampled blocks and freeing half of them...\n", params.num_blocks);
+    set_leak_sample_rate(1);
+    void **ptrs = malloc(params.num_blocks * sizeof(void*));
+    assert(ptrs != NULL);
+    for (int i = 0; i < params.num_blocks; i++) {
+        ptrs[i] = leak_test_alloc(i, params.block_size);
+        assert(ptrs[i] != NULL);
+    }
+    int kept = 0;
+    for (int i = 0; i < params.num_blocks; i++) {
+        if (i % 2 == 0) my_free(ptrs[i]);
+        else kept++;
+    }
+    set_leak_sample_rate(0);
+    
+    printf("Step 3: The blocks still allocated are found and grouped by site...\n");
+    rewind(out);
+    size_t after = my_leak_report(out);
+    printf("  %zu blocks still allocated\n", after);
+    assert(after == before + (size_t)kept);
+    
+    // A single site (leak_test_alloc) holds all the blocks that were kept
+    LeakSite *top = NULL;
+    for (int i = 0; i < LEAK_NUM_SITES; i++) {
+        if (top == NULL || leak_sites[i].leaked_blocks > top->leaked_blocks) top = &leak_sites[i];
+    }
+    assert(top->leaked_blocks == (size_t)kept);
+    assert(top->leaked_bytes >= (size_t)kept * params.block_size);
+    fflush(out);
+    rewind(out);
+    char line[256];
+    bool found = false;
+    while (fgets(line, sizeof(line), out) != NULL) {
+        if (strstr(line, "sampled blocks") != NULL && strstr(line, "allocated at") != NULL) found = true;
+        if (verbose_mode) printf("  %s", line);
+    }
+    assert(found);
+    
+    printf("Step 4: Freeing the rest, the sampled blocks are forgotten...\n");
+    for (int i = 1; i < params.num_blocks; i += 2) {
+        my_free(ptrs[i]);
+    }
+    assert(leak_num_entries == 0);
+    assert(my_leak_report(out) == before);
+    
+    printf("Step 5: Sampled blocks of every kind are forgotten, the others skip the table...\n");
+    size_t sizes[] = { 48, SPAN_THRESHOLD, get_mmap_threshold() };
+    void *kinds[4];
+    set_leak_sample_rate(1);
+    for (int i = 0; i < 3; i++) {
+        kinds[i] = my_malloc(sizes[i]);
+        assert(kinds[i] != NULL);
+    }
+    set_out_of_line_metadata(true);
+    kinds[3] = my_malloc(32);
+    set_out_of_line_metadata(false);
+    set_leak_sample_rate(0);
+    assert(page_map_kind(page_map_get(kinds[1])) == PAGE_KIND_SPAN);
+    assert(page_map_kind(page_map_get(kinds[2])) == PAGE_KIND_MMAP);
+    assert(page_map_kind(page_map_get(kinds[3])) == PAGE_KIND_SPAN);
+    assert(leak_num_entries == 4);
+    for (int i = 0; i < 4; i++) {
+        my_free(kinds[i]);
+    }
+    assert(leak_num_entries == 0);
+    
+    // The frees of blocks that were not sampled never take the lock of the table:
+    // holding it here would deadlock them otherwise
+    for (int i = 0; i < 3; i++) {
+        kinds[i] = my_malloc(sizes[i]);
+        assert(kinds[i] != NULL);
+    }
+    pthread_mutex_lock(&leak_lock);
+    for (int i = 0; i < 3; i++) {
+        my_free(kinds[i]);
+    }
+    pthread_mutex_unlock(&leak_lock);
+    
+    free(ptrs);
+    fclose(out);
+    
+    printf("Test PASSED\n\n");
+}
+
+void test_config(ConfigParams params) {
+    printf("=== Test: config ===\n");
+    printf("Parameters: threshold=%zu, count=%d\n\n", params.threshold, params.num_blocks);
+    
+    printf("Step 1: Applying a configuration string...\n");
+    char conf[128];
+    snprintf(conf, sizeof(conf), "mmap_threshold:%zu,cache_bin_bytes:4k,stats:true", params.threshold);
+    assert(my_malloc_config(conf));
+    assert(get_mmap_threshold() == params.threshold);
+    assert(cache_bin_bytes == 4096);
+    assert(stats_enabled());
+    
+    printf("Step 2: The mmap threshold is used by my_malloc...\n");
+    void *below = my_malloc(params.threshold - 64);
+    void *above = my_malloc(params.threshold);
+    assert(page_map_kind(page_map_get(below)) != PAGE_KIND_MMAP);
+    assert(page_map_kind(page_map_get(above)) == PAGE_KIND_MMAP);
+    assert(my_usable_size(below) >= params.threshold - 64);
+    assert(my_usable_size(above) >= params.threshold);
+    my_free(below);
+    my_free(above);
+    
+    printf("Step 3: Invalid options are rejected...\n");
+    assert(!my_malloc_config("no_such_option:1"));
+    assert(!my_malloc_config("mmap_threshold:lots"));
+    assert(!my_malloc_config("stats"));
+    // Sizes that don't fit in 64 bits, with and without the suffix
+    assert(!my_malloc_config("mmap_threshold:17179869184g"));
+    assert(!my_malloc_config("mmap_threshold:18446744073709551616"));
+    assert(get_mmap_threshold() == params.threshold);
+    
+    printf("Step 4: Statistics count %d allocations by size class...\n", params.num_blocks);
+    size_t allocated = alloc_stats.allocated;
+    size_t nmalloc[STATS_NUM_CLASSES], nfree[STATS_NUM_CLASSES];
+    for (int c = 0; c < STATS_NUM_CLASSES; c++) {
+        nmalloc[c] = size_class_stats[c].nmalloc;
+        nfree[c] = size_class_stats[c].nfree;
+    }
+    void **ptrs = malloc(params.num_blocks * sizeof(void*));
+    assert(ptrs != NULL);
+    size_t expected = 0;
+    for (int i = 0; i < params.num_blocks; i++) {
+        ptrs[i] = my_malloc(16 + (size_t)(i % 64) * 16);
+        assert(ptrs[i] != NULL);
+        expected += my_usable_size(ptrs[i]);
+    }
+    assert(alloc_stats.allocated == allocated + expected);
+    assert(alloc_stats.peak >= alloc_stats.allocated);
+    for (int i = 0; i < params.num_blocks; i++) {
+        my_free(ptrs[i]);
+    }
+    assert(alloc_stats.allocated == allocated);
+    size_t new_mallocs = 0, new_frees = 0;
+    for (int c = 0; c < STATS_NUM_CLASSES; c++) {
+        new_mallocs += size_class_stats[c].nmalloc - nmalloc[c];
+        new_frees += size_class_stats[c].nfree - nfree[c];
+    }
+    assert(new_mallocs == (size_t)params.num_blocks && new_frees == (size_t)params.num_blocks);
+    if (verbose_mode) my_malloc_stats_print(stdout);
+    free(ptrs);
+    
+    // Back to the defaults for the other tests
+    char defaults[128];
+    snprintf(defaults, sizeof(defaults), "mmap_threshold:%d,cache_bin_bytes:%d,stats:false",
+             MMAP_THRESHOLD, CACHE_BIN_BYTES);
+    assert(my_malloc_config(defaults));
+    
+    printf("Test PASSED\n\n");
+}
+
+void test_mallctl(MallctlParams params) {
+    printf("=== Test: mallctl ===\n");
+    printf("Parameters: size=%zu, count=%d\n\n", params.span_size, params.num_blocks);
+    
+    printf("Step 1: Reading and writing an option...\n");
+    size_t current = get_mmap_threshold();
+    size_t old_threshold, new_threshold = 2 * current, len = sizeof(size_t);
+    assert(my_mallctl("opt.mmap_threshold", &old_threshold, &len, &new_threshold, sizeof(new_threshold)) == 0);
+    assert(old_threshold == current);
+    assert(get_mmap_threshold() == new_threshold);
+    size_t zero = 0;
+    assert(my_mallctl("opt.mmap_threshold", NULL, NULL, &zero, sizeof(zero)) == EINVAL);
+    assert(my_mallctl("opt.mmap_threshold", NULL, NULL, &old_threshold, sizeof(old_threshold)) == 0);
+    assert(get_mmap_threshold() == old_threshold);
+    
+    printf("Step 2: Errors for wrong names, sizes and writes...\n");
+    int small;
+    len = sizeof(small);
+    assert(my_mallctl("opt.no_such_option", NULL, NULL, NULL, 0) == ENOENT);
+    assert(my_mallctl("stats.size_class.99.nmalloc", NULL, NULL, NULL, 0) == ENOENT);
+    assert(my_mallctl("stats.allocated", &small, &len, NULL, 0) == EINVAL);
+    assert(my_mallctl("stats.allocated", NULL, NULL, &zero, sizeof(zero)) == EPERM);
+    // Actions take no new value, and aren't triggered when one is given
+    size_t peak_before = alloc_stats.peak;
+    assert(my_mallctl("stats.reset_peak", NULL, NULL, &zero, sizeof(zero)) == EINVAL);
+    assert(alloc_stats.peak == peak_before);
+    assert(my_mallctl("heap.trim", NULL, NULL, &zero, sizeof(zero)) == EINVAL);
+    assert(my_mallctl("cache.flush", NULL, NULL, &zero, sizeof(zero)) == EINVAL);
+    assert(my_mallctl("arenas.0.purge", NULL, NULL, &zero, sizeof(zero)) == EINVAL);
+    assert(my_mallctl("heap.trim", &small, &len, NULL, 0) == EINVAL);
+    
+    printf("Step 3: Counters of %d allocations...\n", params.num_blocks);
+    bool on = true, was_on;
+    len = sizeof(bool);
+    assert(my_mallctl("opt.stats", &was_on, &len, &on, sizeof(on)) == 0);
+    assert(stats_enabled());
+    assert(my_mallctl("stats.reset_peak", NULL, NULL, NULL, 0) == 0);
+    
+    size_t before, after, peak, nmalloc_before, nmalloc_after;
+    len = sizeof(size_t);
+    int cls = stats_class(params.span_size);
+    char name[64];
+    snprintf(name, sizeof(name), "stats.size_class.%d.nmalloc", cls);
+    assert(my_mallctl("stats.allocated", &before, &len, NULL, 0) == 0);
+    assert(my_mallctl(name, &nmalloc_before, &len, NULL, 0) == 0);
+    
+    void **ptrs = malloc(params.num_blocks * sizeof(void*));
+    assert(ptrs != NULL);
+    size_t expected = 0;
+    for (int i = 0; i < params.num_blocks; i++) {
+        ptrs[i] = my_malloc(params.span_size);
+        assert(ptrs[i] != NULL);
+        expected += my_usable_size(ptrs[i]);
+    }
+    assert(my_mallctl("stats.allocated", &after, &len, NULL, 0) == 0);
+    assert(my_mallctl("stats.peak", &peak, &len, NULL, 0) == 0);
+    assert(my_mallctl(name, &nmalloc_after, &len, NULL, 0) == 0);
+    assert(after == before + expected && peak == after);
+    assert(nmalloc_after - nmalloc_before >= (size_t)params.num_blocks);
+    
+    printf("Step 4: Purging the page heaps...\n");
+    unsigned int arenas;
+    len = sizeof(arenas);
+    assert(my_mallctl("arenas.count", &arenas, &len, NULL, 0) == 0 && arenas >= 1);
+    for (int i = 0; i < params.num_blocks; i++) {
+        my_free(ptrs[i]);
+    }
+    assert(my_mallctl("cache.flush", NULL, NULL, NULL, 0) == 0);
+    len = sizeof(size_t);
+    size_t mapped = 0, released = 0;
+    for (unsigned int a = 0; a < arenas; a++) {
+        size_t bytes, again;
+        snprintf(name, sizeof(name), "arenas.%u.mapped", a);
+        assert(my_mallctl(name, &bytes, &len, NULL, 0) == 0);
+        mapped += bytes;
+        snprintf(name, sizeof(name), "arenas.%u.purge", a);
+        assert(my_mallctl(name, &bytes, &len, NULL, 0) == 0);
+        released += bytes;
+        // Nothing is left to release
+        assert(my_mallctl(name, &again, &len, NULL, 0) == 0 && again == 0);
+    }
+    if (params.span_size >= SPAN_THRESHOLD && params.span_size < get_mmap_threshold()) {
+        assert(mapped >= expected);
+    }
+    printf("  Mapped by the page heaps: %zu bytes, purged: %zu bytes\n", mapped, released);
+    
+    printf("Step 5: Heap counters and trim...\n");
+    size_t heap_size, list_bytes = 0, trimmed;
+    assert(my_mallctl("heap.size", &heap_size, &len, NULL, 0) == 0 && heap_size > 0);
+    for (int i = 0; i < NUM_LISTS; i++) {
+        size_t bytes;
+        snprintf(name, sizeof(name), "heap.lists.%d.bytes", i);
+        assert(my_mallctl(name, &bytes, &len, NULL, 0) == 0);
+        list_bytes += bytes;
+    }
+    assert(list_bytes <= heap_size);
+    assert(my_mallctl("heap.trim", &trimmed, &len, NULL, 0) == 0);
+    printf("  Heap: %zu bytes, free in the lists: %zu bytes, trimmed: %zu bytes\n",
+           heap_size, list_bytes, trimmed);
+    
+    assert(my_mallctl("opt.stats", NULL, NULL, &was_on, sizeof(was_on)) == 0);
+    free(ptrs);
+    
+    printf("Test PASSED\n\n");
+}
+
+// Replace a file of the fake cgroup at once, as the kernel does
+static void write_cgroup_file(const char *dir, const char *name, const char *content) {
+    char path[256], tmp[256];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    snprintf(tmp, sizeof(tmp), "%s/.%s", dir, name);
+    FILE *file = fopen(tmp, "w");
+    assert(file != NULL);
+    fputs(content, file);
+    fclose(file);
+    assert(rename(tmp, path) == 0);
+}
+
+// Wait until the monitor has done more than trims trims (at most 2 seconds)
+static bool wait_monitor_trims(size_t trims) {
+    for (int i = 0; i < 2000; i++) {
+        if (__atomic_load_n(&memory_monitor.trims, __ATOMIC_RELAXED) > trims) return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+void test_memory_monitor(MemoryMonitorParams params) {
+    printf("=== Test: memory_monitor ===\n");
+    printf("Parameters: interval=%d, percent=%d\n\n", params.interval_ms, params.percent);
+    
+    char dir[] = "/tmp/cgroup_testXXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    const char *no_pressure = "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"
+                              "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+    char value[64];
+    size_t limit = (size_t)1 << 30;
+    snprintf(value, sizeof(value), "%zu\n", limit);
+    write_cgroup_file(dir, "memory.max", value);
+    snprintf(value, sizeof(value), "%zu\n", limit / 10);
+    write_cgroup_file(dir, "memory.current", value);
+    write_cgroup_file(dir, "memory.pressure", no_pressure);
+    
+    printf("Step 1: Below the limit nothing is trimmed...\n");
+    assert(!set_memory_monitor(params.interval_ms, 0, dir));
+    assert(set_memory_monitor(params.interval_ms, params.percent, dir));
+    unsigned int interval;
+    size_t len = sizeof(interval);
+    assert(my_mallctl("opt.memory_monitor", &interval, &len, NULL, 0) == 0);
+    assert(interval == (unsigned int)params.interval_ms);
+    size_t trims = memory_monitor.trims;
+    usleep(params.interval_ms * 10000);
+    assert(memory_monitor.trims == trims);
+    
+    printf("Step 2: Close to the limit the free memory is given back...\n");
+    void *spans[32];
+    for (int i = 0; i < 32; i++) {
+        spans[i] = my_malloc(SPAN_THRESHOLD * 2);
+        assert(spans[i] != NULL);
+    }
+    for (int i = 0; i < 32; i++) {
+        my_free(spans[i]);
+    }
+    snprintf(value, sizeof(value), "%zu\n", limit / 100 * params.percent);
+    write_cgroup_file(dir, "memory.current", value);
+    assert(wait_monitor_trims(trims));
+    // The free spans were all released
+    assert(set_memory_monitor(0, 0, NULL));
+    for (int i = 0; i < MAX_NUMA_NODES && i < numa_node_count(); i++) {
+        assert(page_heap_purge(&page_heaps[i]) == 0);
+    }
+    printf("  Trims: %zu, released: %zu bytes\n", memory_monitor.trims, memory_monitor.released);
+    
+    printf("Step 3: Under pressure the memory is trimmed below the limit...\n");
+    snprintf(value, sizeof(value), "%zu\n", limit / 10);
+    write_cgroup_file(dir, "memory.current", value);
+    write_cgroup_file(dir, "memory.pressure", "some avg10=42.00 avg60=10.00 avg300=2.00 total=1000\n"
+                                              "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+    trims = memory_monitor.trims;
+    assert(set_memory_monitor(params.interval_ms, params.percent, dir));
+    assert(wait_monitor_trims(trims));
     
-    if (p2 == p1) {
-        printf("SUCCESS: Reuse detected (same address)\n");
-    } else {
-        printf("INFO: Different address (allocator may have different policy)\n");
+    printf("Step 4: Stopping the monitor...\n");
+    unsigned int stop = 0;
+    assert(my_mallctl("opt.memory_monitor", NULL, NULL, &stop, sizeof(stop)) == 0);
+    assert(my_mallctl("opt.memory_monitor", &interval, &len, NULL, 0) == 0 && interval == 0);
+    trims = memory_monitor.trims;
+    usleep(params.interval_ms * 10000);
+    assert(memory_monitor.trims == trims);
+    
+    const char *files[] = { "memory.max", "memory.current", "memory.pressure" };
+    for (int i = 0; i < 3; i++) {
+        char path[256];
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
     }
-
-    if (verbose_mode) print_memory();
+    rmdir(dir);
     
-    my_free(p2);
     printf("Test PASSED\n\n");
 }
 
-void test_coalescing(CoalescingParams params) {
-    printf("=== Test: coalescing ===\n");
-    printf("Parameters: block_size=%zu, num_blocks=%d, order=%d\n\n",
-           params.block_size, params.num_blocks, params.free_order);
+// A user cache of blocks that drops the oldest ones when the allocator asks for memory
+typedef struct TestCache {
+    void **blocks;
+    int head, tail;
+    int calls;
+} TestCache;
+
+static size_t test_cache_reclaim(size_t excess, void *arg) {
+    TestCache *cache = arg;
+    size_t freed = 0;
+    cache->calls++;
+    while (freed < excess && cache->head < cache->tail) {
+        void *block = cache->blocks[cache->head++];
+        freed += my_usable_size(block);
+        my_free(block);
+    }
+    return freed;
+}
+
+void test_budget(BudgetParams params) {
+    printf("=== Test: budget ===\n");
+    printf("Parameters: size=%zu, count=%d\n\n", params.block_size, params.num_blocks);
     
-    void *blocks[params.num_blocks];
+    void **blocks = malloc(params.num_blocks * sizeof(void*));
+    assert(blocks != NULL);
+    assert(!set_memory_budget(2 * params.block_size, params.block_size));
     
-    printf("Step 1: Allocating %d blocks of %zu bytes...\n", params.num_blocks, params.block_size);
+    printf("Step 1: Growth over the hard limit fails...\n");
+    size_t start = budget_footprint;
+    size_t limit = params.block_size * 4;
+    assert(set_memory_budget(0, start + limit));
+    int allocated = 0;
+    while (allocated < params.num_blocks) {
+        blocks[allocated] = my_malloc(params.block_size);
+        if (blocks[allocated] == NULL) break;
+        allocated++;
+    }
+    printf("  %d blocks allocated before the limit\n", allocated);
+    assert(allocated < params.num_blocks);
+    assert(budget_footprint <= start + limit);
+    assert(budget_failures > 0);
+    for (int i = 0; i < allocated; i++) {
+        my_free(blocks[i]);
+    }
+    
+    printf("Step 2: Over the soft limit the callbacks shed the user cache...\n");
+    TestCache cache = { .blocks = blocks, .head = 0, .tail = 0, .calls = 0 };
+    assert(add_reclaim_callback(test_cache_reclaim, &cache));
+    start = budget_footprint;
+    assert(set_memory_budget(start + limit, 0));
     for (int i = 0; i < params.num_blocks; i++) {
-        blocks[i] = my_malloc(params.block_size);
-        assert(blocks[i] != NULL);
-        memset(blocks[i], 'A' + i, params.block_size);
-        printf("  Block %d: %p\n", i, blocks[i]);
+        void *block = my_malloc(params.block_size);
+        assert(block != NULL);
+        blocks[cache.tail++] = block;
+        // The blocks just added are kept: the footprint goes over by one block at most
+        assert(budget_footprint <= start + limit + 2 * params.block_size);
     }
-    if (verbose_mode) print_memory();
+    printf("  Reclaim callbacks: %d, blocks left in the cache: %d\n", cache.calls, cache.tail - cache.head);
+    assert(cache.calls > 0);
+    assert(cache.head > 0);
     
-    printf("Step 2: Freeing blocks in order %d...\n", params.free_order);
-    if (params.free_order == 0) {  // FIFO
+    // No limits for the next steps (the callback sees an empty cache until step 4)
+    assert(set_memory_budget(0, 0));
+    while (cache.head < cache.tail) {
+        my_free(blocks[cache.head++]);
+    }
+    
+    printf("Step 3: Released spans and trimmed heap pages leave the footprint...\n");
+    size_t span_size = 2 * SPAN_THRESHOLD;
+    size_t heap_size = SPAN_THRESHOLD / 4;
+    size_t sizes[2] = { span_size, heap_size };
+    for (int s = 0; s < 2; s++) {
+        memory_trim();
+        size_t base = budget_footprint;
         for (int i = 0; i < params.num_blocks; i++) {
-            my_free(blocks[i]);
-        }
-        printf("  Freed in FIFO order\n");
-    } else if (params.free_order == 1) {  // LIFO
-        for (int i = params.num_blocks - 1; i >= 0; i--) {
-            my_free(blocks[i]);
-        }
-        printf("  Freed in LIFO order\n");
-    } else {  // Alternating
-        for (int i = 0; i < params.num_blocks; i += 2) {
-            my_free(blocks[i]);
+            blocks[i] = my_malloc(sizes[s]);
+            assert(blocks[i] != NULL);
         }
-        for (int i = 1; i < params.num_blocks; i += 2) {
+        size_t used = budget_footprint;
+        assert(used > base);
+        for (int i = 0; i < params.num_blocks; i++) {
             my_free(blocks[i]);
         }
-        printf("  Freed in alternating order\n");
+        memory_trim();
+        printf("  %zu-byte blocks: footprint %zu -> %zu -> %zu bytes\n", sizes[s], base, used, budget_footprint);
+        assert(budget_footprint <= base);
     }
-    if (verbose_mode) print_memory();
     
-    printf("Step 3: Allocating merged block of %zu bytes...\n", (size_t)params.block_size * params.num_blocks);
-    void *merged = my_malloc((size_t)params.block_size * params.num_blocks);
-    assert(merged != NULL);
-    memset(merged, 'Z', (size_t)params.block_size * params.num_blocks);
-    printf("  Merged block allocated at %p\n", merged);
+    printf("Step 4: The callbacks stop once the footprint drops...\n");
+    memory_trim();
+    start = budget_footprint;
+    limit = (size_t)params.num_blocks / 4 * span_size;
+    assert(set_memory_budget(start + limit, 0));
+    cache.head = cache.tail = 0;
+    cache.calls = 0;
+    for (int i = 0; i < params.num_blocks; i++) {
+        void *block = my_malloc(span_size);
+        assert(block != NULL);
+        blocks[cache.tail++] = block;
+    }
+    printf("  Reclaim callbacks: %d, blocks left in the cache: %d\n", cache.calls, cache.tail - cache.head);
+    assert(cache.calls > 0 && cache.head > 0);
+    // The program drops its cache: the free spans are released by the next trim
+    while (cache.head < cache.tail) {
+        my_free(blocks[cache.head++]);
+    }
+    memory_trim();
+    assert(budget_excess() == 0);
+    // Below the limit again, no reclaim runs
+    int calls = cache.calls;
+    size_t reclaims = budget_reclaims;
+    for (int i = 0; i < params.num_blocks / 8; i++) {
+        blocks[i] = my_malloc(span_size);
+        assert(blocks[i] != NULL);
+    }
+    for (int i = 0; i < params.num_blocks / 8; i++) {
+        my_free(blocks[i]);
+    }
+    assert(cache.calls == calls && budget_reclaims == reclaims);
+    
+    // No limits for the other tests
+    assert(set_memory_budget(0, 0));
+    free(blocks);
     
-    if (verbose_mode) print_memory();
-
-    my_free(merged);
     printf("Test PASSED\n\n");
 }
 
-void test_fragmentation(FragmentationParams params) {
-    printf("=== Test: fragmentation ===\n");
-    printf("Parameters: large=%zu, small=%zu, medium=%zu, iterations=%d\n\n",
-           params.large_size, params.small_size, params.medium_size, params.pattern_iterations);
+// Pin the calling thread on a cpu and check that it gets the cache of that cpu
+static FrontCache* cpu_cache_on(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    assert(sched_setaffinity(0, sizeof(set), &set) == 0);
     
-    void **large_blocks = malloc(sizeof(void*) * params.pattern_iterations);
-    void **small_blocks = malloc(sizeof(void*) * params.pattern_iterations);
+    FrontCache *cache = cache_acquire();
+    assert(cache != NULL);
+    cache_release(cache);
+    if (rseq_cpu_id() >= 0) {
+        assert(rseq_cpu_id() == sched_getcpu());
+        assert(cache == &cpu_caches[cpu]);
+    } else {
+        // Without rseq every thread has its own cache
+        assert(cache == &thread_cache);
+    }
+    return cache;
+}
+
+typedef struct CpuCacheFlusher {
+    int stop;
+    int flushes;
+} CpuCacheFlusher;
+
+// Drain all the caches until stopped, like my_flush_caches() from another thread
+static void* cpu_cache_flusher(void *arg) {
+    CpuCacheFlusher *flusher = arg;
+    while (!__atomic_load_n(&flusher->stop, __ATOMIC_RELAXED)) {
+        cache_scavenge(false, true);
+        __atomic_fetch_add(&flusher->flushes, 1, __ATOMIC_RELAXED);
+        sched_yield();
+    }
+    return NULL;
+}
+
+void test_cpu_cache(CpuCacheParams params) {
+    printf("=== Test: cpu_cache ===\n");
+    printf("Parameters: size=%zu, extra=%d\n\n", params.payload, params.extra);
     
-    for (int iter = 0; iter < params.pattern_iterations; iter++) {
-        printf("Iteration %d: ", iter + 1);
-        
-        // Allocate large block
-        large_blocks[iter] = my_malloc(params.large_size);
-        assert(large_blocks[iter] != NULL);
-        memset(large_blocks[iter], 'L', params.large_size);
-        
-        // Allocate small blocks
-        small_blocks[iter] = my_malloc(params.small_size);
-        assert(small_blocks[iter] != NULL);
-        memset(small_blocks[iter], 'S', params.small_size);
-        
-        // Allocate and free medium block to create fragmentation
-        void *medium = my_malloc(params.medium_size);
-        assert(medium != NULL);
-        memset(medium, 'M', params.medium_size);
-        my_free(medium);
-        if (verbose_mode) print_memory();
-        
-        printf("Large: %p, Small: %p\n", large_blocks[iter], small_blocks[iter]);
+    cpu_set_t saved;
+    assert(sched_getaffinity(0, sizeof(saved), &saved) == 0);
+    int cpus[2] = { -1, -1 };
+    for (int i = 0, n = 0; i < CPU_SETSIZE && n < 2; i++) {
+        if (CPU_ISSET(i, &saved)) cpus[n++] = i;
     }
+    assert(cpus[0] >= 0);
     
-    printf("Freeing large blocks to create fragmentation gaps...\n");
-    for (int iter = 0; iter < params.pattern_iterations; iter++) {
-        my_free(large_blocks[iter]);
+    printf("Step 1: The cache of the cpu is selected...\n");
+    FrontCache *cache = cpu_cache_on(cpus[0]);
+    printf("  cpu %d, rseq %s, critical sections %s\n", cpus[0],
+           rseq_cpu_id() >= 0 ? "registered" : "not registered", cpu_caches_rseq ? "on" : "off");
+    cache_scavenge(false, true);
+    
+    size_t total_size = sizeof(size_t) + align(params.payload) + sizeof(Footer);
+    int idx = cache_bin_index(total_size);
+    CacheBin *bin = &cache->bins[idx];
+    unsigned int capacity = cache_bin_capacity(idx);
+    assert(capacity >= CACHE_BIN_MIN_CAPACITY && capacity <= CACHE_BIN_MAX_CAPACITY);
+    assert(cache_bin_count(bin) == 0 && cache_bin_head(bin) == NULL);
+    
+    printf("Step 2: A bin holds at most %u blocks of %zu bytes...\n", capacity, total_size);
+    int count = (int)capacity + params.extra;
+    Block **blocks = malloc(count * sizeof(Block*));
+    assert(blocks != NULL);
+    for (int i = 0; i < count; i++) {
+        // Straight from the heap, so a block reused with a different size isn't possible
+        blocks[i] = heap_allocation(total_size);
+        assert(blocks[i] != NULL && get_size(blocks[i]) == total_size);
     }
-    if (verbose_mode) print_memory();
+    for (int i = 0; i < count; i++) {
+        bool pushed = cache_push(blocks[i]);
+        assert(pushed == (i < (int)capacity));
+        if (!pushed) heap_free_block(blocks[i]);
+    }
+    assert(cache_bin_count(bin) == capacity);
     
-    printf("Attempting to allocate medium blocks in fragmented space...\n");
-    for (int iter = 0; iter < params.pattern_iterations; iter++) {
-        void *medium = my_malloc(params.medium_size);
-        assert(medium != NULL);
-        memset(medium, 'M', params.medium_size);
-        my_free(medium);
+    printf("Step 3: Pops are LIFO and the bin is refilled...\n");
+    for (int i = (int)capacity - 1; i >= 0; i--) {
+        assert(cache_pop(total_size) == blocks[i]);
     }
-    if (verbose_mode) print_memory();
+    assert(cache_bin_count(bin) == 0 && cache_pop(total_size) == NULL);
+    for (int i = 0; i < (int)capacity; i++) {
+        assert(cache_push(blocks[i]));
+    }
+    assert(cache_bin_count(bin) == capacity);
     
-    for (int iter = 0; iter < params.pattern_iterations; iter++) {
-        my_free(small_blocks[iter]);
+    if (cpus[1] >= 0 && rseq_cpu_id() >= 0) {
+        printf("Step 4: Another cpu has its own cache...\n");
+        FrontCache *other = cpu_cache_on(cpus[1]);
+        assert(other != cache);
+        // The blocks pushed on the first cpu are not seen from here
+        assert(cache_pop(total_size) == NULL);
+        assert(cache_bin_count(bin) == capacity);
+        cpu_cache_on(cpus[0]);
     }
-    if (verbose_mode) print_memory();
     
-    free(large_blocks);
-    free(small_blocks);
+    printf("Step 5: A flush drains the bin...\n");
+    cache_scavenge(false, true);
+    assert(cache_bin_count(bin) == 0 && cache_bin_head(bin) == NULL);
+    assert(cache_pop(total_size) == NULL);
+    
+    printf("Step 6: Flushes from another thread don't lose or duplicate blocks...\n");
+    CpuCacheFlusher flusher = { 0, 0 };
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, cpu_cache_flusher, &flusher) == 0);
+    int held = 0;
+    for (int round = 0; round < 20000 || __atomic_load_n(&flusher.flushes, __ATOMIC_RELAXED) < 10; round++) {
+        if (held < (int)capacity && (round % 3 != 2 || held == 0)) {
+            Block *block = cache_pop(total_size);
+            if (block == NULL) block = heap_allocation(total_size);
+            assert(block != NULL && get_size(block) == total_size);
+            // A block handed out twice would already be held
+            for (int i = 0; i < held; i++) assert(blocks[i] != block);
+            blocks[held++] = block;
+        } else {
+            Block *block = blocks[--held];
+            if (!cache_push(block)) heap_free_block(block);
+        }
+    }
+    __atomic_store_n(&flusher.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(tid, NULL);
+    printf("  %d flushes\n", flusher.flushes);
+    while (held > 0) heap_free_block(blocks[--held]);
+    cache_scavenge(false, true);
+    assert(cache_bin_count(bin) == 0);
+    
+    assert(sched_setaffinity(0, sizeof(saved), &saved) == 0);
+    free(blocks);
+    
     printf("Test PASSED\n\n");
 }
 
-void test_stress_small(StressSmallParams params) {
-    printf("=== Test: stress_small ===\n");
-    printf("Parameters: size=%zu, count=%d, free_pct=%d%%\n\n",
-           params.small_alloc_size, params.num_allocations, params.free_percentage);
+typedef struct ThreadCachesWorker {
+    size_t payload;
+    int num_blocks;
+    Block **blocks;
+    FrontCache *cache;
+    int cached;
+} ThreadCachesWorker;
+
+// Allocate and free some blocks, so they stay in the cache of the thread when it exits
+static void* thread_caches_worker(void *arg) {
+    ThreadCachesWorker *worker = arg;
+    for (int i = 0; i < worker->num_blocks; i++) {
+        worker->blocks[i] = get_block_from_payload(my_malloc(worker->payload));
+    }
+    for (int i = 0; i < worker->num_blocks; i++) {
+        my_free(worker->blocks[i]->payload);
+    }
+    assert(thread_cache_registered);
+    worker->cache = &thread_cache;
+    for (int i = 0; i < (int)CACHE_NUM_BINS; i++) {
+        worker->cached += cache_bin_count(&thread_cache.bins[i]);
+    }
+    return NULL;
+}
+
+// Tells whether a block is inside a free block of the segregated lists
+static bool thread_caches_in_free_list(Block *block) {
+    bool found = false;
+    lock_all_lists();
+    for (int i = 0; i < NUM_LISTS && !found; i++) {
+        for (Block *b = segregatedLists[i].head; b != NULL; b = get_next_free(b)) {
+            if (block >= b && (unsigned char*)block < (unsigned char*)b + get_size(b)) {
+                found = true;
+                break;
+            }
+        }
+    }
+    unlock_all_lists();
+    return found;
+}
+
+void test_thread_caches(ThreadCachesParams params) {
+    printf("=== Test: thread_caches ===\n");
+    printf("Parameters: size=%zu, count=%d, interval=%u\n\n", params.payload, params.num_blocks, params.interval);
     
-    void **ptrs = malloc(sizeof(void*) * params.num_allocations);
-    assert(ptrs != NULL);
+    assert(params.num_blocks > 1 && params.interval > 0);
+    // The fallback of the per-cpu caches, even where rseq works
+    set_cpu_caches(false);
+    my_flush_caches();
     
-    printf("Allocating %d blocks of %zu bytes...\n", params.num_allocations, params.small_alloc_size);
-    for (int i = 0; i < params.num_allocations; i++) {
-        ptrs[i] = my_malloc(params.small_alloc_size);
-        assert(ptrs[i] != NULL);
-        memset(ptrs[i], (char)('A' + (i % 26)), params.small_alloc_size);
-        
-        if ((i + 1) % 50 == 0) {
-            printf("  Allocated %d blocks\n", i + 1);
-        }
+    printf("Step 1: An exiting thread gives its cached blocks back...\n");
+    Block **blocks = malloc(params.num_blocks * sizeof(Block*));
+    assert(blocks != NULL);
+    ThreadCachesWorker worker = { params.payload, params.num_blocks, blocks, NULL, 0 };
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, thread_caches_worker, &worker) == 0);
+    pthread_join(tid, NULL);
+    printf("  %d blocks were in the cache of the thread\n", worker.cached);
+    assert(worker.cached > 0);
+    for (FrontCache *cache = thread_caches_head; cache != NULL; cache = cache->next) {
+        assert(cache != worker.cache);
+    }
+    for (int i = 0; i < params.num_blocks; i++) {
+        assert(thread_caches_in_free_list(blocks[i]));
     }
-    if (verbose_mode) print_memory();
     
-    printf("Freeing %d%% of allocated blocks...\n", params.free_percentage);
-    int blocks_to_free = (params.num_allocations * params.free_percentage) / 100;
-    for (int i = 0; i < blocks_to_free; i++) {
-        int idx = (i * 2) % params.num_allocations;  // Free every other block
-        if (ptrs[idx] != NULL) {
-            my_free(ptrs[idx]);
-            ptrs[idx] = NULL;
-        }
+    printf("Step 2: An idle bin is halved after two scavenge intervals...\n");
+    unsigned int saved_interval = cache_scavenge_interval;
+    cache_scavenge_interval = params.interval;
+    my_flush_caches();
+    thread_cache.ops = 0;
+    
+    // The idle bin: filled once, then never used
+    size_t idle_size = sizeof(size_t) + align(params.payload) + sizeof(Footer);
+    CacheBin *idle = &thread_cache.bins[cache_bin_index(idle_size)];
+    int filled = 0;
+    for (int i = 0; i < params.num_blocks; i++) {
+        Block *block = heap_allocation(idle_size);
+        assert(block != NULL);
+        if (cache_push(block)) filled++;
+        else heap_free_block(block);
     }
-    if (verbose_mode) print_memory();
+    assert(cache_bin_count(idle) == (unsigned int)filled);
     
-    printf("Re-allocating freed space...\n");
-    for (int i = 0; i < params.num_allocations; i++) {
-        if (ptrs[i] == NULL) {
-            ptrs[i] = my_malloc(params.small_alloc_size);
-            assert(ptrs[i] != NULL);
-            memset(ptrs[i], (char)('A' + (i % 26)), params.small_alloc_size);
-        }
+    // The busy bin: a block of another size allocated and freed again and again
+    size_t busy_payload = params.payload + 64;
+    unsigned int frees = thread_cache.ops;
+    while (frees < 2 * params.interval) {
+        my_free(my_malloc(busy_payload));
+        frees++;
     }
-    if (verbose_mode) print_memory();
+    printf("  Idle bin: %d blocks, %u left\n", filled, cache_bin_count(idle));
+    assert(cache_bin_count(idle) == (unsigned int)(filled - (filled + 1) / 2));
     
-    printf("Freeing all remaining blocks...\n");
-    for (int i = 0; i < params.num_allocations; i++) {
-        if (ptrs[i] != NULL) {
-            my_free(ptrs[i]);
+    cache_scavenge_interval = saved_interval;
+    set_cpu_caches(true);
+    my_flush_caches();
+    free(blocks);
+    
+    printf("Test PASSED\n\n");
+}
+
+typedef struct CompactionWorker {
+    int id;
+    int iterations;
+    int errors;
+} CompactionWorker;
+
+#define COMPACTION_WORKER_SLOTS 32
+
+static int compaction_workers_running = 0;
+
+// Allocate and free blocks and handles of mixed sizes, checking their contents
+static void* compaction_worker(void *arg) {
+    CompactionWorker *worker = arg;
+    unsigned char *blocks[COMPACTION_WORKER_SLOTS] = { NULL };
+    Handle *handles[COMPACTION_WORKER_SLOTS] = { NULL };
+    size_t sizes[COMPACTION_WORKER_SLOTS];
+    unsigned int seed = (unsigned int)worker->id * 7919 + 1;
+    
+    for (int i = 0; i < worker->iterations; i++) {
+        int slot = rand_r(&seed) % COMPACTION_WORKER_SLOTS;
+        unsigned char tag = (unsigned char)(worker->id * COMPACTION_WORKER_SLOTS + slot);
+        
+        if (blocks[slot] != NULL) {
+            if (blocks[slot][0] != tag || blocks[slot][sizes[slot] - 1] != tag) worker->errors++;
+            my_free(blocks[slot]);
+            blocks[slot] = NULL;
+        } else {
+            sizes[slot] = 16 + (size_t)(rand_r(&seed) % 600);
+            blocks[slot] = my_malloc(sizes[slot]);
+            if (blocks[slot] == NULL) worker->errors++;
+            else memset(blocks[slot], tag, sizes[slot]);
+        }
+        
+        // The data of a handle is read while it's pinned, since it can move
+        if (handles[slot] != NULL) {
+            unsigned char *data = handle_pin(handles[slot]);
+            if (data[0] != tag || data[sizes[slot] % 256 + 15] != tag) worker->errors++;
+            handle_unpin(handles[slot]);
+            handle_free(handles[slot]);
+            handles[slot] = NULL;
+        } else {
+            handles[slot] = handle_alloc(sizes[slot] % 256 + 16);
+            if (handles[slot] == NULL) {
+                worker->errors++;
+            } else {
+                memset(handle_pin(handles[slot]), tag, sizes[slot] % 256 + 16);
+                handle_unpin(handles[slot]);
+            }
         }
     }
-    if (verbose_mode) print_memory();
     
-    free(ptrs);
-    printf("Test PASSED\n\n");
+    for (int slot = 0; slot < COMPACTION_WORKER_SLOTS; slot++) {
+        if (blocks[slot] != NULL) my_free(blocks[slot]);
+        if (handles[slot] != NULL) handle_free(handles[slot]);
+    }
+    __atomic_fetch_sub(&compaction_workers_running, 1, __ATOMIC_RELEASE);
+    return NULL;
 }
 
-void test_large_blocks(LargeBlocksParams params) {
-    printf("=== Test: large_blocks ===\n");
-    printf("Parameters: num=%d, order=%d\n\n", params.num_blocks, params.free_order);
+// Walk the blocks between start and end: every header must be valid and match its footer
+static void compaction_check_region(unsigned char *start, unsigned char *end) {
+    unsigned char *current = start;
+    while (current < end) {
+        Block *block = (Block*)current;
+        assert(header_valid(block) && get_size(block) != 0);
+        assert(load_footer(get_footer(block)) == load_header(block));
+        current += get_size(block);
+    }
+    assert(current == end);
+}
+
+void test_compaction_threads(CompactionThreadsParams params) {
+    printf("=== Test: compaction_threads ===\n");
+    printf("Parameters: threads=%d, iterations=%d, passes=%d\n\n",
+           params.num_threads, params.iterations, params.num_passes);
     
-    void **blocks = malloc(sizeof(void*) * params.num_blocks);
-    assert(blocks != NULL);
+    pthread_t *tids = malloc(params.num_threads * sizeof(pthread_t));
+    CompactionWorker *workers = calloc(params.num_threads, sizeof(CompactionWorker));
+    assert(tids != NULL && workers != NULL);
     
-    printf("Allocating %d large blocks via mmap...\n", params.num_blocks);
-    for (int i = 0; i < params.num_blocks; i++) {
-        blocks[i] = my_malloc(params.block_sizes[i]);
-        assert(blocks[i] != NULL);
-        memset(blocks[i], 'A' + i, params.block_sizes[i]);
-        printf("  Block %d (%zu bytes): %p\n", i, params.block_sizes[i], blocks[i]);
+    printf("Step 1: %d threads allocating while the heap is compacted...\n", params.num_threads);
+    compaction_workers_running = params.num_threads;
+    for (int t = 0; t < params.num_threads; t++) {
+        workers[t].id = t;
+        workers[t].iterations = params.iterations;
+        assert(pthread_create(&tids[t], NULL, compaction_worker, &workers[t]) == 0);
     }
-    if (verbose_mode) print_memory();
+    // At least num_passes passes, and until the last thread is done
+    size_t released = 0;
+    int passes = 0;
+    while (passes < params.num_passes || __atomic_load_n(&compaction_workers_running, __ATOMIC_ACQUIRE) > 0) {
+        released += heap_compact();
+        passes++;
+    }
+    int errors = 0;
+    for (int t = 0; t < params.num_threads; t++) {
+        pthread_join(tids[t], NULL);
+        errors += workers[t].errors;
+    }
+    printf("  %d passes released %zu bytes, corrupted or failed allocations: %d\n", passes, released, errors);
+    assert(errors == 0);
     
-    printf("Freeing blocks in order %d...\n", params.free_order);
-    if (params.free_order == 0) {  // FIFO
-        for (int i = 0; i < params.num_blocks; i++) {
-            my_free(blocks[i]);
-        }
-        printf("  Freed in FIFO order\n");
-    } else if (params.free_order == 1) {  // LIFO
-        for (int i = params.num_blocks - 1; i >= 0; i--) {
-            my_free(blocks[i]);
-        }
-        printf("  Freed in LIFO order\n");
-    } else {  // Random-like pattern
-        for (int i = 0; i < params.num_blocks; i += 2) {
-            my_free(blocks[i]);
+    printf("Step 2: Compacting the idle heap and checking every block...\n");
+    heap_compact();
+    fork_prepare();
+    unsigned char *region_start = (unsigned char*)heap_state.start;
+    if (heap_state.gap_start != NULL) {
+        compaction_check_region((unsigned char*)heap_state.start, heap_state.gap_start);
+        region_start = heap_state.gap_end;
+    }
+    compaction_check_region(region_start, heap_state.top);
+    fork_parent();
+    
+    free(tids);
+    free(workers);
+    printf("Test PASSED\n\n");
+}
+
+// Check the policy of the page that contains addr: bound to the given node (or
+// to any single node if it's -1) with MPOL_PREFERRED on NUMA machines, left to
+// the default policy otherwise
+static void numa_check_page(void *addr, int node) {
+    int mode = -1;
+    unsigned long node_mask = 0;
+    assert(syscall(SYS_get_mempolicy, &mode, &node_mask, (unsigned long)MAX_NUMA_NODES + 1,
+                   addr, MPOL_F_ADDR) == 0);
+    if (numa_node_count() > 1) {
+        assert(mode == MPOL_PREFERRED);
+        if (node >= 0) assert(node_mask == 1UL << node);
+        else assert(node_mask != 0 && (node_mask & (node_mask - 1)) == 0);
+    } else {
+        assert(mode == MPOL_DEFAULT);
+    }
+}
+
+void test_numa(NumaParams params) {
+    printf("=== Test: numa ===\n");
+    printf("Parameters: size=%zu, count=%d\n\n", params.block_size, params.num_blocks);
+    
+    assert(params.block_size < MMAP_THRESHOLD && params.num_blocks > 0);
+    // The thread stays on its cpu, so its node doesn't change
+    cpu_set_t saved, set;
+    assert(sched_getaffinity(0, sizeof(saved), &saved) == 0);
+    CPU_ZERO(&set);
+    CPU_SET(sched_getcpu(), &set);
+    assert(sched_setaffinity(0, sizeof(set), &set) == 0);
+    int node = numa_current_node();
+    printf("  %d node(s), running on node %d\n", numa_node_count(), node);
+    
+    printf("Step 1: Growing the heap with blocks of %zu bytes...\n", params.block_size);
+    size_t page_size = (size_t)get_page_size();
+    size_t total_size = sizeof(size_t) + align(params.block_size) + sizeof(Footer);
+    Block *chain = NULL;
+    int count = 0;
+    unsigned char *old_end = heap_state.end;
+    uintptr_t first;
+    // The heap supports a single gap: once the libc malloc used by the tests has
+    // moved the program break past the sbrk region, the heap can't grow anymore.
+    // Then the pages that the region got from sbrk before are checked (they may
+    // have been obtained by threads running on other nodes).
+    if (heap_state.gap_end != NULL && sbrk(0) != heap_state.end) {
+        first = ((uintptr_t)heap_state.gap_end + page_size - 1) & ~(page_size - 1);
+        node = -1;
+        printf("  The program break was moved by the libc, checking the sbrk region\n");
+    } else {
+        // The blocks are chained through their payloads, so the libc malloc
+        // doesn't move the program break while the heap grows
+        while (count < params.num_blocks || heap_state.end == old_end) {
+            // Straight from the heap, so no free block of the caches is reused
+            Block *block = heap_allocation(total_size);
+            assert(block != NULL);
+            *(Block**)block->payload = chain;
+            chain = block;
+            count++;
         }
-        for (int i = 1; i < params.num_blocks; i += 2) {
-            my_free(blocks[i]);
+        // Only the pages obtained by this test: from the old end, or from the start
+        // of the sbrk region if the static heap was still in use
+        first = ((uintptr_t)old_end + page_size - 1) & ~(page_size - 1);
+        if (first < (uintptr_t)heap_state.gap_end) {
+            first = ((uintptr_t)heap_state.gap_end + page_size - 1) & ~(page_size - 1);
         }
-        printf("  Freed in random-like order\n");
     }
-    if (verbose_mode) print_memory();
+    int pages = 0;
+    for (uintptr_t page = first; page < (uintptr_t)heap_state.end; page += page_size) {
+        numa_check_page((void*)page, node);
+        pages++;
+    }
+    printf("  %d blocks, %d pages checked\n", count, pages);
     
-    free(blocks);
+    printf("Step 2: A block mapped with mmap is bound too...\n");
+    unsigned char *big = my_malloc(2 * MMAP_THRESHOLD);
+    assert(big != NULL);
+    for (size_t offset = 0; offset < 2 * MMAP_THRESHOLD; offset += page_size) {
+        numa_check_page(big + offset, numa_current_node());
+    }
+    my_free(big);
+    
+    while (chain != NULL) {
+        Block *next = *(Block**)chain->payload;
+        heap_free_block(chain);
+        chain = next;
+    }
+    assert(sched_setaffinity(0, sizeof(saved), &saved) == 0);
     printf("Test PASSED\n\n");
 }
 
@@ -751,6 +3631,98 @@ int main(int argc, char *argv[]) {
                 LargeBlocksParams params = default_large_blocks_params;
                 parse_large_blocks_params(&params, argc, argv, i, &params_end);
                 test_large_blocks(params);
+            } else if (strcmp(test_name, "threads") == 0) {
+                ThreadsParams params = default_threads_params;
+                parse_threads_params(&params, argc, argv, i, &params_end);
+                test_threads(params);
+            } else if (strcmp(test_name, "fork_safety") == 0) {
+                ForkSafetyParams params = default_fork_params;
+                parse_fork_params(&params, argc, argv, i, &params_end);
+                test_fork_safety(params);
+            } else if (strcmp(test_name, "ownership") == 0) {
+                OwnershipParams params = default_ownership_params;
+                parse_ownership_params(&params, argc, argv, i, &params_end);
+                test_ownership(params);
+            } else if (strcmp(test_name, "spans") == 0) {
+                SpansParams params = default_spans_params;
+                parse_spans_params(&params, argc, argv, i, &params_end);
+                test_spans(params);
+            } else if (strcmp(test_name, "compaction") == 0) {
+                CompactionParams params = default_compaction_params;
+                parse_compaction_params(&params, argc, argv, i, &params_end);
+                test_compaction(params);
+            } else if (strcmp(test_name, "persistent") == 0) {
+                PersistentParams params = default_persistent_params;
+                parse_persistent_params(&params, argc, argv, i, &params_end);
+                test_persistent(params);
+            } else if (strcmp(test_name, "shared_heap") == 0) {
+                SharedHeapParams params = default_shared_heap_params;
+                parse_shared_heap_params(&params, argc, argv, i, &params_end);
+                test_shared_heap(params);
+            } else if (strcmp(test_name, "slabs") == 0) {
+                SlabsParams params = default_slabs_params;
+                parse_slabs_params(&params, argc, argv, i, &params_end);
+                test_slabs(params);
+            } else if (strcmp(test_name, "fast_lists") == 0) {
+                FastListsParams params = default_fast_lists_params;
+                parse_fast_lists_params(&params, argc, argv, i, &params_end);
+                test_fast_lists(params);
+            } else if (strcmp(test_name, "prefetch") == 0) {
+                PrefetchParams params = default_prefetch_params;
+                parse_prefetch_params(&params, argc, argv, i, &params_end);
+                test_prefetch(params);
+            } else if (strcmp(test_name, "guarded") == 0) {
+                GuardedParams params = default_guarded_params;
+                parse_guarded_params(&params, argc, argv, i, &params_end);
+                test_guarded(params);
+            } else if (strcmp(test_name, "header_checks") == 0) {
+                HeaderChecksParams params = default_header_checks_params;
+                parse_header_checks_params(&params, argc, argv, i, &params_end);
+                test_header_checks(params);
+            } else if (strcmp(test_name, "safe_linking") == 0) {
+                SafeLinkingParams params = default_safe_linking_params;
+                parse_safe_linking_params(&params, argc, argv, i, &params_end);
+                test_safe_linking(params);
+            } else if (strcmp(test_name, "quarantine") == 0) {
+                QuarantineParams params = default_quarantine_params;
+                parse_quarantine_params(&params, argc, argv, i, &params_end);
+                test_quarantine(params);
+            } else if (strcmp(test_name, "leak_report") == 0) {
+                LeakReportParams params = default_leak_report_params;
+                parse_leak_report_params(&params, argc, argv, i, &params_end);
+                test_leak_report(params);
+            } else if (strcmp(test_name, "config") == 0) {
+                ConfigParams params = default_config_params;
+                parse_config_params(&params, argc, argv, i, &params_end);
+                test_config(params);
+            } else if (strcmp(test_name, "mallctl") == 0) {
+                MallctlParams params = default_mallctl_params;
+                parse_mallctl_params(&params, argc, argv, i, &params_end);
+                test_mallctl(params);
+            } else if (strcmp(test_name, "memory_monitor") == 0) {
+                MemoryMonitorParams params = default_memory_monitor_params;
+                parse_memory_monitor_params(&params, argc, argv, i, &params_end);
+                test_memory_monitor(params);
+            } else if (strcmp(test_name, "budget") == 0) {
+                BudgetParams params = default_budget_params;
+                parse_budget_params(&params, argc, argv, i, &params_end);
+                test_budget(params);
+            } else if (strcmp(test_name, "cpu_cache") == 0) {
+                CpuCacheParams params = default_cpu_cache_params;
+                parse_cpu_cache_params(&params, argc, argv, i, &params_end);
+                test_cpu_cache(params);
+            } else if (strcmp(test_name, "thread_caches") == 0) {
+                ThreadCachesParams params = default_thread_caches_params;
+                parse_thread_caches_params(&params, argc, argv, i, &params_end);
+                test_thread_caches(params);
+            } else if (strcmp(test_name, "compaction_threads") == 0) {
+                CompactionThreadsParams params = default_compaction_threads_params;
+                parse_compaction_threads_params(&params, argc, argv, i, &params_end);
+                test_compaction_threads(params);
+            } else if (strcmp(test_name, "numa") == 0) {
+                NumaParams params = default_numa_params;
+                parse_numa_params(&params, argc, argv, i, &params_end);
+                test_numa(params);
             }
             i = params_end;
         } else {
@@ -769,6 +3741,52 @@ int main(int argc, char *argv[]) {
                 test_stress_small(default_stress_params);
             } else if (strcmp(test_name, "large_blocks") == 0) {
                 test_large_blocks(default_large_blocks_params);
+            } else if (strcmp(test_name, "threads") == 0) {
+                test_threads(default_threads_params);
+            } else if (strcmp(test_name, "fork_safety") == 0) {
+                test_fork_safety(default_fork_params);
+            } else if (strcmp(test_name, "ownership") == 0) {
+                test_ownership(default_ownership_params);
+            } else if (strcmp(test_name, "spans") == 0) {
+                test_spans(default_spans_params);
+            } else if (strcmp(test_name, "compaction") == 0) {
+                test_compaction(default_compaction_params);
+            } else if (strcmp(test_name, "persistent") == 0) {
+                test_persistent(default_persistent_params);
+            } else if (strcmp(test_name, "shared_heap") == 0) {
+                test_shared_heap(default_shared_heap_params);
+            } else if (strcmp(test_name, "slabs") == 0) {
+                test_slabs(default_slabs_params);
+            } else if (strcmp(test_name, "fast_lists") == 0) {
+                test_fast_lists(default_fast_lists_params);
+            } else if (strcmp(test_name, "prefetch") == 0) {
+                test_prefetch(default_prefetch_params);
+            } else if (strcmp(test_name, "guarded") == 0) {
+                test_guarded(default_guarded_params);
+            } else if (strcmp(test_name, "header_checks") == 0) {
+                test_header_checks(default_header_checks_params);
+            } else if (strcmp(test_name, "safe_linking") == 0) {
+                test_safe_linking(default_safe_linking_params);
+            } else if (strcmp(test_name, "quarantine") == 0) {
+                test_quarantine(default_quarantine_params);
+            } else if (strcmp(test_name, "leak_report") == 0) {
+                test_leak_report(default_leak_report_params);
+            } else if (strcmp(test_name, "config") == 0) {
+                test_config(default_config_params);
+            } else if (strcmp(test_name, "mallctl") == 0) {
+                test_mallctl(default_mallctl_params);
+            } else if (strcmp(test_name, "memory_monitor") == 0) {
+                test_memory_monitor(default_memory_monitor_params);
+            } else if (strcmp(test_name, "budget") == 0) {
+                test_budget(default_budget_params);
+            } else if (strcmp(test_name, "cpu_cache") == 0) {
+                test_cpu_cache(default_cpu_cache_params);
+            } else if (strcmp(test_name, "thread_caches") == 0) {
+                test_thread_caches(default_thread_caches_params);
+            } else if (strcmp(test_name, "compaction_threads") == 0) {
+                test_compaction_threads(default_compaction_threads_params);
+            } else if (strcmp(test_name, "numa") == 0) {
+                test_numa(default_numa_params);
             }
         }
     }
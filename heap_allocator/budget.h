@@ -0,0 +1,160 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include "heap_allocator_api.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+    ------- MEMORY BUDGET ----------
+
+    The footprint of the allocator is the memory it got from the kernel for the
+    user data: the growth of the heap with sbrk, the blocks allocated with mmap
+    and the pages of the spans taken from the page heaps. It goes down when the
+    memory is given back: an mmap block is unmapped, the pages of a free span are
+    released (span_release_pages) and the pages above the top of the heap are
+    trimmed by heap_compact(). Released pages are counted again when they are
+    reused, since the kernel gives them memory again, and when a span in use is
+    freed next to them: the merged span is released as a whole. The static heap
+    and the metadata are not counted.
+
+    set_memory_budget() puts two limits on the footprint (0 = no limit):
+        - hard limit: sbrk_allocation, mmap_allocation and span_allocation check the
+        budget before asking the kernel for memory (or reusing released pages), and
+        a growth that would go over the limit fails: my_malloc returns NULL instead
+        of the process being killed by the OOM killer.
+        - soft limit: a growth that goes over it is allowed, but the next my_malloc
+        of the thread reclaims memory before returning. First the memory kept for
+        later is trimmed (memory_trim(), see memory_monitor.h), so the next requests
+        reuse it instead of growing, then the callbacks registered with
+        add_reclaim_callback() are called in order, with the bytes still over the
+        limit, until the footprint is below it: the program can drop the entries of
+        its own caches. The growth happens under the locks of the heap, this is why
+        the reclaim is done later, when my_malloc holds no lock.
+    Only one thread reclaims at a time, and the allocations of the callbacks don't
+    start another reclaim. When a reclaim leaves the footprint over the soft limit
+    (the memory is really in use), the next one waits until the footprint grows by
+    another 1/BUDGET_RECLAIM_STEP of the limit, instead of running at every growth.
+*/
+
+#define BUDGET_MAX_CALLBACKS 16
+#define BUDGET_RECLAIM_STEP 16
+
+typedef struct ReclaimEntry {
+    ReclaimCallback callback;
+    void *arg;
+} ReclaimEntry;
+
+static size_t budget_soft_limit = 0;
+static size_t budget_hard_limit = 0;
+static size_t budget_footprint = 0;
+static bool budget_reclaim_pending = false;
+// Footprint a growth must go over to start the next reclaim (0 = the soft limit)
+static size_t budget_reclaim_floor = 0;
+// Reclaims done, and growths refused by the hard limit
+static size_t budget_reclaims = 0;
+static size_t budget_failures = 0;
+
+static ReclaimEntry reclaim_callbacks[BUDGET_MAX_CALLBACKS];
+static unsigned int reclaim_callback_count = 0;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set while the thread runs the callbacks
+static __thread bool budget_in_reclaim = false;
+
+// Set the soft and the hard limit of the footprint (0 = no limit).
+// Returns false if the soft limit is above the hard one.
+bool set_memory_budget(size_t soft_limit, size_t hard_limit) {
+    if (soft_limit != 0 && hard_limit != 0 && soft_limit > hard_limit) return false;
+    __atomic_store_n(&budget_soft_limit, soft_limit, __ATOMIC_RELAXED);
+    __atomic_store_n(&budget_hard_limit, hard_limit, __ATOMIC_RELAXED);
+    __atomic_store_n(&budget_reclaim_floor, 0, __ATOMIC_RELAXED);
+    return true;
+}
+
+// Register a function that frees memory when the footprint is over the soft limit.
+// Returns false if BUDGET_MAX_CALLBACKS are already registered.
+bool add_reclaim_callback(ReclaimCallback callback, void *arg) {
+    if (callback == NULL) return false;
+
+    pthread_mutex_lock(&reclaim_lock);
+    unsigned int count = reclaim_callback_count;
+    if (count == BUDGET_MAX_CALLBACKS) {
+        pthread_mutex_unlock(&reclaim_lock);
+        return false;
+    }
+    reclaim_callbacks[count].callback = callback;
+    reclaim_callbacks[count].arg = arg;
+    // The entry is complete before it becomes visible to the reclaiming thread
+    __atomic_store_n(&reclaim_callback_count, count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&reclaim_lock);
+    return true;
+}
+
+// Count bytes of new memory, before asking them to the kernel.
+// Returns false if they would go over the hard limit.
+static bool budget_charge(size_t bytes) {
+    size_t hard = __atomic_load_n(&budget_hard_limit, __ATOMIC_RELAXED);
+    size_t footprint = __atomic_load_n(&budget_footprint, __ATOMIC_RELAXED);
+    size_t next;
+    do {
+        next = footprint + bytes;
+        if (hard != 0 && next > hard) {
+            __atomic_fetch_add(&budget_failures, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&budget_footprint, &footprint, next, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    size_t soft = __atomic_load_n(&budget_soft_limit, __ATOMIC_RELAXED);
+    if (soft != 0 && next > soft && next > __atomic_load_n(&budget_reclaim_floor, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&budget_reclaim_pending, true, __ATOMIC_RELAXED);
+    }
+    return true;
+}
+
+// Count bytes that can't be refused: released pages merged with memory in use
+static void budget_charge_always(size_t bytes) {
+    __atomic_fetch_add(&budget_footprint, bytes, __ATOMIC_RELAXED);
+}
+
+// Give back the bytes of a charge (the memory was unmapped or released, or never obtained)
+static void budget_uncharge(size_t bytes) {
+    __atomic_fetch_sub(&budget_footprint, bytes, __ATOMIC_RELAXED);
+}
+
+// Tells whether this thread has to reclaim memory (and takes the job)
+static inline bool budget_reclaim_needed() {
+    return __atomic_load_n(&budget_reclaim_pending, __ATOMIC_RELAXED) && !budget_in_reclaim &&
+           __atomic_exchange_n(&budget_reclaim_pending, false, __ATOMIC_ACQUIRE);
+}
+
+// Bytes of the footprint over the soft limit
+static size_t budget_excess() {
+    size_t soft = __atomic_load_n(&budget_soft_limit, __ATOMIC_RELAXED);
+    size_t footprint = __atomic_load_n(&budget_footprint, __ATOMIC_RELAXED);
+    return (soft != 0 && footprint > soft) ? footprint - soft : 0;
+}
+
+// Call the callbacks until the footprint is below the soft limit
+static void budget_run_callbacks() {
+    budget_in_reclaim = true;
+    __atomic_fetch_add(&budget_reclaims, 1, __ATOMIC_RELAXED);
+
+    unsigned int count = __atomic_load_n(&reclaim_callback_count, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < count; i++) {
+        size_t excess = budget_excess();
+        if (excess == 0) break;
+        reclaim_callbacks[i].callback(excess, reclaim_callbacks[i].arg);
+    }
+
+    // Still over the limit: the memory is in use, wait for it to grow before retrying
+    size_t soft = __atomic_load_n(&budget_soft_limit, __ATOMIC_RELAXED);
+    size_t excess = budget_excess();
+    __atomic_store_n(&budget_reclaim_floor, excess == 0 ? 0 : soft + excess + soft / BUDGET_RECLAIM_STEP,
+                     __ATOMIC_RELAXED);
+
+    budget_in_reclaim = false;
+}
+
+#endif
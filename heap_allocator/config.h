@@ -0,0 +1,206 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "heap_allocator_api.h"
+#include "algorithms.h"
+#include "mmap_allocator.h"
+#include "page_heap.h"
+#include "cpu_cache.h"
+#include "quarantine.h"
+#include "stats.h"
+#include "budget.h"
+#include "memory_monitor.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    ------- RUNTIME CONFIGURATION ----------
+
+    The limits of the allocator are macros, but the best values depend on the
+    program: the same binary can be tuned at startup through the MY_MALLOC_CONF
+    environment variable, or at any moment with my_malloc_config(), which takes
+    the same string. It's a list of key:value pairs separated by commas:
+
+        MY_MALLOC_CONF="mmap_threshold:1m,cache_bin_bytes:4k,stats_print:true"
+
+    Sizes accept the k, m and g suffixes; booleans are true or false.
+
+        - mmap_threshold: requests from this size are served by mmap
+        (MMAP_THRESHOLD). Smaller ones above SPAN_THRESHOLD use the page heap.
+        - sbrk_min_growth: minimum number of bytes the heap grows by with sbrk
+        (one page by default).
+        - span_release_pages: free spans of the page heap with at least this number
+        of pages are given back to the kernel (SPAN_RELEASE_PAGES, 0 never).
+        - cache_bin_bytes: bytes held by a bin of the per-cpu caches
+        (CACHE_BIN_BYTES, 0 disables the caches).
+        - cache_scavenge_interval: frees of a cache after which its idle blocks
+        are given back (CACHE_SCAVENGE_INTERVAL).
+        - cpu_caches: the same as set_cpu_caches() (false: one cache per thread).
+        - slabs, prefetch, header_checks: the same as set_out_of_line_metadata(),
+        set_prefetch() and set_header_checks().
+        - guarded_sample, leak_sample: sample rates of the guarded pool and of the
+        allocation sites (0 disables them).
+        - quarantine, quarantine_poison: byte budget of the quarantine and poisoning.
+        - leak_report: print the leak report at exit.
+        - stats: count the allocations by size class (stats.h).
+        - stats_print: print the statistics at exit (it enables stats too).
+        - budget_soft, budget_hard: soft and hard limit of the memory taken from
+        the kernel (budget.h, 0 = no limit).
+        - memory_monitor: start the memory monitor of the cgroup, checking it
+        every this number of milliseconds (memory_monitor.h, 0 stops it).
+
+    An invalid pair is reported on stderr and skipped, the others are applied.
+    The environment variable is read by a constructor, before main starts.
+*/
+
+#define CONFIG_ENV "MY_MALLOC_CONF"
+
+// Parse a size with an optional k/m/g suffix.
+// Returns false if it's invalid or doesn't fit in a size_t.
+static bool config_parse_size(const char *value, size_t *out) {
+    char *end;
+    if (*value < '0' || *value > '9') return false;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (errno == ERANGE) return false;
+
+    unsigned int shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end++; break;
+        case 'm': case 'M': shift = 20; end++; break;
+        case 'g': case 'G': shift = 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0') return false;
+    // The bits shifted out would be lost
+    if (n > (ULLONG_MAX >> shift) || (n << shift) > SIZE_MAX) return false;
+    *out = (size_t)(n << shift);
+    return true;
+}
+
+static bool config_parse_bool(const char *value, bool *out) {
+    if (strcmp(value, "true") == 0) *out = true;
+    else if (strcmp(value, "false") == 0) *out = false;
+    else return false;
+    return true;
+}
+
+static void config_print_stats_at_exit() {
+    my_malloc_stats_print(stderr);
+}
+
+// Apply a single option. Returns false if the key or the value is invalid.
+static bool config_apply(const char *key, const char *value) {
+    size_t n;
+    bool b;
+
+    if (strcmp(key, "mmap_threshold") == 0) {
+        if (!config_parse_size(value, &n) || n == 0) return false;
+        __atomic_store_n(&mmap_threshold, n, __ATOMIC_RELAXED);
+    } else if (strcmp(key, "sbrk_min_growth") == 0) {
+        if (!config_parse_size(value, &n)) return false;
+        __atomic_store_n(&sbrk_min_growth, n, __ATOMIC_RELAXED);
+    } else if (strcmp(key, "span_release_pages") == 0) {
+        if (!config_parse_size(value, &n)) return false;
+        __atomic_store_n(&span_release_threshold, n, __ATOMIC_RELAXED);
+    } else if (strcmp(key, "cache_bin_bytes") == 0) {
+        if (!config_parse_size(value, &n)) return false;
+        __atomic_store_n(&cache_bin_bytes, n, __ATOMIC_RELAXED);
+    } else if (strcmp(key, "cache_scavenge_interval") == 0) {
+        if (!config_parse_size(value, &n) || n == 0 || n > UINT_MAX) return false;
+        __atomic_store_n(&cache_scavenge_interval, (unsigned int)n, __ATOMIC_RELAXED);
+    } else if (strcmp(key, "cpu_caches") == 0) {
+        if (!config_parse_bool(value, &b)) return false;
+        set_cpu_caches(b);
+    } else if (strcmp(key, "slabs") == 0) {
+        if (!config_parse_bool(value, &b)) return false;
+        set_out_of_line_metadata(b);
+    } else if (strcmp(key, "prefetch") == 0) {
+        if (!config_parse_bool(value, &b)) return false;
+        set_prefetch(b);
+    } else if (strcmp(key, "header_checks") == 0) {
+        if (!config_parse_bool(value, &b)) return false;
+        set_header_checks(b);
+    } else if (strcmp(key, "guarded_sample") == 0) {
+        if (!config_parse_size(value, &n) || n > UINT_MAX) return false;
+        set_guarded_sample_rate((unsigned int)n);
+    } else if (strcmp(key, "leak_sample") == 0) {
+        if (!config_parse_size(value, &n) || n > UINT_MAX) return false;
+        set_leak_sample_rate((unsigned int)n);
+    } else if (strcmp(key, "quarantine") == 0) {
+        if (!config_parse_size(value, &n)) return false;
+        set_quarantine(n, __atomic_load_n(&quarantine_poison, __ATOMIC_RELAXED));
+    } else if (strcmp(key, "quarantine_poison") == 0) {
+        if (!config_parse_bool(value, &b)) return false;
+        set_quarantine(__atomic_load_n(&quarantine_max_bytes, __ATOMIC_RELAXED), b);
+    } else if (strcmp(key, "leak_report") == 0) {
+        if (!config_parse_bool(value, &b)) return false;
+        if (b && !set_leak_report(true, 0)) return false;
+    } else if (strcmp(key, "stats") == 0) {
+        if (!config_parse_bool(value, &b)) return false;
+        set_stats(b);
+    } else if (strcmp(key, "stats_print") == 0) {
+        if (!config_parse_bool(value, &b)) return false;
+        if (b) {
+            set_stats(true);
+            if (atexit(config_print_stats_at_exit) != 0) return false;
+        }
+    } else if (strcmp(key, "budget_soft") == 0) {
+        if (!config_parse_size(value, &n)) return false;
+        if (!set_memory_budget(n, __atomic_load_n(&budget_hard_limit, __ATOMIC_RELAXED))) return false;
+    } else if (strcmp(key, "budget_hard") == 0) {
+        if (!config_parse_size(value, &n)) return false;
+        if (!set_memory_budget(__atomic_load_n(&budget_soft_limit, __ATOMIC_RELAXED), n)) return false;
+    } else if (strcmp(key, "memory_monitor") == 0) {
+        if (!config_parse_size(value, &n) || n > UINT_MAX) return false;
+        if (!set_memory_monitor((unsigned int)n, MONITOR_PERCENT, NULL)) return false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Apply a configuration string (see above). Returns false if a pair was invalid.
+bool my_malloc_config(const char *conf) {
+    bool valid = true;
+    const char *pair = conf;
+
+    while (pair != NULL && *pair != '\0') {
+        const char *end = strchr(pair, ',');
+        size_t len = end ? (size_t)(end - pair) : strlen(pair);
+
+        // Keys and values are short: a pair that doesn't fit is invalid anyway
+        char buf[128];
+        bool applied = false;
+        if (len < sizeof(buf)) {
+            memcpy(buf, pair, len);
+            buf[len] = '\0';
+            char *colon = strchr(buf, ':');
+            if (colon != NULL) {
+                *colon = '\0';
+                applied = config_apply(buf, colon + 1);
+            }
+        }
+        if (!applied) {
+            fprintf(stderr, "%s: invalid option \"%.*s\"\n", CONFIG_ENV, (int)len, pair);
+            valid = false;
+        }
+
+        pair = end ? end + 1 : NULL;
+    }
+    return valid;
+}
+
+// Read MY_MALLOC_CONF before main, right after the per-process secrets (utils.h)
+__attribute__((constructor(102)))
+static void config_from_env() {
+    const char *conf = getenv(CONFIG_ENV);
+    if (conf != NULL) my_malloc_config(conf);
+}
+
+#endif
@@ -0,0 +1,659 @@
+#ifndef CPU_CACHE_H
+#define CPU_CACHE_H
+
+#include "data_structure.h"
+#include "utils.h"
+#include "algorithms.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+
+// The pops and pushes of the per-cpu caches are rseq critical sections on x86-64
+// (with compressed links the pop would need the decoding in assembly too).
+// ThreadSanitizer can't see the order the kernel gives to them, so it gets the try-locks.
+#if defined(HAVE_RSEQ) && defined(__x86_64__) && !defined(COMPRESSED_LINKS) && \
+    !defined(__SANITIZE_THREAD__) && __has_include(<linux/membarrier.h>)
+#include <linux/membarrier.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#define HAVE_RSEQ_CS 1
+#endif
+
+/*
+    ------- PER-CPU FRONT-END CACHE ----------
+
+    Small blocks are allocated and freed very often, so before reaching
+    the segregated lists my_malloc and my_free go through a small cache
+    of already-sized blocks.
+
+    The cache is made of bins: each bin is a singly linked LIFO list
+    of blocks of exactly the same total size (one bin every 8 bytes, from
+    the minimum block up to CACHE_MAX_BLOCK_SIZE). Blocks in the cache
+    keep their is_used flag set, so coalesce never merges them with
+    their neighbors and they can be handed out again without any
+    split or header update.
+
+    There is one cache for every cpu instead of one for every thread,
+    so the memory held by the caches is bounded by the number of cpus
+    and not by the number of threads.
+    The cpu the thread is running on is read from the rseq (restartable
+    sequences) area that glibc registers for every thread: the kernel
+    keeps its cpu_id field up to date, so reading it costs a plain load
+    instead of a getcpu syscall.
+
+    On x86-64 the pop and the push are rseq critical sections, with no atomic
+    instruction: a short sequence of assembly that the kernel restarts (it jumps
+    to its abort handler) if the thread is preempted, migrated or interrupted by
+    a signal before the last instruction. The sequence checks that the thread is
+    still on the cpu of the cache, and ends with a single store, the commit: the
+    head and the count of a bin are packed in one word (CacheBin.top), so that
+    store publishes the whole operation. Nothing before it is visible to the
+    other threads, except the link of the pushed block (still owned by the
+    thread) and the low watermark, which is only a hint.
+    The other threads (the scavenger, my_flush_caches, fork) take the try-lock
+    of the cache, which the critical sections check, and then fence the cpu with
+    membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ): a critical section that
+    started before the lock was taken is aborted, the next ones see the lock and
+    skip the cache. So they can detach the blocks of the cache safely.
+    On the other architectures, with compressed links, or if membarrier is not
+    available, the owner takes the try-lock too (an atomic exchange to take it, a
+    release store to give it back). It's taken by the thread running on that cpu
+    almost every time, so its line stays in the cache of the cpu and it's never
+    contended; if it's busy the operation simply skips the cache.
+
+    If rseq is not available (old kernel or glibc, or disabled through
+    the glibc tunables), or the per-cpu caches are turned off with
+    set_cpu_caches(false), every thread uses its own private cache instead.
+    These caches are registered in a list, and a thread-specific key with
+    a destructor gives their blocks back to the segregated lists when the
+    thread exits, so they don't get lost.
+
+    Caches of idle threads or cpus would keep their blocks forever, so
+    every CACHE_SCAVENGE_INTERVAL frees a cache runs the scavenger on
+    itself and, at most once every CACHE_SCAVENGE_PERIOD_MS, on all the
+    caches (the walk takes the registry lock and the lock of every cache,
+    so it can't run on every free of a busy program):
+        - high watermark: the capacity of a bin. It depends on the size class,
+        so that every bin holds about CACHE_BIN_BYTES bytes (more small
+        blocks, fewer big ones).
+        - low watermark: the minimum number of blocks a bin had since the last
+        scavenge. Those blocks were never needed in the meantime, so half of
+        them are given back to the segregated lists.
+    With the critical sections the frees are counted per thread instead of per
+    cache (a counter in the cache would need another store in the sequence).
+
+                 cpu_caches[cpu]
+                 |----------------------|
+                 | lock                 |
+                 | bins[0]  (32 bytes)  | --> block --> block --> NULL
+                 | bins[1]  (40 bytes)  | --> NULL
+                 |   ...                |
+                 | bins[28] (256 bytes) | --> block --> NULL
+                 |----------------------|
+*/
+
+// Largest block (header + payload + footer) kept in the cache
+#define CACHE_MAX_BLOCK_SIZE 256
+// Bytes held by a full bin, used to compute the capacity of each size class
+#define CACHE_BIN_BYTES 2048
+// Limits of the capacity of a bin
+#define CACHE_BIN_MIN_CAPACITY 4
+#define CACHE_BIN_MAX_CAPACITY 32
+// Number of frees of a cache after which the scavenger runs
+#define CACHE_SCAVENGE_INTERVAL 4096
+// Minimum time between two scavenges of all the caches started by the frees
+#define CACHE_SCAVENGE_PERIOD_MS 100
+// One bin for every multiple of the word size between the minimum block and the max
+#define CACHE_NUM_BINS \
+    ((CACHE_MAX_BLOCK_SIZE - (sizeof(Block) + sizeof(Footer))) / sizeof(word_t) + 1)
+// The count of a bin is stored above the bits of the user addresses
+#define CACHE_COUNT_SHIFT 48
+#define CACHE_HEAD_MASK ((1UL << CACHE_COUNT_SHIFT) - 1)
+
+typedef struct CacheBin {
+    // Head of the list | count << CACHE_COUNT_SHIFT, written with a single store
+    uintptr_t top;
+    // Minimum count since the last scavenge
+    unsigned int low_water;
+} CacheBin;
+
+static inline uintptr_t cache_bin_pack(Block *head, unsigned int count) {
+    return (uintptr_t)head | ((uintptr_t)count << CACHE_COUNT_SHIFT);
+}
+
+static inline Block* cache_bin_head(const CacheBin *bin) {
+    return (Block*)(__atomic_load_n(&bin->top, __ATOMIC_RELAXED) & CACHE_HEAD_MASK);
+}
+
+static inline unsigned int cache_bin_count(const CacheBin *bin) {
+    return (unsigned int)(__atomic_load_n(&bin->top, __ATOMIC_RELAXED) >> CACHE_COUNT_SHIFT);
+}
+
+typedef struct FrontCache {
+    int lock;
+    // Frees since the last time this cache started the scavenger
+    unsigned int ops;
+    CacheBin bins[CACHE_NUM_BINS];
+    // Links of the list of the per-thread caches
+    struct FrontCache *next;
+    struct FrontCache *prev;
+} CACHE_ALIGNED FrontCache;   // Neighboring caches of the array never share a line
+
+// Array of per-cpu caches, created the first time it's needed
+static FrontCache *cpu_caches = NULL;
+static long cpu_cache_count = 0;
+static bool cpu_caches_failed = false;
+
+// Runtime values of CACHE_BIN_BYTES (0 disables the caches) and of
+// CACHE_SCAVENGE_INTERVAL, set through MY_MALLOC_CONF (see config.h)
+static size_t cache_bin_bytes = CACHE_BIN_BYTES;
+static unsigned int cache_scavenge_interval = CACHE_SCAVENGE_INTERVAL;
+// False: every thread uses its own cache even if rseq is available
+static bool cpu_caches_enabled = true;
+// Time (CLOCK_MONOTONIC, ms) of the last scavenge of all the caches
+static uint64_t cache_last_scavenge_ms = 0;
+// The per-cpu caches are used through rseq critical sections (see above)
+static bool cpu_caches_rseq = false;
+// Frees of the thread through the critical sections since it started the scavenger
+static __thread unsigned int cache_thread_ops = 0;
+
+// Cache used when the cpu can't be read through rseq
+static __thread FrontCache thread_cache;
+static __thread bool thread_cache_registered = false;
+
+// List of the per-thread caches, used by the scavenger
+static FrontCache *thread_caches_head = NULL;
+static pthread_mutex_t cache_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Key whose destructor flushes the cache of an exiting thread
+static pthread_key_t thread_cache_key;
+static pthread_once_t thread_cache_key_once = PTHREAD_ONCE_INIT;
+
+// Get the cpu of the calling thread from the rseq area, -1 if rseq is not registered
+static inline int rseq_cpu_id() {
+#ifdef HAVE_RSEQ
+    if (__rseq_size == 0) return -1;
+    struct rseq *rs = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+    // The field is updated by the kernel, so it must be read every time
+    return (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+#else
+    return -1;
+#endif
+}
+
+// The fence of the critical sections needs the registration of the address space,
+// so a forked child registers again: without it the try-locks are used
+static void cpu_caches_register_rseq() {
+#ifdef HAVE_RSEQ_CS
+    bool registered = syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+    __atomic_store_n(&cpu_caches_rseq, registered, __ATOMIC_RELAXED);
+#endif
+}
+
+static FrontCache* cpu_caches_init() {
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    if (count <= 0) {
+        cpu_caches_failed = true;
+        return NULL;
+    }
+
+    // The array is mapped directly so it doesn't take space from the heap,
+    // and the zeroed pages are already a set of empty caches
+    size_t length = (size_t)count * sizeof(FrontCache);
+    void *mem = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        cpu_caches_failed = true;
+        return NULL;
+    }
+
+    cpu_cache_count = count;
+    cpu_caches_register_rseq();
+
+    // Two threads can get here at the same time: only the first one
+    // publishes its array, the other one releases its own
+    FrontCache *expected = NULL;
+    if (!__atomic_compare_exchange_n(&cpu_caches, &expected, (FrontCache*)mem, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(mem, length);
+        return expected;
+    }
+    return (FrontCache*)mem;
+}
+
+static inline int cache_bin_index(size_t size) {
+    return (int)((size - (sizeof(Block) + sizeof(Footer))) / sizeof(word_t));
+}
+
+// High watermark of a bin: the number of blocks that fit in cache_bin_bytes
+static inline unsigned int cache_bin_capacity(int idx) {
+    size_t bin_bytes = __atomic_load_n(&cache_bin_bytes, __ATOMIC_RELAXED);
+    if (bin_bytes == 0) return 0;
+    size_t size = (sizeof(Block) + sizeof(Footer)) + (size_t)idx * sizeof(word_t);
+    size_t capacity = bin_bytes / size;
+    if (capacity < CACHE_BIN_MIN_CAPACITY) capacity = CACHE_BIN_MIN_CAPACITY;
+    if (capacity > CACHE_BIN_MAX_CAPACITY) capacity = CACHE_BIN_MAX_CAPACITY;
+    return (unsigned int)capacity;
+}
+
+// Give a chain of cached blocks (linked through the next_free link) back to the segregated lists.
+// It must be called without holding the lock of any cache: heap_free_block takes
+// the list locks, and fork_prepare takes the list locks before the cache locks.
+static void cache_release_chain(Block *chain) {
+    while (chain != NULL) {
+        Block *next = get_next_free(chain);
+        heap_free_block(chain);
+        chain = next;
+    }
+}
+
+// Take the blocks out of every bin of a locked cache and return them as
+// a single chain. If only_idle is true, only half of the low watermark
+// of each bin is taken, otherwise the bins are emptied.
+static Block* cache_detach(FrontCache *cache, bool only_idle) {
+    Block *chain = NULL;
+
+    for (int i = 0; i < (int)CACHE_NUM_BINS; i++) {
+        CacheBin *bin = &cache->bins[i];
+        Block *head = cache_bin_head(bin);
+        unsigned int count = cache_bin_count(bin);
+        unsigned int to_release = only_idle ? (bin->low_water + 1) / 2 : count;
+
+        while (to_release > 0 && head != NULL) {
+            Block *block = head;
+            head = get_next_free(block);
+            count--;
+            to_release--;
+
+            set_next_free(block, chain);
+            chain = block;
+        }
+        __atomic_store_n(&bin->top, cache_bin_pack(head, count), __ATOMIC_RELAXED);
+        bin->low_water = count;
+    }
+
+    return chain;
+}
+
+// Called by a thread that took the lock of a cache: the critical sections
+// running on its cpu are aborted, so the cache can't change anymore (see above)
+static void cache_fence(FrontCache *cache) {
+#ifdef HAVE_RSEQ_CS
+    FrontCache *caches = __atomic_load_n(&cpu_caches, __ATOMIC_ACQUIRE);
+    if (!__atomic_load_n(&cpu_caches_rseq, __ATOMIC_RELAXED) || caches == NULL ||
+        cache < caches || cache >= caches + cpu_cache_count) {
+        return;
+    }
+    int cpu = (int)(cache - caches);
+    if (syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, MEMBARRIER_CMD_FLAG_CPU, cpu) != 0) {
+        // Kernels before 5.10 can only fence all the cpus
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+    }
+#else
+    (void)cache;
+#endif
+}
+
+// Give back to the segregated lists all the blocks of a cache
+static void cache_flush(FrontCache *cache) {
+    while (__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    cache_fence(cache);
+    Block *chain = cache_detach(cache, false);
+    __atomic_store_n(&cache->lock, 0, __ATOMIC_RELEASE);
+
+    cache_release_chain(chain);
+}
+
+// Destructor of the thread-specific key: the thread is exiting, so its
+// cache is removed from the list and all its blocks go back to the heap
+static void thread_cache_destructor(void *arg) {
+    FrontCache *cache = (FrontCache*)arg;
+    // If another destructor frees memory after this one, the cache is registered again
+    thread_cache_registered = false;
+
+    pthread_mutex_lock(&cache_registry_lock);
+    if (cache->prev) cache->prev->next = cache->next;
+    else thread_caches_head = cache->next;
+    if (cache->next) cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&cache_registry_lock);
+
+    cache_flush(cache);
+}
+
+static void thread_cache_key_init() {
+    pthread_key_create(&thread_cache_key, thread_cache_destructor);
+}
+
+// Called the first time a thread uses its own cache
+static void thread_cache_register() {
+    thread_cache_registered = true;
+
+    pthread_once(&thread_cache_key_once, thread_cache_key_init);
+    pthread_setspecific(thread_cache_key, &thread_cache);
+
+    pthread_mutex_lock(&cache_registry_lock);
+    thread_cache.prev = NULL;
+    thread_cache.next = thread_caches_head;
+    if (thread_caches_head) thread_caches_head->prev = &thread_cache;
+    thread_caches_head = &thread_cache;
+    pthread_mutex_unlock(&cache_registry_lock);
+}
+
+// Shrink a single cache, skipping it if it's in use
+static void cache_scavenge_one(FrontCache *cache, bool only_idle) {
+    if (__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE)) return;
+    cache_fence(cache);
+    Block *chain = cache_detach(cache, only_idle);
+    __atomic_store_n(&cache->lock, 0, __ATOMIC_RELEASE);
+
+    cache_release_chain(chain);
+}
+
+// Go through all the per-cpu and per-thread caches and give back to the heap
+// the blocks that were not used since the last scavenge (only_idle = true),
+// or all the cached blocks (only_idle = false).
+// If wait is false and another thread is already scavenging, it returns immediately.
+static void cache_scavenge(bool only_idle, bool wait) {
+    if (wait) {
+        pthread_mutex_lock(&cache_registry_lock);
+    } else if (pthread_mutex_trylock(&cache_registry_lock) != 0) {
+        return;
+    }
+
+    FrontCache *caches = __atomic_load_n(&cpu_caches, __ATOMIC_ACQUIRE);
+    if (caches != NULL) {
+        for (long i = 0; i < cpu_cache_count; i++) {
+            cache_scavenge_one(&caches[i], only_idle);
+        }
+    }
+
+    for (FrontCache *cache = thread_caches_head; cache != NULL; cache = cache->next) {
+        cache_scavenge_one(cache, only_idle);
+    }
+
+    pthread_mutex_unlock(&cache_registry_lock);
+}
+
+// Called every cache_scavenge_interval frees of a cache, after its lock is released:
+// all the caches are scavenged if the last time was long enough ago, otherwise this one
+static void cache_scavenge_periodic(FrontCache *cache) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+
+    uint64_t last = __atomic_load_n(&cache_last_scavenge_ms, __ATOMIC_RELAXED);
+    if (now - last >= CACHE_SCAVENGE_PERIOD_MS &&
+        __atomic_compare_exchange_n(&cache_last_scavenge_ms, &last, now, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cache_scavenge(true, false);
+    } else {
+        cache_scavenge_one(cache, true);
+    }
+}
+
+// Use the per-cpu caches when rseq is available (the default), or always the
+// per-thread ones. The blocks already cached stay where they are.
+void set_cpu_caches(bool enabled) {
+    __atomic_store_n(&cpu_caches_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+// Select the cache of the calling thread: the one of its cpu (*cpu is set),
+// or its own cache (*cpu is -1)
+static inline FrontCache* cache_select(int *cpu) {
+    *cpu = rseq_cpu_id();
+    if (*cpu >= 0 && !cpu_caches_failed && __atomic_load_n(&cpu_caches_enabled, __ATOMIC_RELAXED)) {
+        FrontCache *caches = __atomic_load_n(&cpu_caches, __ATOMIC_ACQUIRE);
+        if (caches == NULL) caches = cpu_caches_init();
+        if (caches != NULL && *cpu < cpu_cache_count) return &caches[*cpu];
+    }
+
+    *cpu = -1;
+    if (!thread_cache_registered) thread_cache_register();
+    return &thread_cache;
+}
+
+// Select and lock the cache of the calling thread.
+// Returns NULL if the cache is in use by another thread.
+static inline FrontCache* cache_acquire() {
+    int cpu;
+    FrontCache *cache = cache_select(&cpu);
+
+    if (__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return cache;
+}
+
+static inline void cache_release(FrontCache *cache) {
+    __atomic_store_n(&cache->lock, 0, __ATOMIC_RELEASE);
+}
+
+#ifdef HAVE_RSEQ_CS
+/*
+    The critical sections. The descriptor (struct rseq_cs) goes in the __rseq_cs
+    section: the start of the sequence (1), the length up to the commit (2) and
+    the abort handler (4), preceded by the signature that the kernel checks.
+    The sequence registers the descriptor in the rseq area of the thread, then:
+        - leaves for retry if the thread is not on the cpu of the cache anymore,
+        or if the bin changed since it was read (the caller reads it again);
+        - leaves for bail if the cache is locked by another thread;
+        - commits the new top of the bin with the last instruction.
+*/
+#define RSEQ_CS_BEGIN                                                       \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                                   \
+    ".balign 32\n\t"                                                        \
+    "3:\n\t"                                                                \
+    ".long 0x0, 0x0\n\t"                                                    \
+    ".quad 1f, (2f - 1f), 4f\n\t"                                           \
+    ".popsection\n\t"                                                      \
+    "leaq 3b(%%rip), %%rax\n\t"                                             \
+    "movq %%rax, %c[cs_off](%[rs])\n\t"                                     \
+    "1:\n\t"                                                                \
+    "cmpl %k[cpu], %c[cpu_off](%[rs])\n\t"                                  \
+    "jnz %l[retry]\n\t"                                                     \
+    "cmpl $0, %c[lock_off](%[cache])\n\t"                                   \
+    "jnz %l[bail]\n\t"                                                      \
+    "cmpq %[expected], (%[bin])\n\t"                                        \
+    "jnz %l[retry]\n\t"
+
+#define RSEQ_CS_END                                                         \
+    "2:\n\t"                                                                \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                              \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                            \
+    ".long %c[sig]\n\t"                                                     \
+    "4:\n\t"                                                                \
+    "jmp %l[retry]\n\t"                                                     \
+    ".popsection\n\t"
+
+#define RSEQ_CS_INPUTS                                                      \
+    [rs] "r" (rs), [cpu] "r" (cpu), [cache] "r" (cache), [bin] "r" (bin),   \
+    [expected] "r" (top),                                                   \
+    [cs_off] "i" (offsetof(struct rseq, rseq_cs)),                          \
+    [cpu_off] "i" (offsetof(struct rseq, cpu_id)),                          \
+    [lock_off] "i" (offsetof(FrontCache, lock)), [sig] "i" (RSEQ_SIG)
+
+// Result of a critical section
+#define RSEQ_DONE 0
+#define RSEQ_RETRY 1            // Preempted, migrated or raced: read the bin again
+#define RSEQ_BAIL 2             // The cache is locked: skip it
+
+static inline struct rseq* rseq_area() {
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// Pop the head of the bin, if it's still top: the link of the head is read
+// inside the sequence, since only there the head can't be popped by another thread
+static inline int rseq_bin_pop(FrontCache *cache, int cpu, CacheBin *bin, uintptr_t top) {
+    struct rseq *rs = rseq_area();
+    Block *head = (Block*)(top & CACHE_HEAD_MASK);
+    Block **link = &head->next_free;
+    // The link is decoded with the key of its position (see mangle_link())
+    uintptr_t key = mangle_link(link, 0);
+    unsigned int count = (unsigned int)(top >> CACHE_COUNT_SHIFT) - 1;
+    uintptr_t count_bits = (uintptr_t)count << CACHE_COUNT_SHIFT;
+
+    asm goto (
+        RSEQ_CS_BEGIN
+        "movq (%[link]), %%rax\n\t"
+        "xorq %[key], %%rax\n\t"
+        "orq %[count_bits], %%rax\n\t"
+        "cmpl %k[count], %c[low_off](%[bin])\n\t"
+        "jbe 5f\n\t"
+        "movl %k[count], %c[low_off](%[bin])\n\t"
+        "5:\n\t"
+        // Commit
+        "movq %%rax, (%[bin])\n\t"
+        RSEQ_CS_END
+        :
+        : RSEQ_CS_INPUTS, [link] "r" (link), [key] "r" (key), [count_bits] "r" (count_bits),
+          [count] "r" (count), [low_off] "i" (offsetof(CacheBin, low_water))
+        : "rax", "memory", "cc"
+        : retry, bail);
+    return RSEQ_DONE;
+retry:
+    return RSEQ_RETRY;
+bail:
+    return RSEQ_BAIL;
+}
+
+// Push a block on the bin, if top didn't change
+static inline int rseq_bin_push(FrontCache *cache, int cpu, CacheBin *bin, uintptr_t top, Block *block) {
+    struct rseq *rs = rseq_area();
+    Block **link = &block->next_free;
+    uintptr_t link_value = mangle_link(link, top & CACHE_HEAD_MASK);
+    uintptr_t new_top = cache_bin_pack(block, (unsigned int)(top >> CACHE_COUNT_SHIFT) + 1);
+
+    asm goto (
+        RSEQ_CS_BEGIN
+        // The block still belongs to the thread: its link can be written before the commit
+        "movq %[link_value], (%[link])\n\t"
+        // Commit
+        "movq %[new_top], (%[bin])\n\t"
+        RSEQ_CS_END
+        :
+        : RSEQ_CS_INPUTS, [link] "r" (link), [link_value] "r" (link_value), [new_top] "r" (new_top)
+        : "rax", "memory", "cc"
+        : retry, bail);
+    return RSEQ_DONE;
+retry:
+    return RSEQ_RETRY;
+bail:
+    return RSEQ_BAIL;
+}
+#endif
+
+// Take the head of a bin, with the lock of its cache held
+static inline Block* cache_bin_take(CacheBin *bin) {
+    Block *block = cache_bin_head(bin);
+    if (block != NULL) {
+        check_popped_block(block, "my_malloc");
+        unsigned int count = cache_bin_count(bin) - 1;
+        __atomic_store_n(&bin->top, cache_bin_pack(get_next_free(block), count), __ATOMIC_RELAXED);
+        if (count < bin->low_water) bin->low_water = count;
+    }
+    return block;
+}
+
+// Take a block of exactly the given total size from the cache, NULL if there is none
+static inline Block* cache_pop(size_t size) {
+    if (size > CACHE_MAX_BLOCK_SIZE) return NULL;
+    int idx = cache_bin_index(size);
+
+    int cpu;
+    FrontCache *cache = cache_select(&cpu);
+#ifdef HAVE_RSEQ_CS
+    while (cpu >= 0 && __atomic_load_n(&cpu_caches_rseq, __ATOMIC_RELAXED)) {
+        CacheBin *bin = &cache->bins[idx];
+        uintptr_t top = __atomic_load_n(&bin->top, __ATOMIC_RELAXED);
+        Block *block = (Block*)(top & CACHE_HEAD_MASK);
+        if (block == NULL) return NULL;
+
+        int result = rseq_bin_pop(cache, cpu, bin, top);
+        if (result == RSEQ_BAIL) return NULL;
+        if (result == RSEQ_DONE) {
+            // The block belongs to the thread now: its header and its link are checked
+            // before the next pop follows the link
+            check_popped_block(block, "my_malloc");
+            Block *next = get_next_free(block);
+            prefetch_block(next);
+            return block;
+        }
+        cache = cache_select(&cpu);
+    }
+#endif
+
+    if (__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE)) return NULL;
+    CacheBin *bin = &cache->bins[idx];
+    Block *block = cache_bin_take(bin);
+    // The next pop reads the link of the new head
+    if (block != NULL) prefetch_block(cache_bin_head(bin));
+    cache_release(cache);
+    return block;
+}
+
+// Put a used block in the cache. Returns false if the block
+// doesn't fit in the cache, so it must go back to the heap.
+static inline bool cache_push(Block *block) {
+    size_t size = get_size(block);
+    if (size > CACHE_MAX_BLOCK_SIZE) return false;
+    int idx = cache_bin_index(size);
+    unsigned int capacity = cache_bin_capacity(idx);
+    unsigned int interval = __atomic_load_n(&cache_scavenge_interval, __ATOMIC_RELAXED);
+
+    int cpu;
+    FrontCache *cache = cache_select(&cpu);
+#ifdef HAVE_RSEQ_CS
+    while (cpu >= 0 && __atomic_load_n(&cpu_caches_rseq, __ATOMIC_RELAXED)) {
+        CacheBin *bin = &cache->bins[idx];
+        uintptr_t top = __atomic_load_n(&bin->top, __ATOMIC_RELAXED);
+        int result = RSEQ_BAIL;
+        if ((unsigned int)(top >> CACHE_COUNT_SHIFT) < capacity) {
+            result = rseq_bin_push(cache, cpu, bin, top, block);
+            if (result == RSEQ_RETRY) {
+                cache = cache_select(&cpu);
+                continue;
+            }
+        }
+
+        // The scavenger runs outside the critical section
+        if (++cache_thread_ops >= interval) {
+            cache_thread_ops = 0;
+            cache_scavenge_periodic(cache);
+        }
+        return result == RSEQ_DONE;
+    }
+#endif
+
+    if (__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE)) return false;
+
+    CacheBin *bin = &cache->bins[idx];
+    unsigned int count = cache_bin_count(bin);
+    bool pushed = false;
+    if (count < capacity) {
+        set_next_free(block, cache_bin_head(bin));
+        __atomic_store_n(&bin->top, cache_bin_pack(block, count + 1), __ATOMIC_RELAXED);
+        pushed = true;
+    }
+
+    bool scavenge = (++cache->ops >= interval);
+    if (scavenge) cache->ops = 0;
+
+    cache_release(cache);
+
+    // The scavenger runs after the lock of this cache is released
+    if (scavenge) cache_scavenge_periodic(cache);
+
+    return pushed;
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
 
 /*
     -------- DATA STRUCTURES USED IN THE DYNAMIC ALLOCATOR ----------
@@ -62,6 +63,44 @@
         - Segregated list: it's an array of doubly linked lists that keeps track of the current
         free blocks. The purpose of this method is to make searching through the
         free blocks more efficient, to find one of the right size for allocation.
+
+    -------- LOCKS ----------
+
+    The allocator can be used by many threads at the same time. Instead of a single
+    lock around my_malloc and my_free, every list of the segregated list has its own lock,
+    so threads that allocate blocks of different sizes don't wait for each other:
+        - segregatedLists[i].lock: protects the links of the list and the header of
+        every free block stored in it. A free block is always marked as free and inserted
+        while holding the lock of its list, and it's always removed and marked as used
+        while holding the same lock. Therefore, a thread that holds the lock and reads
+        a free header in a block of the right size knows that the block is in that list.
+        - heap_state.growth_lock: protects the top, the end, the gap pointers and the
+        sbrk calls. The top can be read without the lock (see get_heap_top()): it only grows,
+        except during a compaction pass (handles.h).
+        - mmap_tracker.lock (mmap_allocator.h): protects the list of the mmap blocks.
+    A thread that holds more than one list lock takes them in ascending order of
+    index: my_free of a heap block locks the lists of its free neighbors and of the
+    merged block (at most three, see heap_free_block()), the compaction pass and
+    the fork handlers take all of them. The growth lock is always taken before a
+    list lock, so the locks can't deadlock.
+
+    -------- CACHE LINES ----------
+
+    The global state is read and written by every thread, so its layout in memory
+    matters as much as the locks: two variables in the same cache line (64 bytes)
+    bounce between the cores even if they are protected by different locks
+    (false sharing), and the hot path pays a miss for every line it touches.
+    For this reason the state is grouped by who uses it, and every group starts
+    on its own cache line (CACHE_ALIGNED):
+        - heap_state: the pointers of the heap (top, end, gaps) in one line, read
+        by every allocation and free, and the growth lock in the next one, so that
+        the threads waiting for it don't invalidate the pointers for the readers.
+        - segregatedLists[i]: the head of each list next to its lock, one list per
+        line. The thread that takes the lock is the one that touches the head.
+        - Per-cpu caches, fast lists, page heaps and slab classes (in their own
+        headers) are padded the same way, one per line.
+        - Cold state, like the list of the mmap blocks, is in separate aligned
+        structs, so it never shares a line with the hot state.
 */
 
 // Heap starts with 4 KB of memory
@@ -71,6 +110,10 @@
 // Threshold to use mmap instead of the heap (in this case 128KB)
 #define MMAP_THRESHOLD (128 * 1024)
 
+// Size of a cache line on x86-64 and most ARM cores
+#define CACHE_LINE_SIZE 64
+#define CACHE_ALIGNED __attribute__((aligned(CACHE_LINE_SIZE)))
+
 // Define the size of a word and the size of a header
 // to make the code clearer
 typedef intptr_t word_t;
@@ -83,37 +126,95 @@ typedef size_t Footer;
 // (0x07 = 0000...0111) and then negates it (so,
 // = 1111...1000). With this mask, we can easily eliminate 
 // the last 3 bits of a header to get just the size.
-#define SIZE_MASK (~(sizeof(word_t) - 1))
+// The 16 most significant bits of a header hold its checksum (see utils.h),
+// so they are not part of the size either, and neither is the bit below them.
+#define HEADER_CHECK_SHIFT 48
+#define HEADER_FIELDS_MASK ((1UL << HEADER_CHECK_SHIFT) - 1)
+// Flag of the used blocks whose allocation site was recorded (see leak_check.h):
+// sizes are below 128 TB, so the highest bit of the fields is free for it
+#define SAMPLED_FLAG (1UL << (HEADER_CHECK_SHIFT - 1))
+#define SIZE_MASK (~(sizeof(word_t) - 1) & (SAMPLED_FLAG - 1))
+// Flag of the blocks kept in a per-cpu cache or in a fast list (they are still
+// marked as used): it's set only when the header checks are enabled
+#define CACHED_FLAG 4UL
+
+/*
+    With COMPRESSED_LINKS defined at compile time (gcc -DCOMPRESSED_LINKS ...),
+    the links of the free lists are stored as 32-bit offsets instead of pointers.
+    Offsets are counted in words (8 bytes) from the start of the static heap, so
+    the heap and its sbrk region can span up to 32 GB; 0 is used as NULL (the
+    stored value is the offset + 1). This makes sizeof(Block) 16 bytes instead
+    of 24, and the minimum block (header + links + footer) 24 bytes instead of 32.
+    The links must always be accessed through get_next_free() / set_next_free()
+    and the other functions in utils.h.
+*/
+#define LINK_SHIFT 3
+#define COMPRESSED_LINKS_RANGE ((size_t)UINT32_MAX << LINK_SHIFT)
 
 typedef struct Block {
     size_t header;
 
     union {
         struct {
+#ifdef COMPRESSED_LINKS
+            uint32_t next_link;
+            uint32_t prev_link;
+#else
             struct Block *next_free;
             struct Block *prev_free;
+#endif
         };
         unsigned char payload[0];
     };
 } Block;
 
-// Definition of the heap, which is an array of bytes (unsigned char)
-static unsigned char heap[HEAP_TOTAL_SIZE];
-
-// Pointers to handle the heap
-
-// Points to the top of the allocated portion of the heap
-static unsigned char *heap_top = heap; 
-//Pointer to the end of the heap array
-static unsigned char *heap_end = heap + HEAP_TOTAL_SIZE;
-
-// Pointer to the first block, which starts at the beginning of the heap
-static Block* heap_start = (Block *)heap;
-
-// Array of segregated free lists
-static Block *segregatedLists[NUM_LISTS] = { NULL };
-
-static unsigned char *gap_start = NULL;  // Start of the gap (end of static heap usage)
-static unsigned char *gap_end = NULL;    // End of the gap (start of sbrk memory)
+// Definition of the heap, which is an array of bytes (unsigned char).
+// It's aligned to a page so that its pages don't contain other variables
+// (the page map in page_map.h works on whole pages).
+static unsigned char heap[HEAP_TOTAL_SIZE] __attribute__((aligned(4096)));
+
+// Hot state of the heap.
+// The first line is read by every allocation and free: the pointers are written
+// only while holding growth_lock, which is in the second line with the pointers
+// that only the growth uses.
+typedef struct HeapState {
+    // Points to the top of the allocated portion of the heap
+    unsigned char *top;
+    // Pointer to the end of the heap (static array or sbrk region)
+    unsigned char *end;
+    unsigned char *gap_start;   // Start of the gap (end of static heap usage)
+    unsigned char *gap_end;     // End of the gap (start of sbrk memory)
+    // Pointer to the first block, which starts at the beginning of the heap
+    Block *start;
+
+    // Lock for the growth of the heap (top, end, gap pointers and sbrk)
+    pthread_mutex_t growth_lock CACHE_ALIGNED;
+    // Pages above the top given back by heap_compact(), out of the memory budget
+    // until the top reaches them again (NULL: none)
+    unsigned char *trim_start;
+    unsigned char *trim_end;
+} CACHE_ALIGNED HeapState;
+
+static HeapState heap_state = {
+    .top = heap,
+    .end = heap + HEAP_TOTAL_SIZE,
+    .gap_start = NULL,
+    .gap_end = NULL,
+    .start = (Block *)heap,
+    .growth_lock = PTHREAD_MUTEX_INITIALIZER,
+    .trim_start = NULL,
+    .trim_end = NULL
+};
+
+// A segregated list and its lock, in a cache line of their own
+typedef struct SegregatedList {
+    pthread_mutex_t lock;
+    Block *head;
+} CACHE_ALIGNED SegregatedList;
+
+// Array of segregated free lists, with one lock for every list
+static SegregatedList segregatedLists[NUM_LISTS] = {
+    [0 ... NUM_LISTS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER, .head = NULL }
+};
 
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include "data_structure.h"
 #include "utils.h"
 #include "mmap_allocator.h"
+#include "page_heap.h"
 
 /* ------------- DEBUG UTILITY ---------------------
     Includes functions useful to analyze and debug the allocator.
@@ -17,7 +18,8 @@
         c. Blocks in static memory
         d. Blocks allocated in sbrk extended area
     2. Mmap allocated blocks
-    3. Segregated free lists
+    3. Spans of the page heap
+    4. Segregated free lists
 */
 
 static void print_memory() {
@@ -30,23 +32,23 @@ static void print_memory() {
     printf("┌─────────────────────────────────────────────────────────────────┐\n");
     printf("│ HEAP POINTERS                                                   │\n");
     printf("├─────────────────────────────────────────────────────────────────┤\n");
-    printf("│ heap_start: %p                                      │\n", (void*)heap_start);
-    printf("│ heap_top:   %p                                      │\n", (void*)heap_top);
-    printf("│ heap_end:   %p                                      │\n", (void*)heap_end);
+    printf("│ heap_start: %p                                      │\n", (void*)heap_state.start);
+    printf("│ heap_top:   %p                                      │\n", (void*)heap_state.top);
+    printf("│ heap_end:   %p                                      │\n", (void*)heap_state.end);
     printf("│ Static heap size: %zu bytes                                    │\n", (size_t)HEAP_TOTAL_SIZE);
     printf("│ Used in static heap: %ld bytes                                  │\n", 
-           (long)(heap_top - (unsigned char*)heap_start));
+           (long)(heap_state.top - (unsigned char*)heap_state.start));
     printf("└─────────────────────────────────────────────────────────────────┘\n\n");
     
     // Print gap info
     printf("┌─────────────────────────────────────────────────────────────────┐\n");
     printf("│ GAP INFO (between static heap and sbrk memory)                  │\n");
     printf("├─────────────────────────────────────────────────────────────────┤\n");
-    if (gap_start != NULL && gap_end != NULL) {
-        printf("│ gap_start:  %p                                      │\n", (void*)gap_start);
-        printf("│ gap_end:    %p                                      │\n", (void*)gap_end);
+    if (heap_state.gap_start != NULL && heap_state.gap_end != NULL) {
+        printf("│ gap_start:  %p                                      │\n", (void*)heap_state.gap_start);
+        printf("│ gap_end:    %p                                      │\n", (void*)heap_state.gap_end);
         printf("│ Gap size:   %ld bytes                                        │\n", 
-               (long)(gap_end - gap_start));
+               (long)(heap_state.gap_end - heap_state.gap_start));
     } else {
         printf("│ No gap exists (sbrk not used or memory is contiguous)         │\n");
     }
@@ -57,15 +59,15 @@ static void print_memory() {
     printf("│ BLOCKS IN MEMORY                                                │\n");
     printf("├─────────────────────────────────────────────────────────────────┤\n");
     
-    unsigned char *current = (unsigned char*)heap_start;
+    unsigned char *current = (unsigned char*)heap_state.start;
     int block_num = 0;
     
     // Determine the end of the static heap region
-    unsigned char *static_heap_end = (gap_start != NULL) ? gap_start : heap_top;
+    unsigned char *static_heap_end = (heap_state.gap_start != NULL) ? heap_state.gap_start : heap_state.top;
     
-    // If heap_top is still within static heap bounds
-    if (heap_top <= heap + HEAP_TOTAL_SIZE) {
-        static_heap_end = heap_top;
+    // If heap_state.top is still within static heap bounds
+    if (heap_state.top <= heap + HEAP_TOTAL_SIZE) {
+        static_heap_end = heap_state.top;
     }
     
     printf("│                                                                 │\n");
@@ -95,8 +97,8 @@ static void print_memory() {
         printf("│   Payload addr: %p                                  │\n", (void*)block->payload);
         
         if (!used) {
-            printf("│   next_free:    %p                                  │\n", (void*)block->next_free);
-            printf("│   prev_free:    %p                                  │\n", (void*)block->prev_free);
+            printf("│   next_free:    %p                                  │\n", (void*)get_next_free(block));
+            printf("│   prev_free:    %p                                  │\n", (void*)get_prev_free(block));
         }
         printf("│                                                                 │\n");
         
@@ -105,19 +107,19 @@ static void print_memory() {
     }
     
     // Print gap visualization if exists
-    if (gap_start != NULL && gap_end != NULL) {
+    if (heap_state.gap_start != NULL && heap_state.gap_end != NULL) {
         printf("│ === MEMORY GAP ===                                              │\n");
-        printf("│   From: %p                                          │\n", (void*)gap_start);
-        printf("│   To:   %p                                          │\n", (void*)gap_end);
+        printf("│   From: %p                                          │\n", (void*)heap_state.gap_start);
+        printf("│   To:   %p                                          │\n", (void*)heap_state.gap_end);
         printf("│   Size: %ld bytes (UNUSABLE)                                 │\n", 
-               (long)(gap_end - gap_start));
+               (long)(heap_state.gap_end - heap_state.gap_start));
         printf("│                                                                 │\n");
         
         // Traverse sbrk-allocated region
         printf("│ === SBRK ALLOCATED REGION ===                                   │\n");
         
-        current = gap_end;
-        while (current < heap_top) {
+        current = heap_state.gap_end;
+        while (current < heap_state.top) {
             Block *block = (Block*)current;
             size_t size = get_size(block);
             
@@ -140,8 +142,8 @@ static void print_memory() {
             printf("│   Payload addr: %p                                  │\n", (void*)block->payload);
             
             if (!used) {
-                printf("│   next_free:    %p                                  │\n", (void*)block->next_free);
-                printf("│   prev_free:    %p                                  │\n", (void*)block->prev_free);
+                printf("│   next_free:    %p                                  │\n", (void*)get_next_free(block));
+                printf("│   prev_free:    %p                                  │\n", (void*)get_prev_free(block));
             }
             printf("│                                                                 │\n");
             
@@ -161,7 +163,7 @@ static void print_memory() {
     // mmap blocks do NOT live inside the custom heap regions, so we print
     // the tracked list built in mmap_allocator.h
     int mmap_count = 0;
-    MmapTrackNode *mcur = mmap_tracked_head;
+    MmapTrackNode *mcur = mmap_tracker.head;
     while (mcur != NULL) {
         Block *block = mcur->block;
         size_t size = get_size(block);
@@ -184,6 +186,36 @@ static void print_memory() {
     }
     printf("└─────────────────────────────────────────────────────────────────┘\n\n");
     
+    // Print the spans of the page heaps, chunk by chunk
+    printf("┌─────────────────────────────────────────────────────────────────┐\n");
+    printf("│ PAGE HEAP SPANS                                                 │\n");
+    printf("├─────────────────────────────────────────────────────────────────┤\n");
+
+    int chunk_count = 0;
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        for (Span *chunk = page_heaps[node].chunks; chunk != NULL; chunk = chunk->next) {
+            printf("│ Chunk #%d (node %d): %p, %zu pages                       │\n",
+                   chunk_count, node, (void*)chunk->start, chunk->npages);
+
+            // Spans tile the chunk: the first page of each one points to its Span struct
+            uintptr_t addr = chunk->start;
+            while (addr < span_end(chunk)) {
+                Span *span = (Span*)page_map_meta(page_map_get((void*)addr));
+                printf("│   Span %p: %3zu pages  %-8s%s                       │\n",
+                       (void*)span->start, span->npages,
+                       span->state == SPAN_IN_USE ? "USED" : (span->state == SPAN_SLAB ? "SLAB" : "FREE"),
+                       span->released ? " (released)" : "");
+                addr = span_end(span);
+            }
+            chunk_count++;
+        }
+    }
+
+    if (chunk_count == 0) {
+        printf("│ No spans allocated                                              │\n");
+    }
+    printf("└─────────────────────────────────────────────────────────────────┘\n\n");
+    
     // Print segregated free lists
     printf("┌─────────────────────────────────────────────────────────────────┐\n");
     printf("│ SEGREGATED FREE LISTS                                           │\n");
@@ -201,7 +233,7 @@ static void print_memory() {
     for (int i = 0; i < NUM_LISTS; i++) {
         printf("│ List[%d] (%s):                                       │\n", i, list_ranges[i]);
         
-        Block *curr = segregatedLists[i];
+        Block *curr = segregatedLists[i].head;
         if (curr == NULL) {
             printf("│   (empty)                                                       │\n");
         } else {
@@ -209,7 +241,7 @@ static void print_memory() {
             while (curr != NULL && count < 10) {  // Limit to prevent infinite loops
                 printf("│   -> %p (size: %zu)                             │\n", 
                        (void*)curr, get_size(curr));
-                curr = curr->next_free;
+                curr = get_next_free(curr);
                 count++;
             }
             if (curr != NULL) {
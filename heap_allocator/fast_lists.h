@@ -0,0 +1,112 @@
+#ifndef FAST_LISTS_H
+#define FAST_LISTS_H
+
+#include "data_structure.h"
+#include "utils.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+    ------- SINGLY-LINKED FAST LISTS FOR SMALL CLASSES ----------
+
+    The segregated lists are doubly linked because coalesce must be able to
+    take any free block out of the middle of its list. Small blocks are freed
+    and allocated again so often that merging them every time is wasted work:
+    they would be split again at the next malloc of the same size.
+
+    So small blocks (up to FAST_MAX_BLOCK_SIZE bytes) that don't fit in the
+    per-cpu cache are kept in fast lists instead, with deferred coalescing:
+        - There is one list for every exact block size, shared by all the threads.
+        - A block in a fast list stays marked as used, so coalesce never touches
+        it: it's removed only from the head of its list, by my_malloc. For this
+        reason a single link (next_free) is enough, and push and pop write one
+        link and one head instead of updating two neighbors.
+        - Push and pop are lock-free: the head is a tagged pointer, a word that
+        contains the address of the first block in the lower 48 bits (user space
+        addresses use 48 bits, see page_map.h) and a counter in the upper 16 bits.
+        The counter is incremented by every change, so a pop that read an old head
+        fails its compare-and-swap even if the same block is back on the head
+        in the meantime (the ABA problem).
+        - When the heap has no free block for a request, before growing it the fast
+        lists are consolidated: all their blocks are freed for real, merged with
+        their neighbors and inserted in the segregated lists (fast_consolidate()
+        in algorithms.h).
+*/
+
+// Largest block (header + payload + footer) kept in the fast lists
+#define FAST_MAX_BLOCK_SIZE 128
+#define FAST_NUM_LISTS \
+    ((FAST_MAX_BLOCK_SIZE - (sizeof(Block) + sizeof(Footer))) / sizeof(word_t) + 1)
+#define FAST_TAG_SHIFT 48
+#define FAST_PTR_MASK ((1ULL << FAST_TAG_SHIFT) - 1)
+
+typedef uint64_t TaggedPtr;
+
+// Every head is CAS'd by all the threads: one cache line each, so that the
+// lists of different sizes don't slow each other down
+typedef struct FastList {
+    TaggedPtr head;
+} CACHE_ALIGNED FastList;
+
+static FastList fast_lists[FAST_NUM_LISTS];
+
+static inline Block* tagged_ptr(TaggedPtr head) {
+    return (Block*)(uintptr_t)(head & FAST_PTR_MASK);
+}
+
+// New head pointing to block, with the counter of the old head incremented
+static inline TaggedPtr tagged_next(TaggedPtr head, Block *block) {
+    return (((head >> FAST_TAG_SHIFT) + 1) << FAST_TAG_SHIFT) | (uintptr_t)block;
+}
+
+static inline int fast_list_index(size_t size) {
+    return (int)((size - (sizeof(Block) + sizeof(Footer))) / sizeof(word_t));
+}
+
+// Push a used block in the fast list of its size. Returns false if it's too big.
+static bool fast_push(Block *block) {
+    size_t size = get_size(block);
+    if (size > FAST_MAX_BLOCK_SIZE) return false;
+
+    TaggedPtr *list = &fast_lists[fast_list_index(size)].head;
+    TaggedPtr head = __atomic_load_n(list, __ATOMIC_RELAXED);
+    do {
+        set_next_free(block, tagged_ptr(head));
+    } while (!__atomic_compare_exchange_n(list, &head, tagged_next(head, block), true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return true;
+}
+
+// Pop a block of exactly the given size, NULL if the list is empty
+static Block* fast_pop(size_t size) {
+    if (size > FAST_MAX_BLOCK_SIZE) return NULL;
+
+    TaggedPtr *list = &fast_lists[fast_list_index(size)].head;
+    TaggedPtr head = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+    Block *block;
+    do {
+        block = tagged_ptr(head);
+        if (block == NULL) return NULL;
+        // The block may be popped and reused by another thread while we read
+        // its link: in that case the counter changed and the CAS fails
+    } while (!__atomic_compare_exchange_n(list, &head, tagged_next(head, peek_next_free(block)), true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    check_popped_block(block, "my_malloc");
+    // Now the block is ours, so its link (the new head) is checked. The next
+    // pop reads the link of the new head: it's prefetched
+    prefetch_block(get_next_free(block));
+    return block;
+}
+
+// Take all the blocks of a fast list, as a chain linked through next_free
+static Block* fast_detach(int idx) {
+    TaggedPtr *list = &fast_lists[idx].head;
+    TaggedPtr head = __atomic_load_n(list, __ATOMIC_ACQUIRE);
+    while (tagged_ptr(head) != NULL &&
+           !__atomic_compare_exchange_n(list, &head, tagged_next(head, NULL), true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    }
+    return tagged_ptr(head);
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef FORK_SAFETY_H
+#define FORK_SAFETY_H
+
+#include "data_structure.h"
+#include "mmap_allocator.h"
+#include "cpu_cache.h"
+#include "page_heap.h"
+#include "slab.h"
+#include "handles.h"
+#include "guarded_pool.h"
+#include "quarantine.h"
+#include "leak_check.h"
+#include "memory_monitor.h"
+#include <pthread.h>
+#include <sched.h>
+
+/*
+    ------- FORK SAFETY ----------
+
+    When a multithreaded process calls fork(), the child gets a copy of the
+    whole memory but only the thread that called fork. If another thread
+    was holding one of the allocator locks at that moment, in the child that
+    lock stays locked forever (its owner doesn't exist there) and the first
+    my_malloc that needs it deadlocks. The memory protected by the lock can
+    also be half updated.
+
+    To avoid this, three handlers are registered with pthread_atfork:
+        1. prepare: called before fork, it takes every allocator lock,
+           following the usual lock order (the locks of the memory monitor
+           and of the reclaim callbacks, which are held while the heap is
+           trimmed or while nothing else is locked; then cache registry lock,
+           handle lock, growth lock, list locks; then the mmap list, slab class,
+           page heap, metadata, guarded pool, quarantine and leak table locks).
+           When it returns, no other thread is in the middle of an
+           operation, so the heap is consistent.
+        2. parent: called in the parent after fork, it releases the locks.
+        3. child: called in the child after fork, it initializes the locks
+           again, since their owner is not the thread that runs in the child.
+
+    The handlers are registered by a constructor, before main starts.
+*/
+
+static void fork_prepare() {
+    // set_memory_monitor() holds the control lock while the monitor thread,
+    // which may be trimming the heap, exits: it goes before the heap locks
+    pthread_mutex_lock(&monitor_control_lock);
+    pthread_mutex_lock(&memory_monitor.lock);
+    pthread_mutex_lock(&reclaim_lock);
+    pthread_mutex_lock(&cache_registry_lock);
+    pthread_mutex_lock(&handle_lock);
+    pthread_mutex_lock(&heap_state.growth_lock);
+    for (int i = 0; i < NUM_LISTS; i++) {
+        pthread_mutex_lock(&segregatedLists[i].lock);
+    }
+    pthread_mutex_lock(&mmap_tracker.lock);
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        pthread_mutex_lock(&slab_classes[i].lock);
+    }
+    for (int i = 0; i < MAX_NUMA_NODES; i++) {
+        pthread_mutex_lock(&page_heaps[i].lock);
+    }
+    pthread_mutex_lock(&span_meta_lock);
+    pthread_mutex_lock(&slab_meta_lock);
+    pthread_mutex_lock(&guarded_lock);
+    pthread_mutex_lock(&quarantine_lock);
+    pthread_mutex_lock(&leak_lock);
+
+    // The per-cpu caches use try-locks, so here we wait until they are released
+    FrontCache *caches = __atomic_load_n(&cpu_caches, __ATOMIC_ACQUIRE);
+    if (caches != NULL) {
+        for (long i = 0; i < cpu_cache_count; i++) {
+            while (__atomic_exchange_n(&caches[i].lock, 1, __ATOMIC_ACQUIRE)) {
+                sched_yield();
+            }
+        }
+    }
+}
+
+static void fork_parent() {
+    FrontCache *caches = __atomic_load_n(&cpu_caches, __ATOMIC_ACQUIRE);
+    if (caches != NULL) {
+        for (long i = 0; i < cpu_cache_count; i++) {
+            cache_release(&caches[i]);
+        }
+    }
+
+    pthread_mutex_unlock(&leak_lock);
+    pthread_mutex_unlock(&quarantine_lock);
+    pthread_mutex_unlock(&guarded_lock);
+    pthread_mutex_unlock(&slab_meta_lock);
+    pthread_mutex_unlock(&span_meta_lock);
+    for (int i = MAX_NUMA_NODES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&page_heaps[i].lock);
+    }
+    for (int i = SLAB_NUM_CLASSES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&slab_classes[i].lock);
+    }
+    pthread_mutex_unlock(&mmap_tracker.lock);
+    for (int i = NUM_LISTS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&segregatedLists[i].lock);
+    }
+    pthread_mutex_unlock(&heap_state.growth_lock);
+    pthread_mutex_unlock(&handle_lock);
+    pthread_mutex_unlock(&cache_registry_lock);
+    pthread_mutex_unlock(&reclaim_lock);
+    pthread_mutex_unlock(&memory_monitor.lock);
+    pthread_mutex_unlock(&monitor_control_lock);
+}
+
+static void fork_child() {
+    // The memory monitor thread doesn't exist in the child: it can be started again
+    pthread_mutex_init(&monitor_control_lock, NULL);
+    pthread_mutex_init(&memory_monitor.lock, NULL);
+    pthread_cond_init(&memory_monitor.wakeup, NULL);
+    memory_monitor.running = false;
+    pthread_mutex_init(&reclaim_lock, NULL);
+
+    FrontCache *caches = __atomic_load_n(&cpu_caches, __ATOMIC_ACQUIRE);
+    if (caches != NULL) {
+        for (long i = 0; i < cpu_cache_count; i++) {
+            caches[i].lock = 0;
+        }
+        cpu_caches_register_rseq();
+    }
+
+    pthread_mutex_init(&leak_lock, NULL);
+    pthread_mutex_init(&quarantine_lock, NULL);
+    pthread_mutex_init(&guarded_lock, NULL);
+    pthread_mutex_init(&slab_meta_lock, NULL);
+    pthread_mutex_init(&span_meta_lock, NULL);
+    for (int i = 0; i < MAX_NUMA_NODES; i++) {
+        pthread_mutex_init(&page_heaps[i].lock, NULL);
+    }
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        pthread_mutex_init(&slab_classes[i].lock, NULL);
+    }
+    pthread_mutex_init(&mmap_tracker.lock, NULL);
+    for (int i = 0; i < NUM_LISTS; i++) {
+        pthread_mutex_init(&segregatedLists[i].lock, NULL);
+    }
+    pthread_mutex_init(&heap_state.growth_lock, NULL);
+    pthread_mutex_init(&handle_lock, NULL);
+    pthread_mutex_init(&cache_registry_lock, NULL);
+}
+
+__attribute__((constructor))
+static void register_fork_handlers() {
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+#endif
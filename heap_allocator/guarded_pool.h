@@ -0,0 +1,322 @@
+#ifndef GUARDED_POOL_H
+#define GUARDED_POOL_H
+
+#include "page_map.h"
+#include "utils.h"
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+    ------- SAMPLED GUARDED ALLOCATIONS ----------
+
+    A buffer overflow in a heap block writes on the header of the next block:
+    nothing happens at that moment, and much later coalesce merges the wrong
+    blocks or follows a broken link. Tools like ASan find the bug where it
+    happens, but they slow down every access, so they can't run in production.
+
+    The guarded pool catches the same bugs on a sample of the allocations, with
+    a cost close to zero for all the others:
+        - Every thread counts down its allocations; when the counter reaches zero
+        (on average once every sample_rate allocations, the exact distance is
+        random), the allocation is served by the guarded pool. All the other
+        allocations only pay the decrement of a thread-local counter.
+        - The pool is a region of GUARDED_NUM_SLOTS pages, each one between two
+        guard pages that are never accessible:
+
+            | guard | slot 0 | guard | slot 1 | guard | ... | slot N-1 | guard |
+
+        - An object is placed at the end of its page (to catch overflows) or at the
+        start (to catch underflows), chosen at random. An access out of the object
+        touches a guard page and the process gets a SIGSEGV right away.
+        - A freed slot is made inaccessible, and it's reused only after all the
+        other free slots (FIFO order): an access after free also faults.
+        - When the fault is in the pool, the SIGSEGV handler prints what happened
+        (overflow, underflow, use after free), with the stack trace of the access,
+        of the allocation and of the free. Then the default action (core dump)
+        takes place. Faults outside the pool go to the previous handler.
+        - A double free of a sampled object is reported with the same traces and ignored.
+
+    Sampling is disabled by default (sample rate 0) and it's enabled with
+    set_guarded_sample_rate(). If the pool is full, or the request is bigger than
+    a page, the allocation is served as usual.
+*/
+
+#define GUARDED_NUM_SLOTS 64
+#define GUARDED_TRACE_DEPTH 16
+// Allocations after which a thread checks again if sampling was enabled
+#define GUARDED_RECHECK_INTERVAL 65536
+
+#define GUARDED_SLOT_FREE 0         // Never used
+#define GUARDED_SLOT_USED 1
+#define GUARDED_SLOT_FREED 2        // Freed, its page is inaccessible
+
+typedef struct GuardedSlot {
+    void *ptr;
+    size_t size;
+    int state;
+    int alloc_depth;
+    int free_depth;
+    void *alloc_trace[GUARDED_TRACE_DEPTH];
+    void *free_trace[GUARDED_TRACE_DEPTH];
+    // Link of the FIFO of the slots that can be used
+    struct GuardedSlot *next;
+    bool sampled;               // Sampled by the leak report
+} GuardedSlot;
+
+static unsigned int guarded_sample_rate = 0;
+
+static GuardedSlot guarded_slots[GUARDED_NUM_SLOTS];
+static unsigned char *guarded_base = NULL;
+static size_t guarded_length = 0;
+static GuardedSlot *guarded_fifo_head = NULL;
+static GuardedSlot *guarded_fifo_tail = NULL;
+static struct sigaction guarded_prev_action;
+static pthread_mutex_t guarded_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Allocations left before the next sample, and the state of the random generator
+static __thread unsigned int guarded_countdown = 0;
+static __thread uint32_t guarded_rng = 0;
+
+// Sample on average one allocation every rate (0 disables sampling)
+void set_guarded_sample_rate(unsigned int rate) {
+    __atomic_store_n(&guarded_sample_rate, rate, __ATOMIC_RELAXED);
+    // The other threads see the new rate within GUARDED_RECHECK_INTERVAL allocations
+    guarded_countdown = 0;
+}
+
+// xorshift32, enough to make the sampled allocations unpredictable
+static inline uint32_t guarded_random() {
+    if (guarded_rng == 0) guarded_rng = (uint32_t)(uintptr_t)&guarded_rng | 1;
+    guarded_rng ^= guarded_rng << 13;
+    guarded_rng ^= guarded_rng >> 17;
+    guarded_rng ^= guarded_rng << 5;
+    return guarded_rng;
+}
+
+static bool guarded_sample_slow() {
+    unsigned int rate = __atomic_load_n(&guarded_sample_rate, __ATOMIC_RELAXED);
+    if (rate == 0) {
+        guarded_countdown = GUARDED_RECHECK_INTERVAL;
+        return false;
+    }
+    // Random distance with mean rate
+    guarded_countdown = (rate == 1) ? 1 : 1 + guarded_random() % (2 * rate - 1);
+    return true;
+}
+
+// Tells whether this allocation must be sampled. It's called by every my_malloc.
+static inline bool guarded_should_sample() {
+    if (__builtin_expect(guarded_countdown > 1, 1)) {
+        guarded_countdown--;
+        return false;
+    }
+    return guarded_sample_slow();
+}
+
+static inline unsigned char* guarded_slot_page(GuardedSlot *slot) {
+    size_t page_size = (size_t)get_page_size();
+    return guarded_base + (2 * (size_t)(slot - guarded_slots) + 1) * page_size;
+}
+
+// ---------------- Fault report ---------------------
+// Called in the signal handler: only write() and backtrace_symbols_fd(), no locks
+
+static void guarded_print(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void guarded_print(const char *fmt, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(buf) - 1) len = (int)sizeof(buf) - 1;
+    if (len > 0 && write(STDERR_FILENO, buf, (size_t)len) < 0) return;
+}
+
+static void guarded_print_traces(GuardedSlot *slot) {
+    guarded_print("==GUARDED== object of %zu bytes at %p, allocated at:\n", slot->size, slot->ptr);
+    backtrace_symbols_fd(slot->alloc_trace, slot->alloc_depth, STDERR_FILENO);
+    if (slot->state == GUARDED_SLOT_FREED) {
+        guarded_print("==GUARDED== freed at:\n");
+        backtrace_symbols_fd(slot->free_trace, slot->free_depth, STDERR_FILENO);
+    }
+}
+
+static void guarded_report_fault(uintptr_t addr) {
+    size_t page_size = (size_t)get_page_size();
+    size_t page = (addr - (uintptr_t)guarded_base) / page_size;
+    GuardedSlot *slot = NULL;
+    const char *kind = "wild access";
+
+    if (page % 2 == 1) {
+        // Data page of a slot: it's inaccessible only when the slot is free
+        slot = &guarded_slots[page / 2];
+        if (slot->state == GUARDED_SLOT_FREED) kind = "use-after-free";
+        else slot = NULL;
+    } else {
+        // Guard page: the closest object on its two sides is the culprit
+        GuardedSlot *left = (page > 0) ? &guarded_slots[page / 2 - 1] : NULL;
+        GuardedSlot *right = (page / 2 < GUARDED_NUM_SLOTS) ? &guarded_slots[page / 2] : NULL;
+        if (left != NULL && left->state == GUARDED_SLOT_FREE) left = NULL;
+        if (right != NULL && right->state == GUARDED_SLOT_FREE) right = NULL;
+
+        size_t left_dist = left ? addr - ((uintptr_t)left->ptr + left->size) : SIZE_MAX;
+        size_t right_dist = right ? (uintptr_t)right->ptr - addr : SIZE_MAX;
+        if (left != NULL && left_dist <= right_dist) {
+            slot = left;
+            kind = "heap-buffer-overflow";
+        } else if (right != NULL) {
+            slot = right;
+            kind = "heap-buffer-underflow";
+        }
+    }
+
+    guarded_print("\n==GUARDED== %s on address %p\n", kind, (void*)addr);
+    if (slot != NULL) {
+        uintptr_t start = (uintptr_t)slot->ptr;
+        if (addr < start) {
+            guarded_print("==GUARDED== %zu bytes before the object\n", (size_t)(start - addr));
+        } else if (addr >= start + slot->size) {
+            guarded_print("==GUARDED== %zu bytes after the object\n", (size_t)(addr - start - slot->size));
+        } else {
+            guarded_print("==GUARDED== %zu bytes inside the object\n", (size_t)(addr - start));
+        }
+    }
+    guarded_print("==GUARDED== access at:\n");
+    void *trace[GUARDED_TRACE_DEPTH];
+    backtrace_symbols_fd(trace, backtrace(trace, GUARDED_TRACE_DEPTH), STDERR_FILENO);
+    if (slot != NULL) guarded_print_traces(slot);
+}
+
+static void guarded_segv_handler(int sig, siginfo_t *info, void *context) {
+    uintptr_t addr = (uintptr_t)info->si_addr;
+
+    if (addr >= (uintptr_t)guarded_base && addr < (uintptr_t)guarded_base + guarded_length) {
+        guarded_report_fault(addr);
+        // When we return the access is executed again, and with the previous
+        // handler (the default one, usually) it kills the process
+        sigaction(SIGSEGV, &guarded_prev_action, NULL);
+        return;
+    }
+
+    // Not our fault: it's handled as if we weren't there
+    if (guarded_prev_action.sa_flags & SA_SIGINFO) {
+        guarded_prev_action.sa_sigaction(sig, info, context);
+    } else if (guarded_prev_action.sa_handler != SIG_DFL && guarded_prev_action.sa_handler != SIG_IGN) {
+        guarded_prev_action.sa_handler(sig);
+    } else {
+        sigaction(SIGSEGV, &guarded_prev_action, NULL);
+    }
+}
+
+// ---------------- Pool ---------------------
+
+// Note: guarded_lock must be held
+static bool guarded_pool_init() {
+    if (guarded_base != NULL) return true;
+
+    size_t page_size = (size_t)get_page_size();
+    size_t length = (2 * GUARDED_NUM_SLOTS + 1) * page_size;
+    void *mem = mmap(NULL, length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) return false;
+
+    for (int i = 0; i < GUARDED_NUM_SLOTS; i++) {
+        unsigned char *page = (unsigned char*)mem + (2 * (size_t)i + 1) * page_size;
+        if (!page_map_set_range(page, page_size, page_map_entry(&guarded_slots[i], PAGE_KIND_GUARDED))) {
+            page_map_clear_range(mem, length);
+            munmap(mem, length);
+            return false;
+        }
+        guarded_slots[i].next = (i + 1 < GUARDED_NUM_SLOTS) ? &guarded_slots[i + 1] : NULL;
+    }
+    guarded_fifo_head = &guarded_slots[0];
+    guarded_fifo_tail = &guarded_slots[GUARDED_NUM_SLOTS - 1];
+
+    // The first call of backtrace() loads libgcc: it's done here and not in the handler
+    void *trace[1];
+    backtrace(trace, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guarded_segv_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &guarded_prev_action);
+
+    guarded_length = length;
+    guarded_base = (unsigned char*)mem;
+    return true;
+}
+
+// Serve an allocation from the pool. Returns NULL if it can't (the caller goes on as usual).
+static void* guarded_allocation(size_t size) {
+    size_t page_size = (size_t)get_page_size();
+    if (size > page_size) return NULL;
+
+    pthread_mutex_lock(&guarded_lock);
+    GuardedSlot *slot = guarded_pool_init() ? guarded_fifo_head : NULL;
+    if (slot != NULL) {
+        guarded_fifo_head = slot->next;
+        if (guarded_fifo_head == NULL) guarded_fifo_tail = NULL;
+    }
+    pthread_mutex_unlock(&guarded_lock);
+    if (slot == NULL) return NULL;
+
+    unsigned char *page = guarded_slot_page(slot);
+    mprotect(page, page_size, PROT_READ | PROT_WRITE);
+
+    // 16-byte aligned, at the end or at the start of the page
+    size_t aligned_size = (size + 15) & ~(size_t)15;
+    bool at_end = guarded_random() & 1;
+    slot->ptr = at_end ? page + page_size - aligned_size : page;
+    slot->size = size;
+    slot->alloc_depth = backtrace(slot->alloc_trace, GUARDED_TRACE_DEPTH);
+    slot->free_depth = 0;
+    __atomic_store_n(&slot->state, GUARDED_SLOT_USED, __ATOMIC_RELEASE);
+
+    return slot->ptr;
+}
+
+static void guarded_free(GuardedSlot *slot, void *ptr) {
+    size_t page_size = (size_t)get_page_size();
+
+    pthread_mutex_lock(&guarded_lock);
+    if (slot->state != GUARDED_SLOT_USED || ptr != slot->ptr) {
+        pthread_mutex_unlock(&guarded_lock);
+        guarded_print("\n==GUARDED== %s of %p\n",
+                      (slot->state == GUARDED_SLOT_FREED && ptr == slot->ptr) ? "double free" : "invalid free", ptr);
+        if (slot->state != GUARDED_SLOT_FREE) guarded_print_traces(slot);
+        return;
+    }
+
+    slot->free_depth = backtrace(slot->free_trace, GUARDED_TRACE_DEPTH);
+    __atomic_store_n(&slot->state, GUARDED_SLOT_FREED, __ATOMIC_RELEASE);
+
+    // The page becomes inaccessible, and its memory is given back to the kernel
+    unsigned char *page = guarded_slot_page(slot);
+    mprotect(page, page_size, PROT_NONE);
+    madvise(page, page_size, MADV_DONTNEED);
+
+    // At the end of the FIFO: it's reused as late as possible
+    slot->next = NULL;
+    if (guarded_fifo_tail != NULL) guarded_fifo_tail->next = slot;
+    else guarded_fifo_head = slot;
+    guarded_fifo_tail = slot;
+    pthread_mutex_unlock(&guarded_lock);
+}
+
+// Tells whether ptr points inside the object of the slot
+static bool guarded_owns(GuardedSlot *slot, const void *ptr) {
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != GUARDED_SLOT_USED) return false;
+    return (const unsigned char*)ptr >= (unsigned char*)slot->ptr &&
+           (const unsigned char*)ptr < (unsigned char*)slot->ptr + slot->size;
+}
+
+#endif
@@ -0,0 +1,347 @@
+#ifndef HANDLES_H
+#define HANDLES_H
+
+#include "data_structure.h"
+#include "utils.h"
+#include "algorithms.h"
+#include "cpu_cache.h"
+#include "heap_allocator_api.h"
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+    ------- RELOCATABLE HANDLES AND HEAP COMPACTION ----------
+
+    A program that keeps allocating and freeing blocks of different sizes
+    ends up with many small free blocks between the used ones: the memory is
+    free, but it can't be used for bigger requests, and the heap can't shrink
+    because a used block sits on its top. The allocator can't move the blocks
+    returned by my_malloc, since the user keeps raw pointers to them.
+
+    Handles solve this for the data that can be moved. handle_alloc returns a
+    Handle instead of a pointer: the Handle stays the same for the whole life
+    of the allocation, while the block it refers to can be moved by the allocator.
+        - handle_deref: returns the current address of the data. The address is
+        valid until the next compaction.
+        - handle_pin / handle_unpin: while a handle is pinned (pins can be nested),
+        its block is never moved, so the address returned by handle_pin can be used
+        freely until handle_unpin. Pin the handle whenever another thread may run
+        heap_compact at the same time.
+        - handle_free: frees the block and the handle. The handle must not be pinned.
+    The blocks of the handles are normal blocks of the boundary-tag heap, so they
+    must not be passed to my_free.
+
+    heap_compact() runs the compaction pass, while holding the growth lock and all
+    the list locks (so my_malloc and my_free of the heap wait for it):
+        1. The blocks of the unpinned handles are moved, starting from the highest
+           address, into the lowest free block that can contain them, below their
+           current position. The handle is updated with the new address.
+        2. The heap is walked and the adjacent free blocks are merged.
+        3. If the last block of the heap is free, heap_state.top is moved down to its
+           start, and the whole pages between the new heap_state.top and heap_state.end are
+           given back to the kernel with madvise(MADV_DONTNEED). The address range
+           stays mapped, so the heap can grow again there without sbrk.
+    The blocks of my_malloc are never moved: they just limit how far the handles
+    can slide down.
+*/
+
+// Value of pins while the block of the handle is being moved
+#define HANDLE_MOVING UINT_MAX
+// Bytes mapped at once for the Handle structs
+#define HANDLE_META_CHUNK (64 * 1024)
+
+struct Handle {
+    Block *block;
+    unsigned int pins;
+    struct Handle *next;        // Links of the list of the live handles (or of the free pool)
+    struct Handle *prev;
+};
+
+// Live handles, the pool of the Handle structs and the compaction are protected by this lock
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static Handle *live_handles = NULL;
+static size_t live_handle_count = 0;
+static Handle *handle_free_list = NULL;
+static unsigned char *handle_meta_top = NULL;
+static unsigned char *handle_meta_end = NULL;
+
+// ---------------- Handle structs ---------------------
+// Note: the handle lock must be held
+
+static Handle* handle_meta_alloc() {
+    Handle *handle = handle_free_list;
+    if (handle != NULL) {
+        handle_free_list = handle->next;
+        return handle;
+    }
+
+    if (handle_meta_top == NULL || handle_meta_top + sizeof(Handle) > handle_meta_end) {
+        void *mem = mmap(NULL, HANDLE_META_CHUNK, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return NULL;
+        handle_meta_top = (unsigned char*)mem;
+        handle_meta_end = handle_meta_top + HANDLE_META_CHUNK;
+    }
+    handle = (Handle*)handle_meta_top;
+    handle_meta_top += sizeof(Handle);
+    return handle;
+}
+
+static void handle_meta_free(Handle *handle) {
+    handle->next = handle_free_list;
+    handle_free_list = handle;
+}
+
+// ---------------- Handle API ---------------------
+
+Handle* handle_alloc(size_t size) {
+    if (size == 0) return NULL;
+
+    // Same sizes as my_malloc, but the block always comes from the heap
+    size_t total_size = sizeof(size_t) + align(size) + sizeof(Footer);
+    if (total_size < sizeof(Block) + sizeof(Footer)) total_size = sizeof(Block) + sizeof(Footer);
+
+    Block *block = heap_allocation(total_size);
+    if (block == NULL) return NULL;
+
+    pthread_mutex_lock(&handle_lock);
+    Handle *handle = handle_meta_alloc();
+    if (handle == NULL) {
+        pthread_mutex_unlock(&handle_lock);
+        heap_free_block(block);
+        return NULL;
+    }
+
+    handle->block = block;
+    handle->pins = 0;
+    handle->prev = NULL;
+    handle->next = live_handles;
+    if (live_handles != NULL) live_handles->prev = handle;
+    live_handles = handle;
+    live_handle_count++;
+    pthread_mutex_unlock(&handle_lock);
+
+    return handle;
+}
+
+void* handle_deref(Handle *handle) {
+    return (void*)__atomic_load_n(&handle->block, __ATOMIC_ACQUIRE)->payload;
+}
+
+// Pin the handle and return the address of its data, which doesn't change until handle_unpin
+void* handle_pin(Handle *handle) {
+    unsigned int pins = __atomic_load_n(&handle->pins, __ATOMIC_ACQUIRE);
+    for (;;) {
+        // The block is being moved: wait for the compaction to finish with it
+        if (pins == HANDLE_MOVING) {
+            sched_yield();
+            pins = __atomic_load_n(&handle->pins, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&handle->pins, &pins, pins + 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+    }
+    return handle_deref(handle);
+}
+
+void handle_unpin(Handle *handle) {
+    __atomic_fetch_sub(&handle->pins, 1, __ATOMIC_RELEASE);
+}
+
+void handle_free(Handle *handle) {
+    if (handle == NULL) return;
+
+    pthread_mutex_lock(&handle_lock);
+    if (__atomic_load_n(&handle->pins, __ATOMIC_ACQUIRE) != 0) {
+        pthread_mutex_unlock(&handle_lock);
+        fprintf(stderr, "handle_free(): handle %p is pinned\n", (void*)handle);
+        return;
+    }
+
+    if (handle->prev) handle->prev->next = handle->next;
+    else live_handles = handle->next;
+    if (handle->next) handle->next->prev = handle->prev;
+    live_handle_count--;
+
+    Block *block = handle->block;
+    handle_meta_free(handle);
+    pthread_mutex_unlock(&handle_lock);
+
+    heap_free_block(block);
+}
+
+// ---------------- Compaction ---------------------
+// Note: the growth lock and all the list locks must be held
+
+// Find the free block with the lowest address below limit that has at least size bytes
+static Block* compact_find_hole(size_t size, Block *limit) {
+    Block *best = NULL;
+    for (int i = get_list_index(size); i < NUM_LISTS; i++) {
+        for (Block *b = segregatedLists[i].head; b != NULL; b = get_next_free(b)) {
+            if (b < limit && get_size(b) >= size && (best == NULL || b < best)) {
+                best = b;
+            }
+        }
+    }
+    return best;
+}
+
+// Move the block of the handle into a free block below it, if there is one
+static bool compact_move(Handle *handle) {
+    Block *old = handle->block;
+    size_t size = get_size(old);
+
+    Block *dest = compact_find_hole(size, old);
+    if (dest == NULL) return false;
+
+    remove_from_free_list(dest);
+    size_t dest_size = get_size(dest);
+
+    // Same split as split_block, but the rest goes directly in the lists
+    if (dest_size >= size + sizeof(Block) + sizeof(Footer)) {
+        Block *rest = (Block*)((unsigned char*)dest + size);
+        setup_block(rest, dest_size - size, false);
+        insert_into_free_list(rest);
+        dest_size = size;
+    }
+    setup_block(dest, dest_size, true);
+
+    memcpy(dest->payload, old->payload, size - sizeof(size_t) - sizeof(Footer));
+    __atomic_store_n(&handle->block, dest, __ATOMIC_RELEASE);
+
+    // The old block is merged with its neighbors later, by compact_merge_region()
+    setup_block(old, size, false);
+    insert_into_free_list(old);
+    return true;
+}
+
+static int compare_handles_desc(const void *a, const void *b) {
+    Block *x = (*(Handle* const*)a)->block;
+    Block *y = (*(Handle* const*)b)->block;
+    return (x < y) - (x > y);
+}
+
+// Merge the adjacent free blocks between start and end
+static void compact_merge_region(unsigned char *start, unsigned char *end) {
+    unsigned char *current = start;
+    while (current < end) {
+        Block *block = (Block*)current;
+        // The owner of a used block may be splitting it: the header is loaded with
+        // acquire order, to see the header of the second part (see split_block())
+        size_t size = __atomic_load_n(&block->header, __ATOMIC_ACQUIRE) & SIZE_MASK;
+        if (size == 0) break;
+
+        if (!is_used(block)) {
+            size_t merged = size;
+            Block *next = (Block*)(current + merged);
+            while ((unsigned char*)next < end && !is_used(next) && get_size(next) != 0) {
+                if (merged == size) remove_from_free_list(block);
+                remove_from_free_list(next);
+                merged += get_size(next);
+                // The tags inside the merged block are cleared, like in compact_trim_top():
+                // a stale free header or footer must not be merged by coalesce() later
+                store_footer((Footer*)next - 1, 0);
+                store_header(next, 0);
+                next = (Block*)(current + merged);
+            }
+            if (merged != size) {
+                setup_block(block, merged, false);
+                insert_into_free_list(block);
+                size = merged;
+            }
+        }
+        current += size;
+    }
+}
+
+// Move heap_state.top below the free block on top of the heap (if there is one)
+// and give back to the kernel the pages above it. Returns the released bytes.
+static size_t compact_trim_top(unsigned char *region_start) {
+    unsigned char *top = heap_state.top;
+    if (top - region_start >= (long)(sizeof(Block) + sizeof(Footer))) {
+        Footer footer = load_footer((Footer*)(top - sizeof(Footer)));
+        Block *last = (Block*)(top - (footer & SIZE_MASK));
+
+        if ((unsigned char*)last >= region_start && load_header(last) == footer && !is_used(last)) {
+            remove_from_free_list(last);
+            // A stale header must not be merged by coalesce() in another thread
+            store_header(last, 0);
+            top = (unsigned char*)last;
+            set_heap_top(top);
+        }
+    }
+
+    size_t page_size = (size_t)get_page_size();
+    uintptr_t first_page = ((uintptr_t)top + page_size - 1) & ~(page_size - 1);
+    uintptr_t last_page = (uintptr_t)heap_state.end & ~(page_size - 1);
+    if (first_page >= last_page) return 0;
+
+    madvise((void*)first_page, last_page - first_page, MADV_DONTNEED);
+    heap_trim_pages(first_page, last_page);
+    return last_page - first_page;
+}
+
+// Run a compaction pass. Returns the number of bytes given back to the kernel.
+size_t heap_compact() {
+    // The blocks in the per-cpu caches and in the fast lists are marked as used:
+    // they are given back to the heap first, so they can be merged
+    cache_scavenge(false, true);
+    fast_consolidate();
+
+    pthread_mutex_lock(&handle_lock);
+    pthread_mutex_lock(&heap_state.growth_lock);
+    lock_all_lists();
+
+    // Step 1) Move the unpinned handles, starting from the highest address
+    size_t length = live_handle_count * sizeof(Handle*);
+    Handle **sorted = NULL;
+    if (length > 0) {
+        void *mem = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) sorted = (Handle**)mem;
+    }
+
+    if (sorted != NULL) {
+        size_t n = 0;
+        for (Handle *h = live_handles; h != NULL; h = h->next) sorted[n++] = h;
+        qsort(sorted, n, sizeof(Handle*), compare_handles_desc);
+
+        for (size_t i = 0; i < n; i++) {
+            unsigned int expected = 0;
+            // A pinned handle is skipped; a handle pinned from now on waits for the move
+            if (!__atomic_compare_exchange_n(&sorted[i]->pins, &expected, HANDLE_MOVING, false,
+                                             __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                continue;
+            }
+            compact_move(sorted[i]);
+            __atomic_store_n(&sorted[i]->pins, 0, __ATOMIC_RELEASE);
+        }
+        munmap(sorted, length);
+    }
+
+    // Step 2) Merge the free blocks of the static heap and of the sbrk region
+    unsigned char *region_start = (unsigned char*)heap_state.start;
+    if (heap_state.gap_start != NULL) {
+        compact_merge_region((unsigned char*)heap_state.start, heap_state.gap_start);
+        region_start = heap_state.gap_end;
+    }
+    compact_merge_region(region_start, heap_state.top);
+
+    // Step 3) Shrink the top of the heap
+    size_t released = compact_trim_top(region_start);
+
+    unlock_all_lists();
+    pthread_mutex_unlock(&heap_state.growth_lock);
+    pthread_mutex_unlock(&handle_lock);
+
+    return released;
+}
+
+#endif
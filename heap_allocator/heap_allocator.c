@@ -0,0 +1,17 @@
+/*
+    Translation unit of the library (libheap_allocator.a and libheap_allocator.so).
+
+    It's the only file that includes heap_allocator.h, so the static state of the
+    allocator exists once in the whole program. The other files of the program
+    include heap_allocator_api.h and link the library (see heap_allocator_api.h).
+*/
+#include "heap_allocator.h"
+
+// The compressed links are offsets from the static heap. In a shared library the
+// static heap is mapped with the library, far above the program break, so no sbrk
+// region would ever be in range and the heap could never grow (a position
+// independent executable keeps its break just above the static heap, so the
+// static library is fine).
+#if defined(COMPRESSED_LINKS) && defined(__PIC__) && !defined(__PIE__)
+#error "COMPRESSED_LINKS can't be used in libheap_allocator.so: build it with pointer links"
+#endif
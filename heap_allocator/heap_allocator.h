@@ -3,10 +3,29 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <semaphore.h>
+#include <signal.h>
+#include "heap_allocator_api.h"
 #include "data_structure.h"
 #include "utils.h"
 #include "algorithms.h"
 #include "mmap_allocator.h"
+#include "page_map.h"
+#include "page_heap.h"
+#include "slab.h"
+#include "cpu_cache.h"
+#include "guarded_pool.h"
+#include "quarantine.h"
+#include "leak_check.h"
+#include "stats.h"
+#include "memory_monitor.h"
+#include "config.h"
+#include "mallctl.h"
+#include "handles.h"
+#include "persistent_heap.h"
+#include "shared_heap.h"
+#include "fork_safety.h"
 
 /*
     --------------- CUSTOM MALLOC AND FREE ----------------
@@ -28,15 +47,66 @@
             through another sbrk allocation.
         3. Mmap allocation: if the data to allocate exceeds a certain threshold, 
             the allocator uses the mmap syscall to handle the large block independently.
+        Between SPAN_THRESHOLD and the mmap threshold, data is allocated in runs of
+        whole pages by the page heap (page_heap.h).
+    Before all of them, small requests are served by the per-cpu cache (cpu_cache.h)
+    which keeps recently freed blocks of the same size, then by the lock-free
+    fast lists (fast_lists.h), or by slabs without inline
+    headers when the out-of-line metadata mode is enabled (slab.h).
+    When sampling is enabled, one allocation every so often is served by the
+    guarded pool instead (guarded_pool.h), to catch overflows and use after free.
+    Freed blocks can also be kept in a quarantine for a while (quarantine.h).
+    The blocks still allocated can be reported at exit or on demand, grouped
+    by allocation site (leak_check.h), and the allocations can be counted by
+    size class (stats.h). All these options, and the main limits, can be set at
+    startup through the MY_MALLOC_CONF environment variable (config.h), and
+    read, changed or triggered by name at runtime with my_mallctl() (mallctl.h).
+    The memory taken from the kernel can be capped by a memory budget, with a
+    soft limit that reclaims memory and a hard limit that fails (budget.h).
     
     - Free: deallocates the data from the given blocks. To avoid external fragmentation,
         a coalesce operation is performed to merge two consecutive free blocks.
         If the block was allocated with mmap, it's deallocated with munmap.
+        The page map (page_map.h) is used to find out how the pointer was
+        allocated; pointers that don't belong to the allocator are reported and ignored.
+
+    - Owns: tells in constant time whether a pointer belongs to the allocator.
+
+    Data that can be moved can also be allocated through handles (handles.h),
+    which let heap_compact() defragment the heap and shrink its top.
+    Data that must survive a restart can be allocated in a persistent heap
+    backed by a file (persistent_heap.h), and data shared among processes in
+    a shared-memory heap (shared_heap.h).
+
+    Both functions can be called by many threads at the same time: see the
+    locking section in data_structure.h. The locks are also handled
+    around fork(), see fork_safety.h.
+
+    This header contains the state of the allocator, so it must be included by
+    a single .c file of the program. Programs made of many files link the
+    library built from heap_allocator.c and include heap_allocator_api.h.
 */
 
-// Allocates data in dynamic memory
-void* my_malloc(size_t size) {
+// Register the static heap in the page map before main starts
+__attribute__((constructor))
+static void register_static_heap() {
+    page_map_set_range(heap, HEAP_TOTAL_SIZE, page_map_entry(NULL, PAGE_KIND_HEAP));
+}
+
+// A pointer that doesn't belong to the allocator is ignored instead of corrupting the heap
+static void report_invalid_free(void *ptr) {
+    fprintf(stderr, "my_free(): invalid pointer %p\n", ptr);
+}
+
+// Allocates data in dynamic memory (my_malloc without the leak sampling)
+static void* allocate(size_t size) {
     if (size == 0) return NULL;
+
+    // ------------- Sampled allocation ---------------
+    if (__builtin_expect(guarded_should_sample(), 0)) {
+        void *ptr = guarded_allocation(size);
+        if (ptr != NULL) return ptr;
+    }
     
     size_t aligned_size = align(size);
     // Calculate total size which is Header + Payload + Footer
@@ -47,64 +117,330 @@ void* my_malloc(size_t size) {
     if (total_size < min_block_size) total_size = min_block_size;
 
     // ------------- (3) Mmap allocation --------------
-    if (aligned_size >= MMAP_THRESHOLD) {
+    if (aligned_size >= get_mmap_threshold()) {
         return mmap_allocation(aligned_size);
     }
 
-    // ------------- (1) Standard allocation ------------
+    // ------------- Page heap ------------------------
+    if (aligned_size >= SPAN_THRESHOLD) {
+        return span_allocation(aligned_size);
+    }
 
-    Block *block = first_fit(total_size);
-    
-    if (block != NULL) {
-        remove_from_free_list(block);
-        
-        split_block(block, total_size);
-        
-        set_used(block, true);
-        
-        // Footer is updated
-        Footer *footer = get_footer(block);
-        *footer = block->header;
+    // ------------- Slabs ----------------------------
+    if (aligned_size <= SLAB_MAX_SIZE && slab_mode_enabled()) {
+        return slab_allocation(aligned_size);
+    }
 
+    // ------------- Per-cpu cache --------------------
+    Block *block = cache_pop(total_size);
+    if (block != NULL) {
         return (void*)block->payload;
     }
 
-    // If there are no blocks available for that data, a new block is created
-    // on top of the heap
-    if (heap_top + total_size <= heap_end) {
-        block = (Block*)heap_top;
-        
-        setup_block(block, total_size, true);
-
-        heap_top += total_size;
-        
+    // ------------- Fast lists -----------------------
+    block = fast_pop(total_size);
+    if (block != NULL) {
         return (void*)block->payload;
     }
 
+    // ------------- (1) Standard allocation ------------
     // ------------ (2) Sbrk allocation ---------------
-    // The payload pointer is directly returned by the sbrk
-    return sbrk_allocation(total_size);
+    // First-fit, then the top of the heap, then sbrk (see heap_allocation())
+    block = heap_allocation(total_size);
+
+    return (block != NULL) ? (void*)block->payload : NULL;
+}
+
+// Mark a block whose site was recorded, so that my_free removes it from the
+// table of the leak report (the other frees don't take the lock of the table)
+static void leak_mark_sampled(void *ptr) {
+    PageMapEntry entry = page_map_get(ptr);
+
+    switch (page_map_kind(entry)) {
+        case PAGE_KIND_HEAP:
+            set_sampled(get_block_from_payload(ptr), true);
+            break;
+        case PAGE_KIND_MMAP:
+            set_sampled((Block*)page_map_meta(entry), true);
+            break;
+        case PAGE_KIND_SPAN:
+            // A slab can hold many sampled objects
+            __atomic_fetch_add(&((Span*)page_map_meta(entry))->sampled, 1, __ATOMIC_RELAXED);
+            break;
+        case PAGE_KIND_GUARDED:
+            ((GuardedSlot*)page_map_meta(entry))->sampled = true;
+            break;
+    }
+}
+
+// Allocates data in dynamic memory
+void* my_malloc(size_t size) {
+    void *ptr = allocate(size);
+
+    // ------------- Leak sampling --------------------
+    if (__builtin_expect(leak_should_sample(), 0) && ptr != NULL) {
+        if (leak_record(ptr)) leak_mark_sampled(ptr);
+    }
+
+    // ------------- Statistics -----------------------
+    if (__builtin_expect(stats_enabled(), 0) && ptr != NULL) {
+        stats_count_malloc(my_usable_size(ptr));
+    }
+
+    // ------------- Memory budget --------------------
+    // Over the soft limit: the memory kept for later first, then the user caches
+    if (__builtin_expect(budget_reclaim_needed(), 0)) {
+        memory_trim();
+        budget_run_callbacks();
+    }
+    return ptr;
+}
+
+// Give a freed block of the heap back to the allocator
+static void heap_release(Block *block) {
+    // Small blocks are kept in the per-cpu cache as they are (still marked as used)
+    if (cache_push(block)) {
+        return;
+    }
+
+    // If the cache is full they go in the fast lists, where they are merged later
+    if (fast_push(block)) {
+        return;
+    }
+    
+    heap_free_block(block);
+}
+
+// Release a chain of blocks linked through next_free (see quarantine.h)
+static void heap_release_chain(Block *chain) {
+    while (chain != NULL) {
+        Block *next = get_next_free(chain);
+        heap_release(chain);
+        chain = next;
+    }
+}
+
+// Bookkeeping of a valid pointer that is being freed, done before its memory can
+// be reused (a new sample at the same address must not be removed from the table)
+static inline void free_accounting(void *ptr, bool sampled) {
+    if (__builtin_expect(sampled, 0)) {
+        leak_forget(ptr);
+    }
+    if (__builtin_expect(stats_enabled(), 0)) {
+        stats_count_free(my_usable_size(ptr));
+    }
 }
 
 void my_free(void* ptr) {
     if (!ptr) return;
 
-    Block *block = get_block_from_payload(ptr);
-    
-    if (is_mmap(block)) {
+    // The page map tells who owns the pointer without reading
+    // memory in front of it, which may not exist for a foreign pointer
+    PageMapEntry entry = page_map_get(ptr);
+    int kind = page_map_kind(entry);
+
+    if (kind == PAGE_KIND_MMAP) {
+        Block *block = (Block*)page_map_meta(entry);
+        if (ptr != (void*)block->payload) {
+            report_invalid_free(ptr);
+            return;
+        }
+        free_accounting(ptr, is_sampled(block));
         mmap_free(block);
         return;
     }
-    
-    set_used(block, false);
-    
-    // Update the footer before coalescing
-    Footer *footer = get_footer(block);
-    *footer = block->header;
 
-    block = coalesce(block);
+    if (kind == PAGE_KIND_SPAN) {
+        Span *span = (Span*)page_map_meta(entry);
+        unsigned char state = __atomic_load_n(&span->state, __ATOMIC_ACQUIRE);
+        if (state == SPAN_SLAB) {
+            if (!slab_object_valid(span, ptr)) {
+                report_invalid_free(ptr);
+                return;
+            }
+            // The counter of the slab only says whether some of its objects are
+            // sampled: the table tells whether this one is
+            if (__atomic_load_n(&span->sampled, __ATOMIC_RELAXED) != 0 && leak_forget(ptr)) {
+                __atomic_fetch_sub(&span->sampled, 1, __ATOMIC_RELAXED);
+            }
+            free_accounting(ptr, false);
+            if (!slab_free(span, ptr)) report_invalid_free(ptr);
+            return;
+        }
+        if (state != SPAN_IN_USE || (uintptr_t)ptr != span->start) {
+            report_invalid_free(ptr);
+            return;
+        }
+        bool sampled = __atomic_exchange_n(&span->sampled, 0, __ATOMIC_RELAXED) != 0;
+        free_accounting(ptr, sampled);
+        span_free(span);
+        return;
+    }
+
+    if (kind == PAGE_KIND_GUARDED) {
+        GuardedSlot *slot = (GuardedSlot*)page_map_meta(entry);
+        if (guarded_owns(slot, ptr) && ptr == slot->ptr) {
+            free_accounting(ptr, slot->sampled);
+            slot->sampled = false;
+        }
+        // An invalid or double free is reported with its traces
+        guarded_free(slot, ptr);
+        return;
+    }
+
+    if (kind != PAGE_KIND_HEAP || !is_valid_heap_address(ptr)) {
+        report_invalid_free(ptr);
+        return;
+    }
+
+    Block *block = get_block_from_payload(ptr);
+
+    if (header_checks()) {
+        check_header(block, "my_free");
+        // A free block, or a used one that is already in a cache, was freed before
+        if (!is_used(block) || (load_header(block) & CACHED_FLAG)) {
+            fprintf(stderr, "my_free(): double free of %p\n", ptr);
+            return;
+        }
+        // Until it's allocated again, a second free of the same pointer is caught,
+        // even if the block is merged with its neighbors (the old header stays there)
+        set_cached(block, true);
+    }
+
+    bool sampled = is_sampled(block);
+    // The flag must not survive in the caches, where the header isn't rewritten
+    if (__builtin_expect(sampled, 0)) set_sampled(block, false);
+    free_accounting(ptr, sampled);
+
+    if (quarantine_enabled()) {
+        Block *evicted;
+        if (quarantine_push(block, &evicted)) {
+            heap_release_chain(evicted);
+            return;
+        }
+    }
+
+    heap_release(block);
+}
+
+// Set the byte budget of the quarantine of the freed blocks (0 disables it)
+// and whether their payloads are poisoned
+void set_quarantine(size_t max_bytes, bool poison) {
+    heap_release_chain(quarantine_configure(max_bytes, poison));
+}
+
+// Free for real the blocks kept for later by the quarantine, the per-cpu caches
+// and the fast lists, and merge them with their neighbors. The quarantine goes
+// first, since its blocks may end up in the caches and in the fast lists.
+void my_flush_caches() {
+    heap_release_chain(quarantine_flush());
+    cache_scavenge(false, true);
+    fast_consolidate();
+}
+
+// Print the blocks still allocated, grouped by the site of their sampled
+// allocation (see leak_check.h). Returns the number of blocks.
+size_t my_leak_report(FILE *out) {
+    // The blocks kept by the allocator for later are not leaks
+    my_flush_caches();
+
+    // With every lock held no block is split, merged or mapped during the walk
+    fork_prepare();
+    size_t leaked = leak_print_report(out);
+    fork_parent();
+    return leaked;
+}
+
+static bool leak_report_registered = false;
+static sem_t leak_report_sem;
+
+static void leak_report_at_exit() {
+    my_leak_report(stderr);
+}
+
+// The handler can't take locks: it wakes up the reporter thread
+static void leak_report_signal(int signo) {
+    (void)signo;
+    sem_post(&leak_report_sem);
+}
+
+static void* leak_reporter(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (sem_wait(&leak_report_sem) == 0) my_leak_report(stderr);
+    }
+    return NULL;
+}
 
-    insert_into_free_list(block);
+// Print the leak report on stderr when the process exits (at_exit) and
+// every time the signal signo is received (0 = no signal).
+// It can be called once; returns false if the report can't be set up.
+bool set_leak_report(bool at_exit, int signo) {
+    if (leak_report_registered) return false;
+
+    if (signo != 0) {
+        pthread_t thread;
+        if (sem_init(&leak_report_sem, 0, 0) != 0) return false;
+        if (pthread_create(&thread, NULL, leak_reporter, NULL) != 0) return false;
+        pthread_detach(thread);
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = leak_report_signal;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        if (sigaction(signo, &action, NULL) != 0) return false;
+    }
+    if (at_exit && atexit(leak_report_at_exit) != 0) return false;
+
+    leak_report_registered = true;
+    return true;
+}
+
+// Tells whether ptr points inside memory given to the user by the allocator
+bool my_owns(const void *ptr) {
+    PageMapEntry entry = page_map_get(ptr);
+
+    switch (page_map_kind(entry)) {
+        case PAGE_KIND_HEAP:
+            return is_valid_heap_address((void*)ptr);
+        case PAGE_KIND_MMAP:
+            // The pages of an mmap block contain only the header before the payload
+            return (const unsigned char*)ptr >= ((Block*)page_map_meta(entry))->payload;
+        case PAGE_KIND_SPAN:
+            if (__atomic_load_n(&((Span*)page_map_meta(entry))->state, __ATOMIC_ACQUIRE) == SPAN_SLAB) {
+                return slab_owns((Span*)page_map_meta(entry), ptr);
+            }
+            return span_owns(entry, ptr);
+        case PAGE_KIND_GUARDED:
+            return guarded_owns((GuardedSlot*)page_map_meta(entry), ptr);
+        default:
+            return false;
+    }
+}
+
+// Number of bytes that can be used in the block of ptr, which must have been
+// returned by my_malloc (0 if it doesn't belong to the allocator)
+size_t my_usable_size(const void *ptr) {
+    PageMapEntry entry = page_map_get(ptr);
+
+    switch (page_map_kind(entry)) {
+        case PAGE_KIND_HEAP:
+            return get_size(get_block_from_payload((void*)ptr)) - sizeof(size_t) - sizeof(Footer);
+        case PAGE_KIND_MMAP:
+            return get_size((Block*)page_map_meta(entry)) - sizeof(size_t);
+        case PAGE_KIND_SPAN: {
+            Span *span = (Span*)page_map_meta(entry);
+            if (__atomic_load_n(&span->state, __ATOMIC_ACQUIRE) == SPAN_SLAB) {
+                return slab_class_sizes[((Slab*)span->owner)->size_class];
+            }
+            return span->npages * SPAN_PAGE_SIZE;
+        }
+        case PAGE_KIND_GUARDED:
+            return ((GuardedSlot*)page_map_meta(entry))->size;
+        default:
+            return 0;
+    }
 }
 
-#endif
\ No newline at end of file
+#endif
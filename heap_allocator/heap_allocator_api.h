@@ -0,0 +1,119 @@
+#ifndef HEAP_ALLOCATOR_API_H
+#define HEAP_ALLOCATOR_API_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+    --------------- PUBLIC INTERFACE OF THE LIBRARY ----------------
+
+    heap_allocator.h contains the whole allocator: its state is made of static
+    variables and its functions are defined in the header, so it can be included
+    by a single .c file (like allocator.c). Every other .c file of the program
+    that includes it would get its own private heap, and a pointer allocated in
+    one of them and freed in another would corrupt both.
+
+    Programs made of many files use the allocator as a library instead:
+        - heap_allocator.c is the only translation unit that includes
+        heap_allocator.h. It's compiled into libheap_allocator.a and
+        libheap_allocator.so (see the Makefile), so there is a single copy
+        of the allocator state in the whole program.
+        - The other files include this header, which declares the public
+        functions and the types the user needs, and link the library.
+    With link-time optimization (-flto when compiling both the library and the
+    program, with the static library) the compiler still sees the body of
+    my_malloc and my_free, and can inline their fast paths into the callers.
+*/
+
+// ---------------- Allocation ---------------------
+
+void* my_malloc(size_t size);
+void my_free(void *ptr);
+bool my_owns(const void *ptr);
+size_t my_usable_size(const void *ptr);
+void my_flush_caches();
+
+// ---------------- Runtime options ---------------------
+
+void set_out_of_line_metadata(bool enabled);
+void set_cpu_caches(bool enabled);
+void set_prefetch(bool enabled);
+void set_header_checks(bool enabled);
+void set_guarded_sample_rate(unsigned int rate);
+void set_quarantine(size_t max_bytes, bool poison);
+void set_stats(bool enabled);
+// Apply a list of key:value options, like the MY_MALLOC_CONF environment variable
+bool my_malloc_config(const char *conf);
+// Trim the memory kept for later when the cgroup is close to its limit
+bool set_memory_monitor(unsigned int interval_ms, unsigned int percent, const char *cgroup_dir);
+
+// ---------------- Memory budget ---------------------
+
+// Called with the bytes over the soft limit; returns the bytes it freed
+typedef size_t (*ReclaimCallback)(size_t excess, void *arg);
+
+bool set_memory_budget(size_t soft_limit, size_t hard_limit);
+bool add_reclaim_callback(ReclaimCallback callback, void *arg);
+
+// ---------------- Statistics ---------------------
+
+void my_malloc_stats_print(FILE *out);
+// Read or write a value, or trigger an action, by name (see mallctl.h)
+int my_mallctl(const char *name, void *oldp, size_t *oldlenp, const void *newp, size_t newlen);
+
+// ---------------- Leak report ---------------------
+
+void set_leak_sample_rate(unsigned int rate);
+size_t my_leak_report(FILE *out);
+bool set_leak_report(bool at_exit, int signo);
+
+// ---------------- Handles ---------------------
+
+typedef struct Handle Handle;
+
+Handle* handle_alloc(size_t size);
+void* handle_deref(Handle *handle);
+void* handle_pin(Handle *handle);
+void handle_unpin(Handle *handle);
+void handle_free(Handle *handle);
+size_t heap_compact();
+
+// ---------------- Persistent and shared heaps ---------------------
+
+typedef uint64_t pheap_off_t;
+
+struct PHeapHeader;
+
+// Process-local description of an open persistent heap
+typedef struct PHeap {
+    struct PHeapHeader *base;
+    size_t size;
+    int fd;
+    bool shared;            // Shared among processes (see shared_heap.h)
+} PHeap;
+
+static inline void* pheap_from_offset(PHeap *heap, pheap_off_t offset) {
+    return offset ? (void*)((unsigned char*)heap->base + offset) : NULL;
+}
+
+static inline pheap_off_t pheap_to_offset(PHeap *heap, const void *ptr) {
+    return ptr ? (pheap_off_t)((const unsigned char*)ptr - (const unsigned char*)heap->base) : 0;
+}
+
+bool pheap_open(PHeap *heap, const char *path, size_t size, void *base);
+bool pheap_check(PHeap *heap);
+void pheap_sync(PHeap *heap);
+void pheap_close(PHeap *heap);
+void* pheap_root(PHeap *heap);
+void pheap_set_root(PHeap *heap, void *ptr);
+void* pheap_malloc(PHeap *heap, size_t size);
+void pheap_free(PHeap *heap, void *ptr);
+
+bool sheap_open(PHeap *heap, const char *name, size_t size);
+bool sheap_attach_fd(PHeap *heap, int fd);
+void sheap_close(PHeap *heap);
+void sheap_unlink(const char *name);
+
+#endif
@@ -0,0 +1,385 @@
+#ifndef LEAK_CHECK_H
+#define LEAK_CHECK_H
+
+#include "data_structure.h"
+#include "utils.h"
+#include "mmap_allocator.h"
+#include "page_heap.h"
+#include "slab.h"
+#include "guarded_pool.h"
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+    ------- LEAK REPORT ----------
+
+    A leak is memory that is still allocated when nobody needs it anymore.
+    The allocator can't know who needs a block, but it knows which blocks are
+    still allocated and, for a sample of them, where they were allocated: the
+    blocks left at exit grouped by allocation site point straight to the leaks,
+    without running the program again under valgrind.
+
+        - Site sampling: when it's enabled with set_leak_sample_rate(), one
+        allocation every rate (on average, with a thread-local countdown like the
+        guarded pool) records its stack trace. Equal traces are stored once in
+        the table of the sites, and the payload is recorded in the table of the
+        sampled blocks with the index of its site. The block is then marked as
+        sampled (a bit of its header, or a counter in its Span or its guarded
+        slot) and my_free removes only the marked blocks from the table. All the
+        other allocations only pay the decrement of the countdown, and the other
+        frees never take the lock of the table.
+        - Report (my_leak_report() in heap_allocator.h): the caches, the fast
+        lists and the quarantine are flushed, so their blocks are free for real.
+        Then, with every allocator lock held (as before a fork), the same
+        traversal of print_memory() finds the blocks still in use: the static
+        heap, the sbrk region, the mmap blocks, the spans and the slab objects
+        of the page heap, and the guarded slots. They are grouped by the site of
+        their sampled allocation; the blocks that were not sampled are counted
+        together. The sites with the most bytes are printed with their traces.
+        - The report can be printed at exit and when a signal is received
+        (set_leak_report()). The signal handler only wakes up a thread that
+        prints the report, since it can't take locks.
+
+    Both tables have a fixed size and are mapped the first time sampling is
+    enabled. When one of them is full, new samples are dropped (and counted):
+    their blocks show up among the ones that were not sampled.
+*/
+
+// Frames of the stack trace of a site
+#define LEAK_TRACE_DEPTH 10
+// Sites and sampled blocks that can be recorded (powers of 2)
+#define LEAK_NUM_SITES 4096
+#define LEAK_TABLE_SIZE 65536
+// Sites printed by the report, the ones with the most bytes
+#define LEAK_REPORT_SITES 20
+// Allocations after which a thread checks again if sampling was enabled
+#define LEAK_RECHECK_INTERVAL 65536
+
+typedef struct LeakSite {
+    uint64_t hash;              // 0 = empty slot
+    int depth;
+    void *trace[LEAK_TRACE_DEPTH];
+    // Filled by the report
+    size_t leaked_blocks;
+    size_t leaked_bytes;
+} LeakSite;
+
+typedef struct LeakEntry {
+    uintptr_t ptr;              // Payload of the sampled block, 0 = empty slot
+    uint32_t site;
+} LeakEntry;
+
+static unsigned int leak_sample_rate = 0;
+
+static LeakSite *leak_sites = NULL;
+static LeakEntry *leak_table = NULL;
+static size_t leak_num_sites = 0;
+static size_t leak_num_entries = 0;
+static size_t leak_dropped = 0;
+static pthread_mutex_t leak_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread unsigned int leak_countdown = 0;
+
+// Map the tables the first time sampling is enabled. Returns false if mmap fails.
+static bool leak_tables_init() {
+    if (__atomic_load_n(&leak_table, __ATOMIC_ACQUIRE) != NULL) return true;
+
+    pthread_mutex_lock(&leak_lock);
+    if (leak_table == NULL) {
+        size_t sites_size = LEAK_NUM_SITES * sizeof(LeakSite);
+        size_t table_size = LEAK_TABLE_SIZE * sizeof(LeakEntry);
+        void *mem = mmap(NULL, sites_size + table_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            // The first call of backtrace() loads libgcc: it's done here and not in my_malloc
+            void *trace[1];
+            backtrace(trace, 1);
+
+            leak_sites = (LeakSite*)mem;
+            __atomic_store_n(&leak_table, (LeakEntry*)((unsigned char*)mem + sites_size), __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&leak_lock);
+
+    return leak_table != NULL;
+}
+
+// Record the allocation site of one allocation every rate (0 disables sampling)
+void set_leak_sample_rate(unsigned int rate) {
+    if (rate != 0 && !leak_tables_init()) return;
+    __atomic_store_n(&leak_sample_rate, rate, __ATOMIC_RELAXED);
+    // The other threads see the new rate within LEAK_RECHECK_INTERVAL allocations
+    leak_countdown = 0;
+}
+
+static bool leak_sample_slow() {
+    unsigned int rate = __atomic_load_n(&leak_sample_rate, __ATOMIC_RELAXED);
+    if (rate == 0) {
+        leak_countdown = LEAK_RECHECK_INTERVAL;
+        return false;
+    }
+    // Random distance with mean rate (the generator of the guarded pool is enough)
+    leak_countdown = (rate == 1) ? 1 : 1 + guarded_random() % (2 * rate - 1);
+    return true;
+}
+
+// Tells whether the site of this allocation must be recorded. It's called by every my_malloc.
+static inline bool leak_should_sample() {
+    if (__builtin_expect(leak_countdown > 1, 1)) {
+        leak_countdown--;
+        return false;
+    }
+    return leak_sample_slow();
+}
+
+static inline size_t leak_slot(uintptr_t ptr) {
+    return (size_t)(((ptr >> 4) * 0x9E3779B97F4A7C15ULL) >> 32) & (LEAK_TABLE_SIZE - 1);
+}
+
+// FNV-1a of the return addresses
+static uint64_t leak_trace_hash(void **trace, int depth) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < depth; i++) {
+        hash ^= (uint64_t)(uintptr_t)trace[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash | 1;    // 0 marks the empty slots
+}
+
+// Index of the site with this trace, added if it's new. -1 if the table is full.
+// Note: leak_lock must be held
+static int leak_find_site(void **trace, int depth) {
+    uint64_t hash = leak_trace_hash(trace, depth);
+    size_t i = (size_t)hash & (LEAK_NUM_SITES - 1);
+
+    while (leak_sites[i].hash != 0) {
+        LeakSite *site = &leak_sites[i];
+        if (site->hash == hash && site->depth == depth &&
+            memcmp(site->trace, trace, (size_t)depth * sizeof(void*)) == 0) {
+            return (int)i;
+        }
+        i = (i + 1) & (LEAK_NUM_SITES - 1);
+    }
+
+    // Keep the probe sequences short
+    if (leak_num_sites >= LEAK_NUM_SITES * 3 / 4) return -1;
+    leak_sites[i].hash = hash;
+    leak_sites[i].depth = depth;
+    memcpy(leak_sites[i].trace, trace, (size_t)depth * sizeof(void*));
+    leak_num_sites++;
+    return (int)i;
+}
+
+// Record the site of a sampled allocation. Returns false if it was dropped.
+static bool leak_record(void *ptr) {
+    void *trace[LEAK_TRACE_DEPTH];
+    int depth = backtrace(trace, LEAK_TRACE_DEPTH);
+
+    pthread_mutex_lock(&leak_lock);
+    int site = leak_find_site(trace, depth);
+    if (site < 0 || leak_num_entries >= LEAK_TABLE_SIZE * 3 / 4) {
+        leak_dropped++;
+        pthread_mutex_unlock(&leak_lock);
+        return false;
+    }
+
+    size_t i = leak_slot((uintptr_t)ptr);
+    while (leak_table[i].ptr != 0 && leak_table[i].ptr != (uintptr_t)ptr) {
+        i = (i + 1) & (LEAK_TABLE_SIZE - 1);
+    }
+    if (leak_table[i].ptr == 0) leak_num_entries++;
+    leak_table[i].ptr = (uintptr_t)ptr;
+    leak_table[i].site = (uint32_t)site;
+    pthread_mutex_unlock(&leak_lock);
+    return true;
+}
+
+// Position of a sampled block in the table, -1 if it's not there.
+// Note: leak_lock must be held
+static long leak_lookup(uintptr_t ptr) {
+    size_t i = leak_slot(ptr);
+    while (leak_table[i].ptr != 0) {
+        if (leak_table[i].ptr == ptr) return (long)i;
+        i = (i + 1) & (LEAK_TABLE_SIZE - 1);
+    }
+    return -1;
+}
+
+// Remove a freed block, marked as sampled, from the table.
+// Returns false if it wasn't there.
+static bool leak_forget(void *ptr) {
+    pthread_mutex_lock(&leak_lock);
+    long found = leak_lookup((uintptr_t)ptr);
+    if (found < 0) {
+        pthread_mutex_unlock(&leak_lock);
+        return false;
+    }
+
+    // Linear probing without tombstones: the entries after the hole that
+    // can't be found anymore are moved back into it
+    size_t hole = (size_t)found;
+    size_t i = (hole + 1) & (LEAK_TABLE_SIZE - 1);
+    while (leak_table[i].ptr != 0) {
+        size_t home = leak_slot(leak_table[i].ptr);
+        // The entry stays if its home is cyclically in (hole, i]
+        bool stays = (hole < i) ? (home > hole && home <= i) : (home > hole || home <= i);
+        if (!stays) {
+            leak_table[hole] = leak_table[i];
+            hole = i;
+        }
+        i = (i + 1) & (LEAK_TABLE_SIZE - 1);
+    }
+    leak_table[hole].ptr = 0;
+    leak_num_entries--;
+    pthread_mutex_unlock(&leak_lock);
+    return true;
+}
+
+// ---------------- Report ---------------------
+
+typedef struct LeakTotals {
+    size_t blocks;
+    size_t bytes;
+    // Blocks that were not sampled
+    size_t unknown_blocks;
+    size_t unknown_bytes;
+} LeakTotals;
+
+// Count a block still in use under its site.
+// Note: leak_lock must be held
+static void leak_count(LeakTotals *totals, void *payload, size_t size) {
+    totals->blocks++;
+    totals->bytes += size;
+
+    long found = (leak_table != NULL) ? leak_lookup((uintptr_t)payload) : -1;
+    if (found < 0) {
+        totals->unknown_blocks++;
+        totals->unknown_bytes += size;
+        return;
+    }
+    LeakSite *site = &leak_sites[leak_table[found].site];
+    site->leaked_blocks++;
+    site->leaked_bytes += size;
+}
+
+// Count the used blocks of a region of the heap, like print_memory()
+static void leak_walk_region(LeakTotals *totals, unsigned char *start, unsigned char *end) {
+    unsigned char *current = start;
+    while (current < end) {
+        Block *block = (Block*)current;
+        size_t size = get_size(block);
+        if (size == 0) break;
+
+        // With header checks, blocks left in the caches by another thread are marked
+        if (is_used(block) && !(load_header(block) & CACHED_FLAG)) {
+            leak_count(totals, block->payload, size - sizeof(size_t) - sizeof(Footer));
+        }
+        current += size;
+    }
+}
+
+// Count the objects in use of a slab
+static void leak_walk_slab(LeakTotals *totals, Slab *slab) {
+    size_t object_size = slab_class_sizes[slab->size_class];
+    for (unsigned int i = 0; i < slab->capacity; i++) {
+        if (!(slab->free_bits[i / 64] & (1ULL << (i % 64)))) {
+            leak_count(totals, (void*)(slab->span->start + i * object_size), object_size);
+        }
+    }
+}
+
+// Find all the blocks still in use. Note: every allocator lock must be held
+static void leak_walk(LeakTotals *totals) {
+    // 1. Static heap and sbrk region
+    unsigned char *static_end = (heap_state.gap_start != NULL) ? heap_state.gap_start : heap_state.top;
+    leak_walk_region(totals, (unsigned char*)heap_state.start, static_end);
+    if (heap_state.gap_start != NULL && heap_state.gap_end != NULL) {
+        leak_walk_region(totals, heap_state.gap_end, heap_state.top);
+    }
+
+    // 2. Mmap blocks
+    for (MmapTrackNode *node = mmap_tracker.head; node != NULL; node = node->next) {
+        Block *block = node->block;
+        leak_count(totals, block->payload, get_size(block) - sizeof(size_t));
+    }
+
+    // 3. Spans and slabs of the page heaps
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        for (Span *chunk = page_heaps[node].chunks; chunk != NULL; chunk = chunk->next) {
+            uintptr_t addr = chunk->start;
+            while (addr < span_end(chunk)) {
+                Span *span = (Span*)page_map_meta(page_map_get((void*)addr));
+                if (span->state == SPAN_IN_USE) {
+                    leak_count(totals, (void*)span->start, span->npages * SPAN_PAGE_SIZE);
+                } else if (span->state == SPAN_SLAB) {
+                    leak_walk_slab(totals, (Slab*)span->owner);
+                }
+                addr = span_end(span);
+            }
+        }
+    }
+
+    // 4. Guarded slots
+    for (int i = 0; i < GUARDED_NUM_SLOTS; i++) {
+        if (guarded_slots[i].state == GUARDED_SLOT_USED) {
+            leak_count(totals, guarded_slots[i].ptr, guarded_slots[i].size);
+        }
+    }
+}
+
+static int leak_compare_sites(const void *a, const void *b) {
+    size_t bytes_a = leak_sites[*(const int*)a].leaked_bytes;
+    size_t bytes_b = leak_sites[*(const int*)b].leaked_bytes;
+    return (bytes_a < bytes_b) - (bytes_a > bytes_b);
+}
+
+// Walk the allocator and print the blocks still in use, grouped by site.
+// Returns the number of blocks. Note: every allocator lock must be held
+static size_t leak_print_report(FILE *out) {
+    LeakTotals totals = {0};
+    if (leak_sites != NULL) {
+        for (int i = 0; i < LEAK_NUM_SITES; i++) {
+            leak_sites[i].leaked_blocks = 0;
+            leak_sites[i].leaked_bytes = 0;
+        }
+    }
+    leak_walk(&totals);
+
+    fprintf(out, "==LEAK== %zu blocks (%zu bytes) still allocated\n", totals.blocks, totals.bytes);
+
+    if (leak_sites != NULL) {
+        static int order[LEAK_NUM_SITES];
+        int num_sites = 0;
+        for (int i = 0; i < LEAK_NUM_SITES; i++) {
+            if (leak_sites[i].leaked_blocks > 0) order[num_sites++] = i;
+        }
+        qsort(order, (size_t)num_sites, sizeof(int), leak_compare_sites);
+
+        for (int i = 0; i < num_sites && i < LEAK_REPORT_SITES; i++) {
+            LeakSite *site = &leak_sites[order[i]];
+            fprintf(out, "==LEAK== %zu sampled blocks (%zu bytes) allocated at:\n",
+                    site->leaked_blocks, site->leaked_bytes);
+            // backtrace_symbols_fd writes directly on the file descriptor
+            fflush(out);
+            backtrace_symbols_fd(site->trace, site->depth, fileno(out));
+        }
+        if (num_sites > LEAK_REPORT_SITES) {
+            fprintf(out, "==LEAK== ... %d more sites\n", num_sites - LEAK_REPORT_SITES);
+        }
+        if (leak_dropped > 0) {
+            fprintf(out, "==LEAK== %zu samples dropped (tables full)\n", leak_dropped);
+        }
+    }
+
+    fprintf(out, "==LEAK== %zu blocks (%zu bytes) not sampled\n", totals.unknown_blocks, totals.unknown_bytes);
+    fflush(out);
+    return totals.blocks;
+}
+
+#endif
@@ -0,0 +1,352 @@
+#ifndef MALLCTL_H
+#define MALLCTL_H
+
+#include "heap_allocator_api.h"
+#include "data_structure.h"
+#include "utils.h"
+#include "mmap_allocator.h"
+#include "page_heap.h"
+#include "numa.h"
+#include "stats.h"
+#include "config.h"
+#include "budget.h"
+#include "memory_monitor.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    ------- INTROSPECTION AND CONTROL BY NAME ----------
+
+    my_mallctl() reads counters, reads and changes options, and triggers actions
+    through hierarchical names, so an admin endpoint can expose all of them with a
+    single generic function (the same interface as the mallctl of jemalloc):
+
+        int my_mallctl(const char *name, void *oldp, size_t *oldlenp,
+                       const void *newp, size_t newlen);
+
+    If oldp is not NULL, the current value is copied there and *oldlenp must be
+    its size. If newp is not NULL, the value is replaced with the newlen bytes it
+    points to. Actions are triggered by the name alone; the ones that have a
+    result (like the bytes released) copy it in oldp. Returns 0, or:
+        - ENOENT: the name (or the index in it) doesn't exist
+        - EINVAL: a wrong size, an invalid new value, or a new value for an
+        action (which is then not triggered)
+        - EPERM: a new value for a read-only name
+
+    Names (size_t values unless stated otherwise):
+        opt.<option>                  rw  the options of MY_MALLOC_CONF (config.h)
+                                          that have a value: size_t for sizes,
+                                          unsigned int for counts, sample rates and
+                                          intervals, bool for switches.
+                                          opt.memory_monitor is the interval of the
+                                          memory monitor, 0 when it's stopped
+        stats.allocated, stats.peak   r   bytes allocated now, and their peak
+        stats.reset_peak                  action: the peak restarts from now
+        stats.num_size_classes        r   unsigned int
+        stats.size_class.<i>.size     r   largest block of the class (0 = no limit)
+        stats.size_class.<i>.nmalloc  r   (and nfree, bytes) see stats.h
+        heap.size                     r   bytes of the static heap and the sbrk
+                                          region in use (up to the top)
+        heap.lists.<i>.nfree          r   free blocks in the segregated list i
+        heap.lists.<i>.bytes          r   and their bytes
+        heap.trim                         action: heap_compact(), bytes released
+        mmap.count, mmap.bytes        r   blocks allocated with mmap
+        arenas.count                  r   unsigned int: the page heaps, one per
+                                          NUMA node, are the arenas of the allocator
+        arenas.<i>.mapped             r   bytes mapped by the page heap i
+        arenas.<i>.free               r   bytes in its free spans
+        arenas.<i>.purge                  action: every free span is given back
+                                          to the kernel, bytes released
+        cache.flush                       action: my_flush_caches()
+        monitor.trims                 r   trims done by the memory monitor
+        monitor.released              r   and the bytes they released
+        budget.footprint              r   memory taken from the kernel (budget.h)
+        budget.reclaims               r   reclaims done over the soft limit
+        budget.failures               r   growths refused by the hard limit
+
+    Reading a heap.lists or arenas value takes the lock of the list or of the page
+    heap for the time of the walk.
+*/
+
+#define CTL_SIZE 0
+#define CTL_UINT 1
+#define CTL_BOOL 2
+
+typedef struct CtlOption {
+    const char *name;           // Key of the option in MY_MALLOC_CONF
+    int type;
+    void *value;
+} CtlOption;
+
+static const CtlOption ctl_options[] = {
+    { "mmap_threshold",          CTL_SIZE, &mmap_threshold },
+    { "sbrk_min_growth",         CTL_SIZE, &sbrk_min_growth },
+    { "span_release_pages",      CTL_SIZE, &span_release_threshold },
+    { "cache_bin_bytes",         CTL_SIZE, &cache_bin_bytes },
+    { "cache_scavenge_interval", CTL_UINT, &cache_scavenge_interval },
+    { "cpu_caches",              CTL_BOOL, &cpu_caches_enabled },
+    { "slabs",                   CTL_BOOL, &out_of_line_metadata },
+    { "prefetch",                CTL_BOOL, &prefetch_enabled },
+    { "header_checks",           CTL_BOOL, &header_checks_enabled },
+    { "guarded_sample",          CTL_UINT, &guarded_sample_rate },
+    { "leak_sample",             CTL_UINT, &leak_sample_rate },
+    { "quarantine",              CTL_SIZE, &quarantine_max_bytes },
+    { "quarantine_poison",       CTL_BOOL, &quarantine_poison },
+    { "stats",                   CTL_BOOL, &stats_on },
+    { "budget_soft",             CTL_SIZE, &budget_soft_limit },
+    { "budget_hard",             CTL_SIZE, &budget_hard_limit },
+    { "memory_monitor",          CTL_UINT, &memory_monitor.config.interval_ms },
+};
+
+#define CTL_NUM_OPTIONS (sizeof(ctl_options) / sizeof(ctl_options[0]))
+
+// Copy a value in oldp (if requested)
+static int ctl_read(void *oldp, size_t *oldlenp, const void *value, size_t len) {
+    if (oldp == NULL) return 0;
+    if (oldlenp == NULL || *oldlenp != len) return EINVAL;
+    memcpy(oldp, value, len);
+    return 0;
+}
+
+// Check the arguments of an action before triggering it: it has no value to
+// write, only a result to read
+static int ctl_action(void *oldp, size_t *oldlenp, const void *newp, size_t len) {
+    if (newp != NULL) return EINVAL;
+    if (oldp != NULL && (oldlenp == NULL || *oldlenp != len)) return EINVAL;
+    return 0;
+}
+
+static int ctl_read_size(void *oldp, size_t *oldlenp, const void *newp, size_t value) {
+    if (newp != NULL) return EPERM;
+    return ctl_read(oldp, oldlenp, &value, sizeof(value));
+}
+
+// If the name starts with prefix followed by an index and a dot, parse them
+// and point *rest to what follows. Returns false otherwise.
+static bool ctl_match_index(const char *name, const char *prefix, size_t *index, const char **rest) {
+    size_t len = strlen(prefix);
+    if (strncmp(name, prefix, len) != 0) return false;
+
+    const char *digits = name + len;
+    if (*digits < '0' || *digits > '9') return false;
+    char *end;
+    *index = (size_t)strtoull(digits, &end, 10);
+    if (*end != '.') return false;
+    *rest = end + 1;
+    return true;
+}
+
+static int ctl_option(const char *key, void *oldp, size_t *oldlenp, const void *newp, size_t newlen) {
+    for (size_t i = 0; i < CTL_NUM_OPTIONS; i++) {
+        const CtlOption *opt = &ctl_options[i];
+        if (strcmp(opt->name, key) != 0) continue;
+
+        size_t len = (opt->type == CTL_SIZE) ? sizeof(size_t) :
+                     (opt->type == CTL_UINT) ? sizeof(unsigned int) : sizeof(bool);
+        size_t size_value = 0;
+        unsigned int uint_value = 0;
+        bool bool_value = false;
+        const void *current;
+        if (opt->type == CTL_SIZE) {
+            size_value = __atomic_load_n((size_t*)opt->value, __ATOMIC_RELAXED);
+            current = &size_value;
+        } else if (opt->type == CTL_UINT) {
+            uint_value = __atomic_load_n((unsigned int*)opt->value, __ATOMIC_RELAXED);
+            current = &uint_value;
+        } else {
+            bool_value = __atomic_load_n((bool*)opt->value, __ATOMIC_RELAXED);
+            current = &bool_value;
+        }
+
+        int err = ctl_read(oldp, oldlenp, current, len);
+        if (err != 0 || newp == NULL) return err;
+        if (newlen != len) return EINVAL;
+
+        // The new value goes through the same checks and setters of MY_MALLOC_CONF
+        char value[32];
+        if (opt->type == CTL_SIZE) snprintf(value, sizeof(value), "%zu", *(const size_t*)newp);
+        else if (opt->type == CTL_UINT) snprintf(value, sizeof(value), "%u", *(const unsigned int*)newp);
+        else snprintf(value, sizeof(value), "%s", *(const bool*)newp ? "true" : "false");
+        return config_apply(key, value) ? 0 : EINVAL;
+    }
+    return ENOENT;
+}
+
+static int ctl_size_class(size_t idx, const char *field, void *oldp, size_t *oldlenp, const void *newp) {
+    if (idx >= STATS_NUM_CLASSES) return ENOENT;
+    SizeClassStats *cls = &size_class_stats[idx];
+
+    if (strcmp(field, "size") == 0) return ctl_read_size(oldp, oldlenp, newp, stats_class_size((int)idx));
+    if (strcmp(field, "nmalloc") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, __atomic_load_n(&cls->nmalloc, __ATOMIC_RELAXED));
+    }
+    if (strcmp(field, "nfree") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, __atomic_load_n(&cls->nfree, __ATOMIC_RELAXED));
+    }
+    if (strcmp(field, "bytes") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, __atomic_load_n(&cls->bytes, __ATOMIC_RELAXED));
+    }
+    return ENOENT;
+}
+
+static int ctl_heap_list(size_t idx, const char *field, void *oldp, size_t *oldlenp, const void *newp) {
+    if (idx >= NUM_LISTS) return ENOENT;
+    bool blocks = (strcmp(field, "nfree") == 0);
+    if (!blocks && strcmp(field, "bytes") != 0) return ENOENT;
+
+    size_t count = 0, bytes = 0;
+    lock_list((int)idx);
+    for (Block *block = segregatedLists[idx].head; block != NULL; block = get_next_free(block)) {
+        count++;
+        bytes += get_size(block);
+    }
+    unlock_list((int)idx);
+
+    return ctl_read_size(oldp, oldlenp, newp, blocks ? count : bytes);
+}
+
+static int ctl_arena(size_t idx, const char *field, void *oldp, size_t *oldlenp, const void *newp) {
+    if (idx >= (size_t)numa_node_count() || idx >= MAX_NUMA_NODES) return ENOENT;
+    PageHeap *ph = &page_heaps[idx];
+
+    if (strcmp(field, "purge") == 0) {
+        int err = ctl_action(oldp, oldlenp, newp, sizeof(size_t));
+        if (err != 0) return err;
+        size_t released = page_heap_purge(ph);
+        return ctl_read(oldp, oldlenp, &released, sizeof(released));
+    }
+
+    bool mapped = (strcmp(field, "mapped") == 0);
+    if (!mapped && strcmp(field, "free") != 0) return ENOENT;
+
+    size_t bytes = 0;
+    pthread_mutex_lock(&ph->lock);
+    if (mapped) {
+        for (Span *chunk = ph->chunks; chunk != NULL; chunk = chunk->next) {
+            bytes += chunk->npages << SPAN_PAGE_SHIFT;
+        }
+    } else {
+        for (size_t n = 1; n <= SPAN_MAX_PAGES + 1; n++) {
+            Span *list = (n <= SPAN_MAX_PAGES) ? ph->free_runs[n] : ph->large_runs;
+            for (Span *span = list; span != NULL; span = span->next) {
+                bytes += span->npages << SPAN_PAGE_SHIFT;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ph->lock);
+
+    return ctl_read_size(oldp, oldlenp, newp, bytes);
+}
+
+// Bytes of the heap regions in use, up to the top
+static size_t ctl_heap_size() {
+    unsigned char *top = get_heap_top();
+    unsigned char *start = (unsigned char*)heap_state.start;
+
+    if (heap_state.gap_end == NULL) return (size_t)(top - start);
+    return (size_t)(heap_state.gap_start - start) + (size_t)(top - heap_state.gap_end);
+}
+
+// Read or write a value, or trigger an action, by name (see above)
+int my_mallctl(const char *name, void *oldp, size_t *oldlenp, const void *newp, size_t newlen) {
+    size_t idx;
+    const char *rest;
+
+    if (name == NULL) return ENOENT;
+
+    // ---------- Options ----------
+    if (strncmp(name, "opt.", 4) == 0) {
+        return ctl_option(name + 4, oldp, oldlenp, newp, newlen);
+    }
+
+    // ---------- Statistics ----------
+    if (strcmp(name, "stats.allocated") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, __atomic_load_n(&alloc_stats.allocated, __ATOMIC_RELAXED));
+    }
+    if (strcmp(name, "stats.peak") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, __atomic_load_n(&alloc_stats.peak, __ATOMIC_RELAXED));
+    }
+    if (strcmp(name, "stats.reset_peak") == 0) {
+        if (ctl_action(NULL, NULL, newp, 0) != 0) return EINVAL;
+        stats_reset_peak();
+        return 0;
+    }
+    if (strcmp(name, "stats.num_size_classes") == 0) {
+        if (newp != NULL) return EPERM;
+        unsigned int count = STATS_NUM_CLASSES;
+        return ctl_read(oldp, oldlenp, &count, sizeof(count));
+    }
+    if (ctl_match_index(name, "stats.size_class.", &idx, &rest)) {
+        return ctl_size_class(idx, rest, oldp, oldlenp, newp);
+    }
+
+    // ---------- Heap ----------
+    if (strcmp(name, "heap.size") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, ctl_heap_size());
+    }
+    if (ctl_match_index(name, "heap.lists.", &idx, &rest)) {
+        return ctl_heap_list(idx, rest, oldp, oldlenp, newp);
+    }
+    if (strcmp(name, "heap.trim") == 0) {
+        int err = ctl_action(oldp, oldlenp, newp, sizeof(size_t));
+        if (err != 0) return err;
+        size_t released = heap_compact();
+        return ctl_read(oldp, oldlenp, &released, sizeof(released));
+    }
+
+    // ---------- Mmap blocks ----------
+    if (strcmp(name, "mmap.count") == 0 || strcmp(name, "mmap.bytes") == 0) {
+        size_t count = 0, bytes = 0;
+        pthread_mutex_lock(&mmap_tracker.lock);
+        for (MmapTrackNode *node = mmap_tracker.head; node != NULL; node = node->next) {
+            count++;
+            bytes += get_size(node->block);
+        }
+        pthread_mutex_unlock(&mmap_tracker.lock);
+        return ctl_read_size(oldp, oldlenp, newp, (name[5] == 'c') ? count : bytes);
+    }
+
+    // ---------- Page heaps ----------
+    if (strcmp(name, "arenas.count") == 0) {
+        if (newp != NULL) return EPERM;
+        unsigned int count = (unsigned int)numa_node_count();
+        if (count > MAX_NUMA_NODES) count = MAX_NUMA_NODES;
+        return ctl_read(oldp, oldlenp, &count, sizeof(count));
+    }
+    if (ctl_match_index(name, "arenas.", &idx, &rest)) {
+        return ctl_arena(idx, rest, oldp, oldlenp, newp);
+    }
+
+    // ---------- Caches ----------
+    if (strcmp(name, "cache.flush") == 0) {
+        if (ctl_action(NULL, NULL, newp, 0) != 0) return EINVAL;
+        my_flush_caches();
+        return 0;
+    }
+
+    // ---------- Memory monitor ----------
+    if (strcmp(name, "monitor.trims") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, __atomic_load_n(&memory_monitor.trims, __ATOMIC_RELAXED));
+    }
+    if (strcmp(name, "monitor.released") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, __atomic_load_n(&memory_monitor.released, __ATOMIC_RELAXED));
+    }
+
+    // ---------- Memory budget ----------
+    if (strcmp(name, "budget.footprint") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, __atomic_load_n(&budget_footprint, __ATOMIC_RELAXED));
+    }
+    if (strcmp(name, "budget.reclaims") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, __atomic_load_n(&budget_reclaims, __ATOMIC_RELAXED));
+    }
+    if (strcmp(name, "budget.failures") == 0) {
+        return ctl_read_size(oldp, oldlenp, newp, __atomic_load_n(&budget_failures, __ATOMIC_RELAXED));
+    }
+
+    return ENOENT;
+}
+
+#endif
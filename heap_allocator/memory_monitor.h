@@ -0,0 +1,267 @@
+#ifndef MEMORY_MONITOR_H
+#define MEMORY_MONITOR_H
+
+#include "heap_allocator_api.h"
+#include "numa.h"
+#include "page_heap.h"
+#include "handles.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+    ------- CGROUP AND MEMORY PRESSURE MONITOR ----------
+
+    Inside a container the process is killed when its cgroup uses more than
+    memory.max, and the kernel counts all the memory the allocator keeps for later
+    (free blocks of the heap, free spans, per-cpu caches, quarantine) as used.
+    The memory monitor (set_memory_monitor()) is a thread that wakes up every
+    interval_ms milliseconds and reads the cgroup v2 files:
+        - memory.max and memory.current: when the usage reaches percent% of the
+        limit ("max" means no limit), the memory is trimmed.
+        - memory.pressure (or /proc/pressure/memory outside a cgroup): when the
+        tasks waited for memory more than MONITOR_PSI_AVG10 percent of the time in
+        the last 10 seconds (the "some avg10" value of PSI), the memory is trimmed
+        even below the limit.
+    Trimming gives back everything the allocator can without moving data the user
+    can see:
+        1. my_flush_caches(): the quarantine, the per-cpu caches and the fast lists
+        are emptied, so their blocks are merged with their neighbours.
+        2. page_heap_purge() on every page heap: all the free spans are released.
+        3. heap_compact(): the unpinned handles are moved down and the free pages
+        at the top of the heap are given back (madvise).
+    A trim takes the locks of the heap, so when one releases nothing (the memory is
+    really in use) the monitor waits MONITOR_BACKOFF intervals before the next one.
+
+    The cgroup directory is found in /proc/self/cgroup (the "0::" line of cgroup
+    v2, below /sys/fs/cgroup), or it can be given: any directory with the same
+    files works, which is also how the monitor is tested.
+*/
+
+#define MONITOR_PERCENT 90              // Default threshold, percent of memory.max
+#define MONITOR_PSI_AVG10 10.0          // Percent of time stalled on memory
+#define MONITOR_BACKOFF 10              // Intervals skipped after a useless trim
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define PSI_SYSTEM_FILE "/proc/pressure/memory"
+
+typedef struct MonitorConfig {
+    unsigned int interval_ms;
+    unsigned int percent;
+    char cgroup_dir[PATH_MAX];      // Empty: only the pressure is read
+    char psi_file[PATH_MAX];
+} MonitorConfig;
+
+typedef struct MemoryMonitor {
+    pthread_mutex_t lock;           // Protects config, stop and the wait of the thread
+    pthread_cond_t wakeup;
+    pthread_t thread;
+    bool running;
+    bool stop;
+    MonitorConfig config;
+    size_t trims;                   // Trims done, and the bytes they released
+    size_t released;
+} MemoryMonitor;
+
+static MemoryMonitor memory_monitor = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wakeup = PTHREAD_COND_INITIALIZER,
+};
+// Serializes set_memory_monitor(), which waits for the thread to exit
+static pthread_mutex_t monitor_control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Give back to the kernel all the memory kept for later (see above).
+// Returns the bytes released by the page heaps and by the heap.
+static size_t memory_trim() {
+    size_t released = 0;
+
+    my_flush_caches();
+
+    int nodes = numa_node_count();
+    if (nodes > MAX_NUMA_NODES) nodes = MAX_NUMA_NODES;
+    for (int i = 0; i < nodes; i++) {
+        released += page_heap_purge(&page_heaps[i]);
+    }
+
+    released += heap_compact();
+    return released;
+}
+
+// Read a small file in buf. Returns false if it can't be read.
+// Note: open/read don't allocate, unlike fopen
+static bool monitor_read_file(const char *path, char *buf, size_t len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ssize_t n = read(fd, buf, len - 1);
+    close(fd);
+    if (n <= 0) return false;
+    buf[n] = '\0';
+    return true;
+}
+
+// Read a number (or "max", returned as SIZE_MAX) from a file of the cgroup
+static bool monitor_read_value(const char *dir, const char *name, size_t *value) {
+    char path[PATH_MAX + 32];
+    char buf[64];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (!monitor_read_file(path, buf, sizeof(buf))) return false;
+
+    if (strncmp(buf, "max", 3) == 0) {
+        *value = SIZE_MAX;
+        return true;
+    }
+    char *end;
+    if (buf[0] < '0' || buf[0] > '9') return false;
+    *value = (size_t)strtoull(buf, &end, 10);
+    return *end == '\n' || *end == '\0';
+}
+
+// The "some avg10" value of a PSI file, or a negative value if it can't be read
+static double monitor_read_pressure(const char *path) {
+    char buf[256];
+    if (!monitor_read_file(path, buf, sizeof(buf))) return -1.0;
+    if (strncmp(buf, "some ", 5) != 0) return -1.0;
+    char *avg10 = strstr(buf, "avg10=");
+    if (avg10 == NULL) return -1.0;
+    return strtod(avg10 + 6, NULL);
+}
+
+// Find the cgroup v2 directory of the process. Returns false if there is none.
+static bool monitor_find_cgroup(char *dir, size_t len) {
+    char buf[PATH_MAX];
+    if (!monitor_read_file("/proc/self/cgroup", buf, sizeof(buf))) return false;
+
+    // With cgroup v2 the file has a single "0::/path" line
+    char *line = strstr(buf, "0::");
+    if (line == NULL || (line != buf && line[-1] != '\n')) return false;
+    line += 3;
+    line[strcspn(line, "\n")] = '\0';
+
+    int n = snprintf(dir, len, "%s%s", CGROUP_ROOT, line);
+    return n > 0 && (size_t)n < len;
+}
+
+static bool monitor_under_pressure(const MonitorConfig *config) {
+    size_t max, current;
+    if (config->cgroup_dir[0] != '\0' &&
+        monitor_read_value(config->cgroup_dir, "memory.max", &max) && max != SIZE_MAX &&
+        monitor_read_value(config->cgroup_dir, "memory.current", &current) &&
+        current >= max / 100 * config->percent) {
+        return true;
+    }
+    return monitor_read_pressure(config->psi_file) >= MONITOR_PSI_AVG10;
+}
+
+static void* monitor_thread(void *arg) {
+    MonitorConfig config;
+    unsigned int skip = 0;
+
+    pthread_mutex_lock(&memory_monitor.lock);
+    while (!memory_monitor.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += memory_monitor.config.interval_ms / 1000;
+        deadline.tv_nsec += (long)(memory_monitor.config.interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (!memory_monitor.stop &&
+               pthread_cond_timedwait(&memory_monitor.wakeup, &memory_monitor.lock, &deadline) != ETIMEDOUT) {
+        }
+        if (memory_monitor.stop) break;
+
+        // The files are read and the memory trimmed without holding the lock
+        config = memory_monitor.config;
+        pthread_mutex_unlock(&memory_monitor.lock);
+
+        if (skip > 0) {
+            skip--;
+        } else if (monitor_under_pressure(&config)) {
+            size_t released = memory_trim();
+            __atomic_fetch_add(&memory_monitor.trims, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&memory_monitor.released, released, __ATOMIC_RELAXED);
+            if (released == 0) skip = MONITOR_BACKOFF;
+        }
+
+        pthread_mutex_lock(&memory_monitor.lock);
+    }
+    pthread_mutex_unlock(&memory_monitor.lock);
+    return arg;
+}
+
+// Start the memory monitor, checking the cgroup every interval_ms milliseconds and
+// trimming when its usage reaches percent% of memory.max (see above). cgroup_dir
+// NULL finds the cgroup of the process. interval_ms 0 stops the monitor.
+// Returns false if the parameters are invalid or there is nothing to monitor.
+bool set_memory_monitor(unsigned int interval_ms, unsigned int percent, const char *cgroup_dir) {
+    pthread_mutex_lock(&monitor_control_lock);
+
+    // Stop the running thread first, also to restart it with new parameters
+    if (memory_monitor.running) {
+        pthread_mutex_lock(&memory_monitor.lock);
+        memory_monitor.stop = true;
+        pthread_cond_signal(&memory_monitor.wakeup);
+        pthread_mutex_unlock(&memory_monitor.lock);
+        pthread_join(memory_monitor.thread, NULL);
+        memory_monitor.running = false;
+        // Read by my_mallctl() without the lock: 0 while the monitor is stopped
+        __atomic_store_n(&memory_monitor.config.interval_ms, 0, __ATOMIC_RELAXED);
+    }
+    if (interval_ms == 0) {
+        pthread_mutex_unlock(&monitor_control_lock);
+        return true;
+    }
+    if (percent == 0 || percent > 100) {
+        pthread_mutex_unlock(&monitor_control_lock);
+        return false;
+    }
+
+    char dir[PATH_MAX];
+    dir[0] = '\0';
+    if (cgroup_dir != NULL) {
+        if (strlen(cgroup_dir) >= sizeof(dir)) {
+            pthread_mutex_unlock(&monitor_control_lock);
+            return false;
+        }
+        strcpy(dir, cgroup_dir);
+    } else if (!monitor_find_cgroup(dir, sizeof(dir))) {
+        dir[0] = '\0';
+    }
+
+    // The pressure of the cgroup if it's there, otherwise the one of the system
+    char psi[PATH_MAX];
+    size_t limit;
+    bool has_limit = dir[0] != '\0' && monitor_read_value(dir, "memory.max", &limit);
+    int n = snprintf(psi, sizeof(psi), "%s/memory.pressure", dir);
+    if (dir[0] == '\0' || n < 0 || (size_t)n >= sizeof(psi) || access(psi, R_OK) != 0) {
+        strcpy(psi, PSI_SYSTEM_FILE);
+    }
+    if (!has_limit && monitor_read_pressure(psi) < 0) {
+        pthread_mutex_unlock(&monitor_control_lock);
+        return false;
+    }
+
+    pthread_mutex_lock(&memory_monitor.lock);
+    memory_monitor.stop = false;
+    memory_monitor.config.percent = percent;
+    strcpy(memory_monitor.config.cgroup_dir, has_limit ? dir : "");
+    strcpy(memory_monitor.config.psi_file, psi);
+    __atomic_store_n(&memory_monitor.config.interval_ms, interval_ms, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&memory_monitor.lock);
+
+    bool started = pthread_create(&memory_monitor.thread, NULL, monitor_thread, NULL) == 0;
+    memory_monitor.running = started;
+    if (!started) __atomic_store_n(&memory_monitor.config.interval_ms, 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&monitor_control_lock);
+    return started;
+}
+
+#endif
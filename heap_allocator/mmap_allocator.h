@@ -2,6 +2,9 @@
 #define MMAP_ALLOCATOR
 
 #include "utils.h"
+#include "numa.h"
+#include "page_map.h"
+#include "budget.h"
 #include <sys/mman.h>
 #include <stdlib.h>
 
@@ -30,56 +33,76 @@ typedef struct MmapTrackNode {
     struct MmapTrackNode *prev;
 } MmapTrackNode;
 
-static MmapTrackNode *mmap_tracked_head = NULL;
-static MmapTrackNode *mmap_tracked_tail = NULL;
+// Cold state: touched only by mmap allocations and by the debug printer,
+// so it's kept away from the cache lines of the heap state
+typedef struct MmapTracker {
+    pthread_mutex_t lock;       // Protects the tracking list
+    MmapTrackNode *head;
+    MmapTrackNode *tail;
+} CACHE_ALIGNED MmapTracker;
+
+static MmapTracker mmap_tracker = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
 static inline void mmap_track_add(Block *block) {
     MmapTrackNode *node = (MmapTrackNode*)malloc(sizeof(MmapTrackNode));
     if (!node) return;
 
+    pthread_mutex_lock(&mmap_tracker.lock);
+
     node->block = block;
     node->next = NULL;
-    node->prev = mmap_tracked_tail;
+    node->prev = mmap_tracker.tail;
 
-    if (mmap_tracked_tail) {
-        mmap_tracked_tail->next = node;
+    if (mmap_tracker.tail) {
+        mmap_tracker.tail->next = node;
     } else {
-        mmap_tracked_head = node;
+        mmap_tracker.head = node;
     }
-    mmap_tracked_tail = node;
+    mmap_tracker.tail = node;
+
+    pthread_mutex_unlock(&mmap_tracker.lock);
 }
 
 static inline void mmap_track_remove(Block *block) {
-    MmapTrackNode *cur = mmap_tracked_head;
+    pthread_mutex_lock(&mmap_tracker.lock);
+
+    MmapTrackNode *cur = mmap_tracker.head;
     while (cur) {
         if (cur->block == block) {
             if (cur->prev) cur->prev->next = cur->next;
-            else mmap_tracked_head = cur->next;
+            else mmap_tracker.head = cur->next;
 
             if (cur->next) cur->next->prev = cur->prev;
-            else mmap_tracked_tail = cur->prev;
+            else mmap_tracker.tail = cur->prev;
 
+            pthread_mutex_unlock(&mmap_tracker.lock);
             free(cur);
             return;
         }
         cur = cur->next;
     }
+
+    pthread_mutex_unlock(&mmap_tracker.lock);
 }
 
 // --------------------------------------------------------------
 
+// Runtime value of MMAP_THRESHOLD, set through MY_MALLOC_CONF (see config.h)
+static size_t mmap_threshold = MMAP_THRESHOLD;
+
+static inline size_t get_mmap_threshold() {
+    return __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED);
+}
+
 // Check if a block is allocated with mmap using a bitwise operation
 static inline bool is_mmap(Block *b) {
-    return b->header & MMAP_FLAG;
+    return load_header(b) & MMAP_FLAG;
 }
 
 // Set the block's mmap flag using a bitwise operation
 static inline void set_mmap(Block *b, bool mmap_flag) {
-    if (mmap_flag) {
-        b->header |= MMAP_FLAG;
-    } else {
-        b->header &= ~MMAP_FLAG;
-    }
+    size_t fields = load_header(b) & HEADER_FIELDS_MASK;
+    store_header(b, make_header(b, mmap_flag ? (fields | MMAP_FLAG) : (fields & ~MMAP_FLAG)));
 }
 
 static void* mmap_allocation(size_t size) {
@@ -102,17 +125,31 @@ static void* mmap_allocation(size_t size) {
             it and it will not be shared. The MAP_ANONYMOUS flag indicates
             not to map to a file.
     */
+    if (!budget_charge(mmap_size)) {
+        return NULL;
+    }
     void *ptr = mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, 
                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     
     if (ptr == MAP_FAILED) {
+        budget_uncharge(mmap_size);
         return NULL;
     }
+
+    // Place the block on the node of the thread that requested it
+    numa_bind_to_local_node(ptr, mmap_size);
     
     Block *block = (Block*)ptr;
     
     // Set the block with the mmap flag true and the is_used flag true
-    block->header = (mmap_size & SIZE_MASK) | 1 | MMAP_FLAG;
+    store_header(block, make_header(block, (mmap_size & SIZE_MASK) | 1 | MMAP_FLAG));
+
+    // Every page of the block points to its header in the page map
+    if (!page_map_set_range(block, mmap_size, page_map_entry(block, PAGE_KIND_MMAP))) {
+        munmap(ptr, mmap_size);
+        budget_uncharge(mmap_size);
+        return NULL;
+    }
 
     // Track this mmap allocation so debug utilities can print it
     mmap_track_add(block);
@@ -126,7 +163,9 @@ static void mmap_free(Block *block) {
 
     // Remove from tracking list before unmapping
     mmap_track_remove(block);
+    page_map_clear_range(block, size);
     munmap(block, size);
+    budget_uncharge(size);
 }
 
 #endif
\ No newline at end of file
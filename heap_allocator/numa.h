@@ -0,0 +1,108 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/*
+    ------- NUMA AWARE PLACEMENT OF THE GROWTH REGIONS ----------
+
+    On multi-socket machines every socket (NUMA node) has its own memory,
+    and accessing the memory of another node is noticeably slower.
+    By default Linux places a page on the node of the thread that touches
+    it first, so a region obtained by one thread but filled by another one
+    can end up on the wrong node.
+
+    To avoid this, every time the allocator asks the kernel for new memory
+    (sbrk extension of the heap or mmap of a large block) the region is
+    bound to the node of the thread that requested it:
+        1. The current node is obtained through the getcpu syscall,
+           which returns both the cpu and the node the thread is running on.
+        2. The region is bound to that node with the mbind syscall using
+           the MPOL_PREFERRED policy. The policy is applied when the pages
+           are touched the first time, and if the node runs out of memory
+           the kernel can still fall back to another node.
+
+    Only raw syscalls are used, so libnuma is not required. On machines
+    with a single node all the functions are no-ops.
+*/
+
+// Maximum number of nodes supported by the node mask passed to mbind
+#define MAX_NUMA_NODES 64
+
+// Get the number of NUMA nodes of the machine.
+// The list of the online nodes is read once from sysfs, it has
+// the form "0" or "0-1" so the last number + 1 is the node count.
+static int numa_node_count() {
+    static int node_count = 0;
+    if (node_count != 0) return node_count;
+
+    // read() is used instead of fopen() because fopen allocates
+    // a buffer through malloc
+    char buf[64];
+    ssize_t len = -1;
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd >= 0) {
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+    }
+
+    int last_node = 0;
+    if (len > 0) {
+        buf[len] = '\0';
+        // Parse the last number of the list
+        int current = 0;
+        for (ssize_t i = 0; i < len; i++) {
+            if (buf[i] >= '0' && buf[i] <= '9') {
+                current = current * 10 + (buf[i] - '0');
+            } else {
+                if (i > 0 && buf[i - 1] >= '0' && buf[i - 1] <= '9') last_node = current;
+                current = 0;
+            }
+        }
+        if (buf[len - 1] >= '0' && buf[len - 1] <= '9') last_node = current;
+    }
+
+    node_count = last_node + 1;
+    if (node_count > MAX_NUMA_NODES) node_count = MAX_NUMA_NODES;
+    return node_count;
+}
+
+// Get the node of the cpu the calling thread is running on
+static inline int numa_current_node() {
+    unsigned int cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+    return (node < MAX_NUMA_NODES) ? (int)node : 0;
+}
+
+// Bind the region [addr, addr + length) to the given node.
+// The region doesn't need to be page aligned: mbind works on whole pages,
+// so the start is rounded down to the page that contains it.
+static void numa_bind_region(void *addr, size_t length, int node) {
+    if (numa_node_count() <= 1 || length == 0) return;
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(page_size - 1);
+    uintptr_t end = ((uintptr_t)addr + length + page_size - 1) & ~(page_size - 1);
+
+    unsigned long node_mask = 1UL << node;
+    // The error is ignored on purpose: without the binding the memory
+    // is still usable, it's just placed by the default policy
+    syscall(SYS_mbind, (void*)start, end - start, MPOL_PREFERRED,
+            &node_mask, (unsigned long)MAX_NUMA_NODES + 1, 0);
+}
+
+// Bind a region just obtained from the kernel to the node of the calling thread
+static inline void numa_bind_to_local_node(void *addr, size_t length) {
+    if (numa_node_count() <= 1) return;
+    numa_bind_region(addr, length, numa_current_node());
+}
+
+#endif
@@ -0,0 +1,367 @@
+#ifndef PAGE_HEAP_H
+#define PAGE_HEAP_H
+
+#include "data_structure.h"
+#include "numa.h"
+#include "page_map.h"
+#include "budget.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/*
+    ------- PAGE HEAP FOR MID-SIZE ALLOCATIONS ----------
+
+    Allocations between SPAN_THRESHOLD and MMAP_THRESHOLD are too big for
+    the boundary-tag blocks of the heap (a linear search for a big block and
+    the risk of fragmenting the small ones) and too small to pay a mmap
+    syscall each. They are served by a page heap, in runs of whole pages
+    called spans:
+
+        - Span: a run of contiguous pages, either in use or free. Its metadata
+        (first page, number of pages, state) is stored out of line, in Span
+        structs allocated from a separate pool. The pages themselves contain
+        only user data: the pointer returned to the user is the first page
+        of the span, so big buffers are always page aligned.
+        - Chunk: memory is obtained from the kernel with mmap in chunks of
+        SPAN_CHUNK_PAGES pages. A new chunk starts as a single free span.
+        - Free runs: free spans are kept in lists indexed by their number of
+        pages (free_runs[n] holds spans of n pages), and spans bigger than
+        SPAN_MAX_PAGES are kept in the large list.
+        - Page map: every page of a span in use points to its Span struct,
+        so my_free finds the span of a pointer in O(1). A free span needs
+        only its first and last pages in the map, to be found by its
+        neighbors when they are freed.
+
+    Allocation takes the first span of the list for the requested number of
+    pages (or of the next non-empty list) and splits it, putting the
+    remaining pages back in the free runs. Freeing a span merges it with the
+    free spans before and after it in the same chunk (found through the page
+    map), so no search is needed. When the merged span is big enough, its
+    pages are given back to the kernel with madvise(MADV_DONTNEED): the
+    address range stays reserved, but the memory is released.
+
+    A span in use can also be cut into small objects by the slab allocator
+    (state SPAN_SLAB, see slab.h).
+
+    There is one page heap for every NUMA node: a thread takes pages from
+    the heap of its node, whose chunks are bound to that node (see numa.h).
+    Each page heap has its own lock.
+*/
+
+// Allocations from this size up to MMAP_THRESHOLD use the page heap
+#define SPAN_THRESHOLD (8 * 1024)
+#define SPAN_PAGE_SHIFT PAGE_MAP_SHIFT
+#define SPAN_PAGE_SIZE (1UL << SPAN_PAGE_SHIFT)
+// Number of pages of the largest span that can be requested
+#define SPAN_MAX_PAGES (MMAP_THRESHOLD / SPAN_PAGE_SIZE)
+// Number of pages mapped at once from the kernel (1 MB)
+#define SPAN_CHUNK_PAGES 256
+// Free spans with at least this number of pages are given back to the kernel
+#define SPAN_RELEASE_PAGES 64
+// Bytes mapped at once for the Span structs
+#define SPAN_META_CHUNK (64 * 1024)
+
+#define SPAN_FREE 0
+#define SPAN_IN_USE 1
+#define SPAN_CHUNK 2
+#define SPAN_SLAB 3            // In use as a slab of small objects (see slab.h)
+
+typedef struct Span {
+    uintptr_t start;            // Address of the first page
+    size_t npages;
+    struct Span *next;          // Links of the free run list (or of the chunk list)
+    struct Span *prev;
+    struct Span *chunk;         // Chunk that contains the span
+    void *owner;                // Metadata of the user of the span (the Slab struct of a slab)
+    unsigned char state;        // Read without locks by my_free: always accessed atomically
+    unsigned char node;         // NUMA node of the page heap that owns the span
+    bool released;              // Pages given back to the kernel
+    unsigned int sampled;       // Objects of the span sampled by the leak report
+} Span;
+
+typedef struct PageHeap {
+    pthread_mutex_t lock;
+    Span *free_runs[SPAN_MAX_PAGES + 1];
+    Span *large_runs;
+    Span *chunks;
+} CACHE_ALIGNED PageHeap;
+
+// Runtime value of SPAN_RELEASE_PAGES (0 never releases), see config.h
+static size_t span_release_threshold = SPAN_RELEASE_PAGES;
+
+static PageHeap page_heaps[MAX_NUMA_NODES] = {
+    [0 ... MAX_NUMA_NODES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+// Pool of Span structs
+static Span *span_meta_free_list = NULL;
+static unsigned char *span_meta_top = NULL;
+static unsigned char *span_meta_end = NULL;
+static pthread_mutex_t span_meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// ---------------- Span metadata ---------------------
+
+static Span* span_meta_alloc() {
+    pthread_mutex_lock(&span_meta_lock);
+
+    Span *span = span_meta_free_list;
+    if (span != NULL) {
+        span_meta_free_list = span->next;
+    } else {
+        if (span_meta_top == NULL || span_meta_top + sizeof(Span) > span_meta_end) {
+            void *mem = mmap(NULL, SPAN_META_CHUNK, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                pthread_mutex_unlock(&span_meta_lock);
+                return NULL;
+            }
+            span_meta_top = (unsigned char*)mem;
+            span_meta_end = span_meta_top + SPAN_META_CHUNK;
+        }
+        span = (Span*)span_meta_top;
+        span_meta_top += sizeof(Span);
+    }
+    span->sampled = 0;
+
+    pthread_mutex_unlock(&span_meta_lock);
+    return span;
+}
+
+static void span_meta_free(Span *span) {
+    pthread_mutex_lock(&span_meta_lock);
+    span->next = span_meta_free_list;
+    span_meta_free_list = span;
+    pthread_mutex_unlock(&span_meta_lock);
+}
+
+// ---------------- Free runs ---------------------
+// Note: the lock of the page heap must be held
+
+static inline Span** span_free_list(PageHeap *ph, size_t npages) {
+    return (npages <= SPAN_MAX_PAGES) ? &ph->free_runs[npages] : &ph->large_runs;
+}
+
+static inline uintptr_t span_end(Span *span) {
+    return span->start + (span->npages << SPAN_PAGE_SHIFT);
+}
+
+static void span_insert_free(PageHeap *ph, Span *span) {
+    Span **list = span_free_list(ph, span->npages);
+
+    __atomic_store_n(&span->state, SPAN_FREE, __ATOMIC_RELAXED);
+    span->prev = NULL;
+    span->next = *list;
+    if (*list != NULL) (*list)->prev = span;
+    *list = span;
+
+    // Only the first and last pages are needed to find a free span
+    PageMapEntry entry = page_map_entry(span, PAGE_KIND_SPAN);
+    page_map_set_range((void*)span->start, SPAN_PAGE_SIZE, entry);
+    page_map_set_range((void*)(span_end(span) - SPAN_PAGE_SIZE), SPAN_PAGE_SIZE, entry);
+}
+
+static void span_remove_free(PageHeap *ph, Span *span) {
+    if (span->prev) span->prev->next = span->next;
+    else *span_free_list(ph, span->npages) = span->next;
+
+    if (span->next) span->next->prev = span->prev;
+
+    span->next = NULL;
+    span->prev = NULL;
+}
+
+// Get the free span that starts or ends at the page containing addr, NULL if
+// there is none. The page map entries of free spans are only meaningful on their
+// boundaries, so the span is checked against the expected boundary.
+static Span* span_free_neighbor(Span *span, uintptr_t addr, bool before) {
+    PageMapEntry entry = page_map_get((void*)addr);
+    if (page_map_kind(entry) != PAGE_KIND_SPAN) return NULL;
+
+    Span *neighbor = (Span*)page_map_meta(entry);
+    if (__atomic_load_n(&neighbor->state, __ATOMIC_RELAXED) != SPAN_FREE || neighbor->chunk != span->chunk) {
+        return NULL;
+    }
+
+    if (before && span_end(neighbor) != span->start) return NULL;
+    if (!before && neighbor->start != span_end(span)) return NULL;
+
+    return neighbor;
+}
+
+// Give the pages of a free span back to the kernel (and take them out of the budget)
+static void span_release_pages(Span *span) {
+    if (span->released) return;
+    madvise((void*)span->start, span->npages << SPAN_PAGE_SHIFT, MADV_DONTNEED);
+    budget_uncharge(span->npages << SPAN_PAGE_SHIFT);
+    span->released = true;
+}
+
+// ---------------- Chunks ---------------------
+
+// Map a new chunk for the given page heap and insert it as a free span
+static Span* page_heap_grow(PageHeap *ph, int node, size_t npages) {
+    if (npages < SPAN_CHUNK_PAGES) npages = SPAN_CHUNK_PAGES;
+    size_t length = npages << SPAN_PAGE_SHIFT;
+
+    Span *chunk = span_meta_alloc();
+    Span *span = span_meta_alloc();
+    if (chunk == NULL || span == NULL) {
+        if (chunk) span_meta_free(chunk);
+        if (span) span_meta_free(span);
+        return NULL;
+    }
+
+    // The chunk is only reserved: its spans are charged to the budget when they are used
+    void *mem = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        span_meta_free(chunk);
+        span_meta_free(span);
+        return NULL;
+    }
+    numa_bind_region(mem, length, node);
+
+    chunk->start = (uintptr_t)mem;
+    chunk->npages = npages;
+    chunk->state = SPAN_CHUNK;
+    chunk->node = (unsigned char)node;
+    chunk->chunk = chunk;
+    chunk->prev = NULL;
+    chunk->next = ph->chunks;
+    ph->chunks = chunk;
+
+    span->start = (uintptr_t)mem;
+    span->npages = npages;
+    span->chunk = chunk;
+    span->node = (unsigned char)node;
+    // Fresh pages from mmap are not backed by memory until they are touched
+    span->released = true;
+    span_insert_free(ph, span);
+
+    return span;
+}
+
+// ---------------- Allocation and free ---------------------
+
+// Find the first free span with at least npages pages
+static Span* span_find_free(PageHeap *ph, size_t npages) {
+    for (size_t n = npages; n <= SPAN_MAX_PAGES; n++) {
+        if (ph->free_runs[n] != NULL) return ph->free_runs[n];
+    }
+    for (Span *span = ph->large_runs; span != NULL; span = span->next) {
+        if (span->npages >= npages) return span;
+    }
+    return NULL;
+}
+
+static void* span_allocation(size_t size) {
+    size_t npages = (size + SPAN_PAGE_SIZE - 1) >> SPAN_PAGE_SHIFT;
+
+    int node = (numa_node_count() > 1) ? numa_current_node() : 0;
+    PageHeap *ph = &page_heaps[node];
+
+    pthread_mutex_lock(&ph->lock);
+
+    Span *span = span_find_free(ph, npages);
+    if (span == NULL) span = page_heap_grow(ph, node, npages);
+    // The released pages get memory again, if the budget allows it
+    if (span == NULL || (span->released && !budget_charge(npages << SPAN_PAGE_SHIFT))) {
+        pthread_mutex_unlock(&ph->lock);
+        return NULL;
+    }
+
+    span_remove_free(ph, span);
+
+    // Split: the remaining pages become a new free span
+    if (span->npages > npages) {
+        Span *rest = span_meta_alloc();
+        if (rest != NULL) {
+            rest->start = span->start + (npages << SPAN_PAGE_SHIFT);
+            rest->npages = span->npages - npages;
+            rest->chunk = span->chunk;
+            rest->node = span->node;
+            rest->released = span->released;
+            span->npages = npages;
+            span_insert_free(ph, rest);
+        } else if (span->released) {
+            // The whole span is used: its other pages are charged too
+            budget_charge_always((span->npages - npages) << SPAN_PAGE_SHIFT);
+        }
+    }
+
+    __atomic_store_n(&span->state, SPAN_IN_USE, __ATOMIC_RELAXED);
+    span->owner = NULL;
+    span->released = false;
+    // Every page of a span in use points to it
+    page_map_set_range((void*)span->start, span->npages << SPAN_PAGE_SHIFT,
+                       page_map_entry(span, PAGE_KIND_SPAN));
+
+    pthread_mutex_unlock(&ph->lock);
+
+    return (void*)span->start;
+}
+
+static void span_free(Span *span) {
+    PageHeap *ph = &page_heaps[span->node];
+
+    pthread_mutex_lock(&ph->lock);
+
+    // Merge with the free span that ends right before this one.
+    // The span was in use, so the merged span is not released: the released pages
+    // of the neighbours are charged again, and given back with the whole span.
+    Span *prev = span_free_neighbor(span, span->start - SPAN_PAGE_SIZE, true);
+    if (prev != NULL) {
+        span_remove_free(ph, prev);
+        if (prev->released) budget_charge_always(prev->npages << SPAN_PAGE_SHIFT);
+        span->start = prev->start;
+        span->npages += prev->npages;
+        span_meta_free(prev);
+    }
+
+    // Merge with the free span that starts right after this one
+    Span *next = span_free_neighbor(span, span_end(span), false);
+    if (next != NULL) {
+        span_remove_free(ph, next);
+        if (next->released) budget_charge_always(next->npages << SPAN_PAGE_SHIFT);
+        span->npages += next->npages;
+        span_meta_free(next);
+    }
+
+    size_t release_pages = __atomic_load_n(&span_release_threshold, __ATOMIC_RELAXED);
+    if (release_pages != 0 && span->npages >= release_pages) {
+        span_release_pages(span);
+    }
+
+    span_insert_free(ph, span);
+
+    pthread_mutex_unlock(&ph->lock);
+}
+
+// Give back to the kernel the pages of all the free spans of a page heap,
+// whatever their size. Returns the number of bytes released.
+static size_t page_heap_purge(PageHeap *ph) {
+    size_t released = 0;
+
+    pthread_mutex_lock(&ph->lock);
+    for (size_t n = 1; n <= SPAN_MAX_PAGES + 1; n++) {
+        Span *list = (n <= SPAN_MAX_PAGES) ? ph->free_runs[n] : ph->large_runs;
+        for (Span *span = list; span != NULL; span = span->next) {
+            if (!span->released) released += span->npages << SPAN_PAGE_SHIFT;
+            span_release_pages(span);
+        }
+    }
+    pthread_mutex_unlock(&ph->lock);
+
+    return released;
+}
+
+// Tells whether ptr is inside a span in use, given its page map entry
+static inline bool span_owns(PageMapEntry entry, const void *ptr) {
+    Span *span = (Span*)page_map_meta(entry);
+    return __atomic_load_n(&span->state, __ATOMIC_RELAXED) == SPAN_IN_USE &&
+           (uintptr_t)ptr >= span->start && (uintptr_t)ptr < span_end(span);
+}
+
+#endif
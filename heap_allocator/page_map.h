@@ -0,0 +1,148 @@
+#ifndef PAGE_MAP_H
+#define PAGE_MAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+/*
+    ------- PAGE MAP ----------
+
+    The page map tells, for every page of the address space, whether the
+    memory belongs to the allocator and how it was obtained. Thanks to it,
+    my_free can classify a pointer without reading the header in front of it
+    (which for a foreign or invalid pointer may not exist at all), and
+    my_owns can answer in constant time.
+
+    It's a radix tree with 3 levels, like the page table of the processor.
+    User space addresses use 48 bits and pages are 4KB (12 bits), so a page
+    number has 36 bits, split in 3 groups of 12 bits. Each group is the index
+    in one level of the tree:
+
+        address:  | root (12) | mid (12) | leaf (12) | offset in page (12) |
+
+        page_map_root[root] --> mid node[mid] --> leaf node[leaf] --> entry
+
+    The root is a static array, while the mid and leaf nodes are mapped only
+    when some page in their range is registered, so the tree stays small
+    for a sparse address space. A lookup costs 3 dependent loads.
+
+    Every entry is a word that stores the kind of the page in its 3 least
+    significant bits and, for kinds that need it, a pointer to the metadata
+    of the memory region in the other bits (metadata is at least 8-byte aligned):
+        - PAGE_KIND_NONE: the page is not owned by the allocator
+        - PAGE_KIND_HEAP: static heap or sbrk region, blocks have the usual
+          header and footer
+        - PAGE_KIND_MMAP: page of a block allocated with mmap, the pointer is
+          the header of the block
+        - PAGE_KIND_SPAN: page of a span of the page heap, the pointer is its
+          Span struct (see page_heap.h)
+        - PAGE_KIND_GUARDED: page of a sampled allocation, the pointer is its
+          slot in the guarded pool (see guarded_pool.h)
+    Since the metadata can be found from any address, an allocation doesn't
+    need a header in front of it to be freed.
+*/
+
+#define PAGE_MAP_SHIFT 12
+#define PAGE_MAP_LEVEL_BITS 12
+#define PAGE_MAP_LEVEL_SIZE (1UL << PAGE_MAP_LEVEL_BITS)
+#define PAGE_MAP_LEVEL_MASK (PAGE_MAP_LEVEL_SIZE - 1)
+// Addresses above this limit are never owned by the allocator
+#define PAGE_MAP_ADDRESS_BITS 48
+
+#define PAGE_KIND_NONE 0
+#define PAGE_KIND_HEAP 1
+#define PAGE_KIND_MMAP 2
+#define PAGE_KIND_SPAN 3
+#define PAGE_KIND_GUARDED 4
+#define PAGE_KIND_MASK 7UL
+
+typedef uintptr_t PageMapEntry;
+
+typedef struct PageMapLeaf {
+    PageMapEntry entries[PAGE_MAP_LEVEL_SIZE];
+} PageMapLeaf;
+
+typedef struct PageMapMid {
+    PageMapLeaf *leaves[PAGE_MAP_LEVEL_SIZE];
+} PageMapMid;
+
+static PageMapMid *page_map_root[PAGE_MAP_LEVEL_SIZE];
+
+static inline int page_map_kind(PageMapEntry entry) {
+    return (int)(entry & PAGE_KIND_MASK);
+}
+
+static inline void* page_map_meta(PageMapEntry entry) {
+    return (void*)(entry & ~PAGE_KIND_MASK);
+}
+
+static inline PageMapEntry page_map_entry(void *meta, int kind) {
+    return (uintptr_t)meta | (uintptr_t)kind;
+}
+
+// Get the entry of the page that contains addr
+static inline PageMapEntry page_map_get(const void *addr) {
+    uintptr_t page = (uintptr_t)addr >> PAGE_MAP_SHIFT;
+    if (page >> (PAGE_MAP_ADDRESS_BITS - PAGE_MAP_SHIFT)) return 0;
+
+    PageMapMid *mid = __atomic_load_n(&page_map_root[page >> (2 * PAGE_MAP_LEVEL_BITS)], __ATOMIC_ACQUIRE);
+    if (mid == NULL) return 0;
+
+    PageMapLeaf *leaf = __atomic_load_n(&mid->leaves[(page >> PAGE_MAP_LEVEL_BITS) & PAGE_MAP_LEVEL_MASK], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) return 0;
+
+    return __atomic_load_n(&leaf->entries[page & PAGE_MAP_LEVEL_MASK], __ATOMIC_RELAXED);
+}
+
+// Get the node stored in *slot, creating it if it doesn't exist yet.
+// Two threads can create the same node at the same time: only the first
+// one is installed, the other one is released.
+static void* page_map_node(void **slot, size_t node_size) {
+    void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (node != NULL) return node;
+
+    // Nodes are mapped directly, they must not depend on the heap they describe
+    void *mem = mmap(NULL, node_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+
+    void *expected = NULL;
+    if (!__atomic_compare_exchange_n(slot, &expected, mem, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(mem, node_size);
+        return expected;
+    }
+    return mem;
+}
+
+// Set the entry of every page that overlaps [start, start + length).
+// Returns false if a node of the tree couldn't be allocated.
+static bool page_map_set_range(const void *start, size_t length, PageMapEntry entry) {
+    if (length == 0) return true;
+
+    uintptr_t first = (uintptr_t)start >> PAGE_MAP_SHIFT;
+    uintptr_t last = ((uintptr_t)start + length - 1) >> PAGE_MAP_SHIFT;
+
+    for (uintptr_t page = first; page <= last; page++) {
+        if (page >> (PAGE_MAP_ADDRESS_BITS - PAGE_MAP_SHIFT)) return false;
+
+        PageMapMid *mid = page_map_node((void**)&page_map_root[page >> (2 * PAGE_MAP_LEVEL_BITS)],
+                                        sizeof(PageMapMid));
+        if (mid == NULL) return false;
+
+        PageMapLeaf *leaf = page_map_node((void**)&mid->leaves[(page >> PAGE_MAP_LEVEL_BITS) & PAGE_MAP_LEVEL_MASK],
+                                          sizeof(PageMapLeaf));
+        if (leaf == NULL) return false;
+
+        __atomic_store_n(&leaf->entries[page & PAGE_MAP_LEVEL_MASK], entry, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+static inline void page_map_clear_range(const void *start, size_t length) {
+    page_map_set_range(start, length, 0);
+}
+
+#endif
@@ -0,0 +1,504 @@
+#ifndef PERSISTENT_HEAP_H
+#define PERSISTENT_HEAP_H
+
+#include "data_structure.h"
+#include "utils.h"
+#include "algorithms.h"
+#include "heap_allocator_api.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+    ------- PERSISTENT HEAP BACKED BY A FILE ----------
+
+    A persistent heap is a separate heap whose memory is a file mapped with
+    mmap(MAP_SHARED): everything allocated in it is written to the file by the
+    kernel, and when the program starts again and opens the same file, the data
+    is already there. There is no serialization and no loading, the file is just
+    mapped again (the pages are read lazily, when they are touched).
+
+    For this to work, the state of the allocator must live inside the mapping too,
+    and it can't contain raw pointers: the file may be mapped at a different
+    address the next time. So:
+        - The first bytes of the file are a PHeapHeader, which contains what for
+        the normal heap are global variables: the top of the heap, the heads of the
+        segregated lists, plus a root offset that the user sets to find their data
+        after a restart.
+        - Blocks have the same layout as the normal ones (header with the size and
+        the used flag, footer), but the tags are plain, without the checksum of the
+        process, and the links of the free lists are offsets from the start of the
+        mapping instead of pointers (PBlock). Offset 0 is the PHeapHeader itself,
+        so it's used as NULL.
+        - The file may be written by other processes (or damaged): pheap_free
+        checks the tags of the block and of the neighbours it merges, and on a
+        mismatch reports the corruption and leaves the block allocated.
+        - The user must also link its own structures with offsets, see
+        pheap_to_offset() and pheap_from_offset().
+
+                offset 0             PHEAP_DATA_OFFSET                  top           size
+                |--------------------|-----------------------------------|-------------|
+                |    PHeapHeader     |  blocks (header/payload/footer)   |   unused    |
+                |--------------------|-----------------------------------|-------------|
+
+    The file can be mapped at a fixed base (the address is requested with
+    MAP_FIXED_NOREPLACE), so that the user pointers stay valid; if that address
+    is not available, the heap is mapped somewhere else and works the same way
+    through offsets. The size is chosen when the file is created and doesn't change.
+
+    Allocation and free use the same algorithms as the normal heap (first-fit on
+    the segregated lists, split, coalesce through the footers, growth of top),
+    protected by a single lock stored in the header. Only one process at a time
+    can open the file (it's locked with flock), so the lock is initialized again
+    every time the heap is opened.
+
+    If the process is killed in the middle of an operation, the free lists in the
+    file can be left half updated. The blocks themselves are always walkable: a
+    header is rewritten only after the headers of the blocks it's split into, and
+    top is moved only after the new block is written. The header has a clean flag
+    that is cleared when the heap is opened and set again by pheap_close, so when
+    a heap that was not closed is opened, pheap_recover() walks the blocks and
+    rebuilds the lists from them.
+*/
+
+#define PHEAP_MAGIC 0x5048454150484541ULL   // "PHEAPHEA"
+#define PHEAP_VERSION 1
+// Blocks start after the header, aligned to a cache line
+#define PHEAP_DATA_OFFSET ((sizeof(PHeapHeader) + 63) & ~(size_t)63)
+
+typedef struct PBlock {
+    size_t header;
+
+    union {
+        struct {
+            pheap_off_t next_free;
+            pheap_off_t prev_free;
+        };
+        unsigned char payload[0];
+    };
+} PBlock;
+
+typedef struct PHeapHeader {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t size;                      // Size of the whole mapping
+    pheap_off_t top;                    // Offset of the first byte never allocated
+    pheap_off_t root;                   // Offset of the user data to find after a restart
+    pheap_off_t lists[NUM_LISTS];       // Heads of the segregated lists
+    uint64_t clean;                     // The heap was closed properly
+    uint64_t recoveries;                // Times the lists were rebuilt after a crash
+    pthread_mutex_t lock;
+} PHeapHeader;
+
+// ---------------- Offsets ---------------------
+
+// pheap_from_offset() and pheap_to_offset() are in heap_allocator_api.h, with PHeap
+
+static inline PBlock* pheap_block(PHeap *heap, pheap_off_t offset) {
+    return (PBlock*)pheap_from_offset(heap, offset);
+}
+
+// The tags are plain (size | used flag), without the checksum of the headers of
+// Block: that one depends on the key of the process and on the address of the
+// block, which are different every time the heap is mapped.
+// The footer is a copy of the header.
+static inline size_t pblock_size(PBlock *b) { return b->header & SIZE_MASK; }
+static inline bool pblock_used(PBlock *b) { return b->header & 1; }
+
+static inline Footer* pblock_footer(PBlock *b, size_t size) {
+    return (Footer*)((unsigned char*)b + size - sizeof(Footer));
+}
+
+static inline void pblock_setup(PBlock *b, size_t size, bool used) {
+    b->header = size | (used ? 1 : 0);
+    *pblock_footer(b, size) = b->header;
+}
+
+// ---------------- Free lists ---------------------
+// Note: the lock of the heap must be held
+
+static void pheap_remove_free(PHeap *heap, PBlock *block) {
+    if (block->prev_free) {
+        pheap_block(heap, block->prev_free)->next_free = block->next_free;
+    } else {
+        heap->base->lists[get_list_index(pblock_size(block))] = block->next_free;
+    }
+
+    if (block->next_free) {
+        pheap_block(heap, block->next_free)->prev_free = block->prev_free;
+    }
+
+    block->next_free = 0;
+    block->prev_free = 0;
+}
+
+static void pheap_insert_free(PHeap *heap, PBlock *block) {
+    pheap_off_t *head = &heap->base->lists[get_list_index(pblock_size(block))];
+
+    block->next_free = *head;
+    block->prev_free = 0;
+    if (*head) pheap_block(heap, *head)->prev_free = pheap_to_offset(heap, block);
+    *head = pheap_to_offset(heap, block);
+}
+
+// ---------------- Recovery ---------------------
+// Note: the lock of the heap must be held
+
+// Rebuild the free lists walking the blocks: adjacent free blocks are merged and
+// every footer is written again from its header. A block with an invalid header
+// ends the heap there.
+static void pheap_recover(PHeap *heap) {
+    PHeapHeader *h = heap->base;
+    memset(h->lists, 0, sizeof(h->lists));
+
+    pheap_off_t off = PHEAP_DATA_OFFSET;
+    PBlock *free_run = NULL;
+    while (off < h->top) {
+        PBlock *block = pheap_block(heap, off);
+        size_t size = pblock_size(block);
+        if (size < sizeof(PBlock) + sizeof(Footer) || off + size > h->top) {
+            h->top = off;
+            break;
+        }
+
+        if (pblock_used(block)) {
+            pblock_setup(block, size, true);
+            free_run = NULL;
+        } else if (free_run != NULL) {
+            pheap_remove_free(heap, free_run);
+            pblock_setup(free_run, pblock_size(free_run) + size, false);
+            pheap_insert_free(heap, free_run);
+        } else {
+            pblock_setup(block, size, false);
+            pheap_insert_free(heap, block);
+            free_run = block;
+        }
+        off += size;
+    }
+
+    h->recoveries++;
+}
+
+// ---------------- Locking ---------------------
+
+// Returns 0 with the lock held, or the error of the lock (the lock isn't held)
+static inline int pheap_lock(PHeap *heap) {
+    int err = pthread_mutex_lock(&heap->base->lock);
+
+    // The lock of a shared heap is robust: if its owner died while holding it,
+    // the heap may be half updated, so it's repaired before going on
+    if (err == EOWNERDEAD) {
+        pheap_recover(heap);
+        err = pthread_mutex_consistent(&heap->base->lock);
+        if (err != 0) pthread_mutex_unlock(&heap->base->lock);
+    }
+    // ENOTRECOVERABLE: a previous owner died and the heap was never repaired
+    // (the lock can't be used anymore), or another error of the lock
+    if (err != 0) {
+        fprintf(stderr, "pheap: lock of the heap %p failed: %s\n", (void*)heap->base, strerror(err));
+    }
+    return err;
+}
+
+static inline void pheap_unlock(PHeap *heap) {
+    pthread_mutex_unlock(&heap->base->lock);
+}
+
+// Tells whether the blocks are walkable from the start of the data to top,
+// and whether every free block is in the right list (and nothing else is)
+static bool pheap_check_locked(PHeap *heap) {
+    PHeapHeader *h = heap->base;
+    size_t free_blocks = 0;
+
+    for (pheap_off_t off = PHEAP_DATA_OFFSET; off < h->top; off += pblock_size(pheap_block(heap, off))) {
+        size_t size = pblock_size(pheap_block(heap, off));
+        if (size < sizeof(PBlock) + sizeof(Footer) || off + size > h->top) return false;
+        if (!pblock_used(pheap_block(heap, off))) free_blocks++;
+    }
+
+    size_t listed = 0;
+    for (int i = 0; i < NUM_LISTS; i++) {
+        pheap_off_t prev = 0;
+        for (pheap_off_t off = h->lists[i]; off != 0; off = pheap_block(heap, off)->next_free) {
+            PBlock *b = pheap_block(heap, off);
+            if (off < PHEAP_DATA_OFFSET || off >= h->top || pblock_used(b) ||
+                get_list_index(pblock_size(b)) != i || b->prev_free != prev) {
+                return false;
+            }
+            // More links than free blocks: the list has a cycle
+            if (++listed > free_blocks) return false;
+            prev = off;
+        }
+    }
+    return listed == free_blocks;
+}
+
+bool pheap_check(PHeap *heap) {
+    if (pheap_lock(heap) != 0) return false;
+    bool ok = pheap_check_locked(heap);
+    pheap_unlock(heap);
+    return ok;
+}
+
+// A lock in shared memory must be process-shared, and robust so that a process
+// that dies while holding it doesn't block the others forever
+static void pheap_init_lock(PHeap *heap) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (heap->shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    }
+    pthread_mutex_init(&heap->base->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// ---------------- Open and close ---------------------
+
+// Write an empty heap in a new mapping
+static void pheap_format(PHeap *heap) {
+    PHeapHeader *h = heap->base;
+    memset(h, 0, sizeof(PHeapHeader));
+    h->version = PHEAP_VERSION;
+    h->size = heap->size;
+    h->top = PHEAP_DATA_OFFSET;
+    pheap_init_lock(heap);
+    // The magic number is written last: a header with the magic is complete
+    __atomic_store_n(&h->magic, PHEAP_MAGIC, __ATOMIC_RELEASE);
+}
+
+// Tells whether the mapping contains a valid heap of the given size
+static bool pheap_valid(PHeap *heap) {
+    PHeapHeader *h = heap->base;
+    return h->magic == PHEAP_MAGIC && h->version == PHEAP_VERSION && h->size == heap->size &&
+           h->top >= PHEAP_DATA_OFFSET && h->top <= h->size;
+}
+
+// Map the file descriptor, at base if possible
+static bool pheap_map(PHeap *heap, int fd, size_t size, void *base) {
+    void *mem = MAP_FAILED;
+#ifdef MAP_FIXED_NOREPLACE
+    if (base != NULL) {
+        mem = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    }
+#endif
+    // The fixed base is not available: the heap is relocated
+    if (mem == MAP_FAILED) {
+        mem = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mem == MAP_FAILED) return false;
+
+    heap->base = (PHeapHeader*)mem;
+    heap->size = size;
+    heap->fd = fd;
+    return true;
+}
+
+// Open the persistent heap stored in path, creating it with the given size if the
+// file doesn't exist (or is empty). base is the preferred address, NULL for any.
+// Returns false if the file can't be opened or mapped, if it's already open in
+// another process, or if it doesn't contain a valid heap.
+bool pheap_open(PHeap *heap, const char *path, size_t size, void *base) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return false;
+
+    // Only one process at a time can use the heap
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    bool created = (st.st_size == 0);
+    if (created) {
+        size = (size + (size_t)get_page_size() - 1) & ~((size_t)get_page_size() - 1);
+        if (size <= PHEAP_DATA_OFFSET || ftruncate(fd, (off_t)size) != 0) {
+            close(fd);
+            return false;
+        }
+    } else {
+        size = (size_t)st.st_size;
+    }
+
+    heap->shared = false;
+    if (!pheap_map(heap, fd, size, base)) {
+        close(fd);
+        return false;
+    }
+
+    if (created) {
+        pheap_format(heap);
+    } else if (!pheap_valid(heap)) {
+        munmap(heap->base, size);
+        close(fd);
+        return false;
+    } else {
+        pheap_init_lock(heap);
+        // The last process that used the heap didn't close it
+        if (!heap->base->clean) pheap_recover(heap);
+    }
+
+    heap->base->clean = 0;
+    return true;
+}
+
+// Write the heap to the file
+void pheap_sync(PHeap *heap) {
+    msync(heap->base, heap->size, MS_SYNC);
+}
+
+void pheap_close(PHeap *heap) {
+    // If the lock is unusable the heap is left marked as dirty
+    if (pheap_lock(heap) == 0) {
+        heap->base->clean = 1;
+        pheap_unlock(heap);
+    }
+
+    pheap_sync(heap);
+    munmap(heap->base, heap->size);
+    close(heap->fd);     // It also releases the flock
+    heap->base = NULL;
+}
+
+// ---------------- Root ---------------------
+
+void* pheap_root(PHeap *heap) {
+    return pheap_from_offset(heap, __atomic_load_n(&heap->base->root, __ATOMIC_ACQUIRE));
+}
+
+void pheap_set_root(PHeap *heap, void *ptr) {
+    __atomic_store_n(&heap->base->root, pheap_to_offset(heap, ptr), __ATOMIC_RELEASE);
+}
+
+// ---------------- Allocation and free ---------------------
+
+void* pheap_malloc(PHeap *heap, size_t size) {
+    if (size == 0) return NULL;
+
+    size_t total_size = sizeof(size_t) + align(size) + sizeof(Footer);
+    size_t min_block_size = sizeof(PBlock) + sizeof(Footer);
+    if (total_size < min_block_size) total_size = min_block_size;
+
+    if (pheap_lock(heap) != 0) return NULL;
+    PHeapHeader *h = heap->base;
+    PBlock *block = NULL;
+
+    // First-fit on the segregated lists
+    for (int i = get_list_index(total_size); i < NUM_LISTS && block == NULL; i++) {
+        for (pheap_off_t off = h->lists[i]; off != 0; off = pheap_block(heap, off)->next_free) {
+            if (pblock_size(pheap_block(heap, off)) >= total_size) {
+                block = pheap_block(heap, off);
+                break;
+            }
+        }
+    }
+
+    if (block != NULL) {
+        pheap_remove_free(heap, block);
+        size_t current_size = pblock_size(block);
+
+        // Split
+        if (current_size >= total_size + min_block_size) {
+            PBlock *rest = (PBlock*)((unsigned char*)block + total_size);
+            pblock_setup(rest, current_size - total_size, false);
+            pheap_insert_free(heap, rest);
+            current_size = total_size;
+        }
+        pblock_setup(block, current_size, true);
+    } else if (h->top + total_size <= h->size) {
+        // New block on top of the heap
+        block = pheap_block(heap, h->top);
+        pblock_setup(block, total_size, true);
+        h->top += total_size;
+    }
+
+    pheap_unlock(heap);
+    return block ? (void*)block->payload : NULL;
+}
+
+void pheap_free(PHeap *heap, void *ptr) {
+    if (ptr == NULL) return;
+
+    // The block stays allocated: the heap can't be changed without its lock
+    if (pheap_lock(heap) != 0) return;
+    PHeapHeader *h = heap->base;
+
+    size_t min_block_size = sizeof(PBlock) + sizeof(Footer);
+    pheap_off_t off = pheap_to_offset(heap, ptr) - offsetof(PBlock, payload);
+    if (((uintptr_t)ptr & (sizeof(word_t) - 1)) || (off & (sizeof(word_t) - 1)) ||
+        off < PHEAP_DATA_OFFSET || off >= h->top || !pblock_used(pheap_block(heap, off))) {
+        pheap_unlock(heap);
+        fprintf(stderr, "pheap_free(): invalid pointer %p\n", ptr);
+        return;
+    }
+
+    PBlock *block = pheap_block(heap, off);
+    size_t size = pblock_size(block);
+    if (size < min_block_size || off + size > h->top || *pblock_footer(block, size) != block->header) {
+        pheap_unlock(heap);
+        fprintf(stderr, "pheap_free(): corrupted block %p\n", ptr);
+        return;
+    }
+
+    // The previous block, if it's free, is found through its footer: it's validated
+    // before anything is changed, so a corrupted footer leaves the block allocated
+    PBlock *prev = NULL;
+    size_t prev_size = 0;
+    if (off > PHEAP_DATA_OFFSET) {
+        Footer prev_footer = *(Footer*)((unsigned char*)block - sizeof(Footer));
+        if (!(prev_footer & 1)) {
+            prev_size = prev_footer & SIZE_MASK;
+            if (prev_size < min_block_size || prev_size > off - PHEAP_DATA_OFFSET ||
+                (prev_size & (sizeof(word_t) - 1)) ||
+                pheap_block(heap, off - prev_size)->header != prev_footer) {
+                pheap_unlock(heap);
+                fprintf(stderr, "pheap_free(): corrupted block before %p\n", ptr);
+                return;
+            }
+            prev = pheap_block(heap, off - prev_size);
+        }
+    }
+    PBlock *next = NULL;
+    if (off + size < h->top && !pblock_used(pheap_block(heap, off + size))) {
+        next = pheap_block(heap, off + size);
+        size_t next_size = pblock_size(next);
+        if (next_size < min_block_size || next_size > h->top - (off + size) ||
+            *pblock_footer(next, next_size) != next->header) {
+            pheap_unlock(heap);
+            fprintf(stderr, "pheap_free(): corrupted block after %p\n", ptr);
+            return;
+        }
+    }
+
+    // Coalesce with the next block
+    if (next != NULL) {
+        pheap_remove_free(heap, next);
+        size += pblock_size(next);
+    }
+
+    // Coalesce with the previous block
+    if (prev != NULL) {
+        pheap_remove_free(heap, prev);
+        block = prev;
+        size += prev_size;
+    }
+
+    pblock_setup(block, size, false);
+    pheap_insert_free(heap, block);
+
+    pheap_unlock(heap);
+}
+
+#endif
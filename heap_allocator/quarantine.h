@@ -0,0 +1,159 @@
+#ifndef QUARANTINE_H
+#define QUARANTINE_H
+
+#include "data_structure.h"
+#include "utils.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+    ------- QUARANTINE OF FREED BLOCKS ----------
+
+    A freed block is normally reused right away (the per-cpu cache is LIFO),
+    so a use after free reads or writes the data of the next owner of the
+    block and the bug shows up far from where it happens.
+
+    When the quarantine is enabled (set_quarantine()), my_free doesn't give
+    the blocks of the heap back at once: it appends them to a FIFO and they
+    are really freed only when the FIFO holds more than max_bytes bytes, oldest
+    first. The budget bounds the memory kept out of use, and in the meantime:
+        - The block can't be handed out again, so a use after free touches
+        memory that nobody owns (and, with guarded sampling, more of them fault).
+        - If poisoning is enabled, the payload is filled with QUARANTINE_POISON
+        (except the first word, used for the link of the FIFO). When the block
+        leaves the quarantine the poison is checked: a change means that the
+        block was written after free, and it's reported.
+    Blocks stay marked as used while they are in quarantine, so coalesce never
+    touches them. The FIFO is protected by quarantine_lock, which is never held
+    together with other locks: the evicted blocks are freed after releasing it.
+    Blocks bigger than the budget, mmap blocks, spans and slab objects are
+    freed as usual.
+*/
+
+#define QUARANTINE_POISON 0xFD
+
+static size_t quarantine_max_bytes = 0;
+static bool quarantine_poison = false;
+
+static Block *quarantine_head = NULL;
+static Block *quarantine_tail = NULL;
+static size_t quarantine_bytes = 0;
+// Blocks found written after free
+static size_t quarantine_corruptions = 0;
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline bool quarantine_enabled() {
+    return __atomic_load_n(&quarantine_max_bytes, __ATOMIC_RELAXED) != 0;
+}
+
+// The poisoned part of the payload: everything after the link
+static inline unsigned char* quarantine_poison_start(Block *block) {
+    return block->payload + sizeof(word_t);
+}
+
+static inline size_t quarantine_poison_size(Block *block) {
+    return get_size(block) - sizeof(size_t) - sizeof(Footer) - sizeof(word_t);
+}
+
+// Check the poison of a block that leaves the quarantine
+static void quarantine_check(Block *block) {
+    unsigned char *start = quarantine_poison_start(block);
+    size_t size = quarantine_poison_size(block);
+    for (size_t i = 0; i < size; i++) {
+        if (start[i] != QUARANTINE_POISON) {
+            fprintf(stderr, "my_free(): block %p written after free (offset %zu)\n",
+                    (void*)block->payload, i + sizeof(word_t));
+            __atomic_fetch_add(&quarantine_corruptions, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+}
+
+// Detach the oldest blocks until at most max_bytes are left.
+// Note: quarantine_lock must be held
+static Block* quarantine_evict(size_t max_bytes) {
+    Block *evicted = NULL;
+    Block *last = NULL;
+    while (quarantine_head != NULL && quarantine_bytes > max_bytes) {
+        Block *block = quarantine_head;
+        quarantine_head = get_next_free(block);
+        quarantine_bytes -= get_size(block);
+
+        set_next_free(block, NULL);
+        if (last != NULL) set_next_free(last, block);
+        else evicted = block;
+        last = block;
+    }
+    if (quarantine_head == NULL) quarantine_tail = NULL;
+    return evicted;
+}
+
+// Check the poison of the evicted blocks, after releasing the lock
+static void quarantine_check_chain(Block *chain, bool poisoned) {
+    if (!poisoned) return;
+    for (Block *block = chain; block != NULL; block = get_next_free(block)) {
+        quarantine_check(block);
+    }
+}
+
+// Put a freed block in quarantine. Returns false if the block must be freed as usual.
+// Otherwise *evicted is the chain (linked through next_free) of the blocks that
+// left the quarantine, which the caller must free.
+static bool quarantine_push(Block *block, Block **evicted) {
+    size_t size = get_size(block);
+    size_t max_bytes = __atomic_load_n(&quarantine_max_bytes, __ATOMIC_RELAXED);
+    if (size > max_bytes) return false;
+
+    bool poisoned = __atomic_load_n(&quarantine_poison, __ATOMIC_RELAXED);
+    if (poisoned) {
+        memset(quarantine_poison_start(block), QUARANTINE_POISON, quarantine_poison_size(block));
+    }
+    set_next_free(block, NULL);
+
+    pthread_mutex_lock(&quarantine_lock);
+    // All the blocks in the FIFO are poisoned or not, as the current setting says
+    if (poisoned != quarantine_poison || quarantine_max_bytes == 0) {
+        pthread_mutex_unlock(&quarantine_lock);
+        return false;
+    }
+    if (quarantine_tail != NULL) set_next_free(quarantine_tail, block);
+    else quarantine_head = block;
+    quarantine_tail = block;
+    quarantine_bytes += size;
+    *evicted = quarantine_evict(quarantine_max_bytes);
+    pthread_mutex_unlock(&quarantine_lock);
+
+    quarantine_check_chain(*evicted, poisoned);
+    return true;
+}
+
+// Set the budget of the quarantine (0 disables it) and whether the payloads are
+// poisoned. Returns the chain of the blocks that don't fit in the new budget
+// (all of them if the poisoning changes).
+static Block* quarantine_configure(size_t max_bytes, bool poison) {
+    pthread_mutex_lock(&quarantine_lock);
+    bool was_poisoned = quarantine_poison;
+    __atomic_store_n(&quarantine_max_bytes, max_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&quarantine_poison, poison, __ATOMIC_RELAXED);
+    Block *evicted = quarantine_evict(poison == was_poisoned ? max_bytes : 0);
+    pthread_mutex_unlock(&quarantine_lock);
+
+    quarantine_check_chain(evicted, was_poisoned);
+    return evicted;
+}
+
+// Take all the blocks out of the quarantine, keeping it enabled.
+// Returns their chain, which the caller must free.
+static Block* quarantine_flush() {
+    pthread_mutex_lock(&quarantine_lock);
+    bool poisoned = quarantine_poison;
+    Block *evicted = quarantine_evict(0);
+    pthread_mutex_unlock(&quarantine_lock);
+
+    quarantine_check_chain(evicted, poisoned);
+    return evicted;
+}
+
+#endif
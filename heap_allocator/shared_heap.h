@@ -0,0 +1,131 @@
+#ifndef SHARED_HEAP_H
+#define SHARED_HEAP_H
+
+#include "persistent_heap.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+    ------- SHARED-MEMORY HEAP FOR MANY PROCESSES ----------
+
+    A shared heap is the same heap of persistent_heap.h (header with the state of
+    the allocator, blocks linked with offsets), but its memory is a shared memory
+    object mapped by many processes at the same time. Every process can allocate
+    and free blocks, and objects can be passed from one process to another just by
+    sending their offset (pheap_to_offset() / pheap_from_offset()), without copying
+    them: each process may map the heap at a different address.
+
+    The memory can be:
+        - A POSIX shared memory object (shm_open) with a name: any process can
+          open it with sheap_open and the same name.
+        - An anonymous memfd (name NULL): it's shared with the child processes
+          through fork, or passed as a file descriptor to other processes, that
+          attach to it with sheap_attach_fd.
+
+    The process that creates the object formats the heap; the others wait until
+    the magic number is in the header before using it.
+
+    The lock in the header is a process-shared robust mutex. If a process dies
+    while holding it (in the middle of a pheap_malloc or pheap_free), the next
+    process that takes the lock gets EOWNERDEAD: it runs the recovery check
+    (pheap_recover(), which rebuilds the free lists from the blocks) and marks
+    the lock as consistent again, so the other processes can go on.
+    The blocks that the dead process allocated and didn't free stay allocated.
+    If the lock can't be taken (ENOTRECOVERABLE: a process got EOWNERDEAD
+    and released the lock without repairing the heap) the heap is unusable:
+    pheap_malloc returns NULL, pheap_free and pheap_check report the error.
+*/
+
+// Time waited for the creator of a shared heap to format it
+#define SHEAP_OPEN_TIMEOUT_MS 1000
+
+// Map a shared memory object. If created, the heap is formatted,
+// otherwise we wait until its creator has formatted it.
+static bool sheap_map(PHeap *heap, int fd, size_t size, bool created) {
+    heap->shared = true;
+
+    if (created) {
+        size = (size + (size_t)get_page_size() - 1) & ~((size_t)get_page_size() - 1);
+        if (size <= PHEAP_DATA_OFFSET || ftruncate(fd, (off_t)size) != 0) return false;
+        if (!pheap_map(heap, fd, size, NULL)) return false;
+        pheap_format(heap);
+        return true;
+    }
+
+    // The creator may have not set the size yet
+    struct stat st;
+    int waited = 0;
+    while (fstat(fd, &st) == 0 && st.st_size == 0 && waited < SHEAP_OPEN_TIMEOUT_MS) {
+        usleep(1000);
+        waited++;
+    }
+    if (st.st_size == 0 || !pheap_map(heap, fd, (size_t)st.st_size, NULL)) return false;
+
+    while (__atomic_load_n(&heap->base->magic, __ATOMIC_ACQUIRE) != PHEAP_MAGIC &&
+           waited < SHEAP_OPEN_TIMEOUT_MS) {
+        usleep(1000);
+        waited++;
+    }
+    if (!pheap_valid(heap)) {
+        munmap(heap->base, heap->size);
+        return false;
+    }
+    return true;
+}
+
+// Open the shared heap with the given name (like "/my_heap"), creating it with
+// the given size if it doesn't exist. With name NULL, a new anonymous heap is created.
+bool sheap_open(PHeap *heap, const char *name, size_t size) {
+    int fd;
+    bool created = true;
+
+    if (name == NULL) {
+        // memfd_create is called directly, like the other syscalls in numa.h
+        fd = (int)syscall(SYS_memfd_create, "shared_heap", 0);
+    } else {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            fd = shm_open(name, O_RDWR, 0600);
+            created = false;
+        }
+    }
+    if (fd < 0) return false;
+
+    if (!sheap_map(heap, fd, size, created)) {
+        close(fd);
+        if (created && name != NULL) shm_unlink(name);
+        return false;
+    }
+    return true;
+}
+
+// Attach to a shared heap received as a file descriptor (the fd is duplicated)
+bool sheap_attach_fd(PHeap *heap, int fd) {
+    int own_fd = dup(fd);
+    if (own_fd < 0) return false;
+
+    if (!sheap_map(heap, own_fd, 0, false)) {
+        close(own_fd);
+        return false;
+    }
+    return true;
+}
+
+// Unmap the heap in this process. The memory is released when the last process
+// closes it (and, for a named heap, after sheap_unlink).
+void sheap_close(PHeap *heap) {
+    munmap(heap->base, heap->size);
+    close(heap->fd);
+    heap->base = NULL;
+}
+
+void sheap_unlink(const char *name) {
+    shm_unlink(name);
+}
+
+#endif
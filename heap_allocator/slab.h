@@ -0,0 +1,281 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "data_structure.h"
+#include "page_heap.h"
+#include "page_map.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+/*
+    ------- OUT-OF-LINE METADATA MODE (SLABS) ----------
+
+    Blocks of the heap keep their header and footer next to the payload. This
+    has two costs for small objects:
+        - A buffer overrun of the user writes on the header of the next block
+        (or on the links of a free block), and corrupts the allocator.
+        - Every malloc and free writes on the cache lines next to the user data,
+        which may be in use by another thread (false sharing between threads
+        working on neighboring blocks).
+
+    When the out-of-line metadata mode is enabled (set_out_of_line_metadata()),
+    small requests up to SLAB_MAX_SIZE are served by slabs instead:
+        - A slab is a span of SLAB_PAGES pages taken from the page heap, cut into
+        objects of the same size class. The objects have no header and no footer:
+        the payloads are contiguous and densely packed.
+        - The state of the slab lives in a separate Slab struct: the size class,
+        the number of used objects and a bitmap with a bit for every object
+        (1 = free). The span of the slab points to it, so my_free finds it through
+        the page map, like any span.
+        - Each size class has a lock and a list of the slabs that have free objects.
+        A slab that becomes empty is given back to the page heap, unless it's the
+        only slab of its class.
+
+    The mode only changes where new small blocks are taken from: my_free
+    recognizes both kinds of blocks through the page map, so it can be switched
+    at any moment.
+*/
+
+#define SLAB_PAGES 4
+#define SLAB_SIZE (SLAB_PAGES * SPAN_PAGE_SIZE)
+#define SLAB_MAX_SIZE 512
+#define SLAB_NUM_CLASSES 16
+// Objects of the smallest class in a slab, one bit each
+#define SLAB_MAX_OBJECTS (SLAB_SIZE / 16)
+#define SLAB_BITMAP_WORDS (SLAB_MAX_OBJECTS / 64)
+// Bytes mapped at once for the Slab structs
+#define SLAB_META_CHUNK (64 * 1024)
+
+// Sizes of the classes, multiples of 16 so every object is 16-byte aligned
+static const unsigned short slab_class_sizes[SLAB_NUM_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512
+};
+
+typedef struct Slab {
+    Span *span;
+    uint64_t free_bits[SLAB_BITMAP_WORDS];
+    unsigned short capacity;
+    unsigned short used;
+    unsigned char size_class;
+    struct Slab *next;          // Links of the list of the slabs with free objects
+    struct Slab *prev;
+} Slab;
+
+typedef struct SlabClass {
+    pthread_mutex_t lock;
+    Slab *partial;
+} CACHE_ALIGNED SlabClass;
+
+static bool out_of_line_metadata = false;
+
+static SlabClass slab_classes[SLAB_NUM_CLASSES] = {
+    [0 ... SLAB_NUM_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+// Pool of Slab structs
+static Slab *slab_meta_free_list = NULL;
+static unsigned char *slab_meta_top = NULL;
+static unsigned char *slab_meta_end = NULL;
+static pthread_mutex_t slab_meta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Enable or disable the out-of-line metadata mode for the next allocations
+void set_out_of_line_metadata(bool enabled) {
+    __atomic_store_n(&out_of_line_metadata, enabled, __ATOMIC_RELAXED);
+}
+
+static inline bool slab_mode_enabled() {
+    return __atomic_load_n(&out_of_line_metadata, __ATOMIC_RELAXED);
+}
+
+static inline int slab_class_index(size_t size) {
+    for (int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        if (size <= slab_class_sizes[i]) return i;
+    }
+    return -1;
+}
+
+// ---------------- Slab metadata ---------------------
+
+static Slab* slab_meta_alloc() {
+    pthread_mutex_lock(&slab_meta_lock);
+
+    Slab *slab = slab_meta_free_list;
+    if (slab != NULL) {
+        slab_meta_free_list = slab->next;
+    } else {
+        if (slab_meta_top == NULL || slab_meta_top + sizeof(Slab) > slab_meta_end) {
+            void *mem = mmap(NULL, SLAB_META_CHUNK, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) {
+                pthread_mutex_unlock(&slab_meta_lock);
+                return NULL;
+            }
+            slab_meta_top = (unsigned char*)mem;
+            slab_meta_end = slab_meta_top + SLAB_META_CHUNK;
+        }
+        slab = (Slab*)slab_meta_top;
+        slab_meta_top += sizeof(Slab);
+    }
+
+    pthread_mutex_unlock(&slab_meta_lock);
+    return slab;
+}
+
+static void slab_meta_free(Slab *slab) {
+    pthread_mutex_lock(&slab_meta_lock);
+    slab->next = slab_meta_free_list;
+    slab_meta_free_list = slab;
+    pthread_mutex_unlock(&slab_meta_lock);
+}
+
+// ---------------- Partial lists ---------------------
+// Note: the lock of the size class must be held
+
+static void slab_push_partial(SlabClass *sc, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = sc->partial;
+    if (sc->partial != NULL) sc->partial->prev = slab;
+    sc->partial = slab;
+}
+
+static void slab_remove_partial(SlabClass *sc, Slab *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else sc->partial = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+// Take a span from the page heap and turn it into a slab of the given class
+static Slab* slab_create(int class_idx) {
+    Slab *slab = slab_meta_alloc();
+    if (slab == NULL) return NULL;
+
+    void *mem = span_allocation(SLAB_SIZE);
+    if (mem == NULL) {
+        slab_meta_free(slab);
+        return NULL;
+    }
+
+    Span *span = (Span*)page_map_meta(page_map_get(mem));
+    size_t size = slab_class_sizes[class_idx];
+
+    slab->span = span;
+    slab->size_class = (unsigned char)class_idx;
+    slab->capacity = (unsigned short)(SLAB_SIZE / size);
+    slab->used = 0;
+    slab->next = NULL;
+    slab->prev = NULL;
+
+    // Set the bits of the existing objects only
+    for (size_t w = 0; w < SLAB_BITMAP_WORDS; w++) {
+        size_t first = w * 64;
+        if (first >= slab->capacity) slab->free_bits[w] = 0;
+        else if (slab->capacity - first >= 64) slab->free_bits[w] = ~0ULL;
+        else slab->free_bits[w] = (1ULL << (slab->capacity - first)) - 1;
+    }
+
+    span->owner = slab;
+    // The span is published as a slab last: my_free reads the state without locks
+    __atomic_store_n(&span->state, SPAN_SLAB, __ATOMIC_RELEASE);
+    return slab;
+}
+
+// Give an empty slab back to the page heap
+static void slab_destroy(Slab *slab) {
+    Span *span = slab->span;
+    span->owner = NULL;
+    __atomic_store_n(&span->state, SPAN_IN_USE, __ATOMIC_RELEASE);
+    span_free(span);
+    slab_meta_free(slab);
+}
+
+// ---------------- Allocation and free ---------------------
+
+static void* slab_allocation(size_t size) {
+    int class_idx = slab_class_index(size);
+    SlabClass *sc = &slab_classes[class_idx];
+
+    pthread_mutex_lock(&sc->lock);
+
+    Slab *slab = sc->partial;
+    if (slab == NULL) {
+        slab = slab_create(class_idx);
+        if (slab == NULL) {
+            pthread_mutex_unlock(&sc->lock);
+            return NULL;
+        }
+        slab_push_partial(sc, slab);
+    }
+
+    // First free object of the bitmap
+    int w = 0;
+    while (slab->free_bits[w] == 0) w++;
+    int bit = __builtin_ctzll(slab->free_bits[w]);
+    slab->free_bits[w] &= ~(1ULL << bit);
+
+    if (++slab->used == slab->capacity) {
+        slab_remove_partial(sc, slab);
+    }
+
+    pthread_mutex_unlock(&sc->lock);
+
+    return (void*)(slab->span->start + (size_t)(w * 64 + bit) * slab_class_sizes[class_idx]);
+}
+
+// Free an object of a slab. Returns false if ptr is not an allocated object.
+static bool slab_free(Span *span, void *ptr) {
+    Slab *slab = (Slab*)span->owner;
+    size_t size = slab_class_sizes[slab->size_class];
+    size_t offset = (uintptr_t)ptr - span->start;
+    size_t idx = offset / size;
+
+    if (offset % size != 0 || idx >= slab->capacity) return false;
+
+    SlabClass *sc = &slab_classes[slab->size_class];
+    pthread_mutex_lock(&sc->lock);
+
+    uint64_t mask = 1ULL << (idx % 64);
+    // The object is already free: double free
+    if (slab->free_bits[idx / 64] & mask) {
+        pthread_mutex_unlock(&sc->lock);
+        return false;
+    }
+    slab->free_bits[idx / 64] |= mask;
+
+    if (slab->used-- == slab->capacity) {
+        slab_push_partial(sc, slab);
+    }
+
+    // An empty slab is kept only if it's the last one of the class
+    bool destroy = (slab->used == 0 && (sc->partial != slab || slab->next != NULL));
+    if (destroy) slab_remove_partial(sc, slab);
+
+    pthread_mutex_unlock(&sc->lock);
+
+    if (destroy) slab_destroy(slab);
+    return true;
+}
+
+// Tells whether ptr is the start of an allocated object of the slab
+static bool slab_object_valid(Span *span, const void *ptr) {
+    Slab *slab = (Slab*)span->owner;
+    size_t size = slab_class_sizes[slab->size_class];
+    size_t offset = (uintptr_t)ptr - span->start;
+    size_t idx = offset / size;
+    if (offset % size != 0 || idx >= slab->capacity) return false;
+    return !(__atomic_load_n(&slab->free_bits[idx / 64], __ATOMIC_RELAXED) & (1ULL << (idx % 64)));
+}
+
+// Tells whether ptr points inside an allocated object of the slab
+static bool slab_owns(Span *span, const void *ptr) {
+    Slab *slab = (Slab*)span->owner;
+    size_t idx = ((uintptr_t)ptr - span->start) / slab_class_sizes[slab->size_class];
+    if (idx >= slab->capacity) return false;
+    return !(__atomic_load_n(&slab->free_bits[idx / 64], __ATOMIC_RELAXED) & (1ULL << (idx % 64)));
+}
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "data_structure.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+    ------- ALLOCATION STATISTICS ----------
+
+    When statistics are enabled (set_stats(), or the stats option of
+    MY_MALLOC_CONF), my_malloc and my_free count the allocations by size class,
+    using the usable size of the block (the bytes the user can write, see
+    my_usable_size()):
+        - Class i holds the blocks of up to 2^(i+3) bytes, so class 0 holds the
+        blocks up to 8 bytes, class 1 up to 16 bytes and so on. The last class
+        holds all the bigger blocks.
+        - Every class counts its allocations (nmalloc), its frees (nfree) and the
+        bytes allocated at the moment. Each class is on its own cache line.
+        - The bytes allocated in total and their peak are kept too. The peak can
+        be reset, to measure the peak of a phase of the program.
+    The counters are atomic, so with many threads they cost a contended atomic
+    operation per call: statistics are disabled by default, and when they are
+    disabled my_malloc and my_free only pay the check of a flag.
+*/
+
+#define STATS_NUM_CLASSES 24
+
+typedef struct SizeClassStats {
+    size_t nmalloc;
+    size_t nfree;
+    size_t bytes;               // Allocated now
+} CACHE_ALIGNED SizeClassStats;
+
+typedef struct AllocStats {
+    size_t allocated;           // Bytes allocated now, in all the classes
+    size_t peak;                // Highest value of allocated since the last reset
+} CACHE_ALIGNED AllocStats;
+
+static bool stats_on = false;
+static SizeClassStats size_class_stats[STATS_NUM_CLASSES];
+static AllocStats alloc_stats;
+
+// Enable or disable the statistics. The counters are kept when they are disabled.
+void set_stats(bool enabled) {
+    __atomic_store_n(&stats_on, enabled, __ATOMIC_RELAXED);
+}
+
+static inline bool stats_enabled() {
+    return __atomic_load_n(&stats_on, __ATOMIC_RELAXED);
+}
+
+static inline int stats_class(size_t size) {
+    if (size <= 8) return 0;
+    int cls = 61 - __builtin_clzl(size - 1);
+    return (cls < STATS_NUM_CLASSES) ? cls : STATS_NUM_CLASSES - 1;
+}
+
+// Largest size of the blocks of a class (0 for the last one, which has no limit)
+static inline size_t stats_class_size(int cls) {
+    return (cls < STATS_NUM_CLASSES - 1) ? (size_t)8 << cls : 0;
+}
+
+static void stats_count_malloc(size_t size) {
+    SizeClassStats *cls = &size_class_stats[stats_class(size)];
+    __atomic_fetch_add(&cls->nmalloc, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&cls->bytes, size, __ATOMIC_RELAXED);
+
+    size_t allocated = __atomic_add_fetch(&alloc_stats.allocated, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&alloc_stats.peak, __ATOMIC_RELAXED);
+    while (allocated > peak &&
+           !__atomic_compare_exchange_n(&alloc_stats.peak, &peak, allocated, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void stats_count_free(size_t size) {
+    SizeClassStats *cls = &size_class_stats[stats_class(size)];
+    __atomic_fetch_add(&cls->nfree, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&cls->bytes, size, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&alloc_stats.allocated, size, __ATOMIC_RELAXED);
+}
+
+// Start measuring the peak again from the bytes allocated now
+static void stats_reset_peak() {
+    __atomic_store_n(&alloc_stats.peak, __atomic_load_n(&alloc_stats.allocated, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+// Print the counters of the classes that were used
+void my_malloc_stats_print(FILE *out) {
+    fprintf(out, "==STATS== allocated: %zu bytes, peak: %zu bytes\n",
+            __atomic_load_n(&alloc_stats.allocated, __ATOMIC_RELAXED),
+            __atomic_load_n(&alloc_stats.peak, __ATOMIC_RELAXED));
+    fprintf(out, "==STATS== %5s %12s %12s %12s %14s\n", "class", "size", "nmalloc", "nfree", "bytes");
+    for (int i = 0; i < STATS_NUM_CLASSES; i++) {
+        SizeClassStats *cls = &size_class_stats[i];
+        size_t nmalloc = __atomic_load_n(&cls->nmalloc, __ATOMIC_RELAXED);
+        if (nmalloc == 0) continue;
+        char size[24];
+        if (stats_class_size(i) != 0) snprintf(size, sizeof(size), "<= %zu", stats_class_size(i));
+        else snprintf(size, sizeof(size), "> %zu", stats_class_size(i - 1));
+        fprintf(out, "==STATS== %5d %12s %12zu %12zu %14zu\n", i, size, nmalloc,
+                __atomic_load_n(&cls->nfree, __ATOMIC_RELAXED),
+                __atomic_load_n(&cls->bytes, __ATOMIC_RELAXED));
+    }
+    fflush(out);
+}
+
+#endif
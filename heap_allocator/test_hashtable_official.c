@@ -1,7 +1,7 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include "heap_allocator.h"
+#include "heap_allocator_api.h"
 #include <string.h>
 
 //Test script took from: https://github.com/engineer-man/youtube/tree/master/077
@@ -207,7 +207,7 @@ void ht_dump(ht_t *hashtable) {
     }
 }
 
-int main(int argc, char **argv) {
+int main(void) {
     ht_t *ht = ht_create();
 
     ht_set(ht, "name1", "em");
@@ -6,6 +6,10 @@
 #include <stddef.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/auxv.h>
+#include <sys/random.h>
+#include <time.h>
 
 /*
     ------ UTILITY FUNCTIONS USED IN THE PROGRAM -------- 
@@ -15,20 +19,137 @@
     - Block manipulation (all of them performed by bitmask operations)
     - Footer related
     - Gap check utilities
+    - Locking
 */
 
+// -------- Per-process secrets -----------
+// Keys of the header checksums and of the safe-linking of the free lists.
+// They are random for every process, and they are set before the other
+// constructors, which may already allocate.
+// They come from getrandom(), never straight from the 16 random bytes that the
+// kernel gives to every program (AT_RANDOM): glibc already uses them as the stack
+// canary and the pointer guard, and a free link or a header checksum would leak
+// them. Only if getrandom() fails, AT_RANDOM is hashed with other values.
+
+static size_t header_key = 0x9E3779B97F4A7C15UL;
+static uintptr_t link_secret = sizeof(word_t) - 1;
+
+// Finalizer of splitmix64
+static inline uint64_t mix_bits(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+__attribute__((constructor(101)))
+static void init_process_keys() {
+    uint64_t keys[2];
+    if (getrandom(keys, sizeof(keys), GRND_NONBLOCK) != (ssize_t)sizeof(keys)) {
+        // The canary and the pointer guard can't be recovered from the keys:
+        // they are mixed with the time and the address of the stack
+        const uint64_t *random = (const uint64_t*)getauxval(AT_RANDOM);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t seed = (uint64_t)now.tv_nsec ^ ((uint64_t)now.tv_sec << 32) ^ (uint64_t)(uintptr_t)&now;
+        if (random != NULL) seed ^= mix_bits(random[0] + mix_bits(random[1]));
+        keys[0] = mix_bits(seed);
+        keys[1] = mix_bits(seed + 0x9E3779B97F4A7C15ULL);
+    }
+    // The low bits are always set: see mangle_link()
+    link_secret = (uintptr_t)keys[0] | (sizeof(word_t) - 1);
+    header_key = (size_t)keys[1] | 1;
+}
+
+// -------- Header checksums -----------
+/*
+    A buffer overflow or a double free usually shows up much later, when coalesce
+    or remove_from_free_list follow a header or a link that was overwritten. To
+    catch it where it happens, every header carries a checksum of its size and
+    flags in its 16 most significant bits (sizes never use them):
+
+        | checksum (16) | size (45) | cached | mmap | used |
+
+    The checksum is a multiply-shift hash of the other bits and of the address of
+    the block, with a random key chosen at startup: an overflow that writes
+    plausible values, or a header copied from another block, doesn't match it.
+    It's computed on every header write (one multiplication), and the footer is
+    still a copy of the header.
+
+    When the checks are enabled (set_header_checks(true)) the header is verified:
+        - by my_free, which also detects double frees: a block that is not marked
+        as used, or that is in a per-cpu cache or in a fast list (CACHED_FLAG), is
+        reported and ignored.
+        - by every pop from the segregated lists, the per-cpu caches and the fast
+        lists, before its links are followed.
+    A wrong checksum means that the heap is corrupted: it's reported and the
+    process is aborted, before the corruption spreads.
+*/
+
+static bool header_checks_enabled = false;
+
+void set_header_checks(bool enabled) {
+    __atomic_store_n(&header_checks_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+static inline bool header_checks() {
+    return __atomic_load_n(&header_checks_enabled, __ATOMIC_RELAXED);
+}
+
+// The header of block b with the given size and flags
+static inline size_t make_header(Block *b, size_t fields) {
+    size_t check = ((fields ^ (uintptr_t)b) * header_key) >> HEADER_CHECK_SHIFT;
+    return fields | (check << HEADER_CHECK_SHIFT);
+}
+
+// -------- Tag access -----------
+// The header and the footer of a block are read by other threads (coalesce of the
+// neighbors, heap_compact) while the owner of the block updates them, so they are
+// always read and written as whole words with relaxed atomics: on x86 and arm64
+// these are the same plain loads and stores, but the compiler can't tear them.
+
+static inline size_t load_header(Block *b) {
+    return __atomic_load_n(&b->header, __ATOMIC_RELAXED);
+}
+
+static inline void store_header(Block *b, size_t header) {
+    __atomic_store_n(&b->header, header, __ATOMIC_RELAXED);
+}
+
+static inline Footer load_footer(Footer *f) {
+    return __atomic_load_n(f, __ATOMIC_RELAXED);
+}
+
+static inline void store_footer(Footer *f, Footer footer) {
+    __atomic_store_n(f, footer, __ATOMIC_RELAXED);
+}
+
+static inline bool header_valid(Block *b) {
+    size_t header = load_header(b);
+    return header == make_header(b, header & HEADER_FIELDS_MASK);
+}
+
+// The checksum can't be trusted anymore: better to stop here
+static void report_corrupted_header(Block *b, const char *where) {
+    fprintf(stderr, "%s: corrupted header 0x%lx of block %p\n", where, (unsigned long)load_header(b), (void*)b);
+    abort();
+}
+
+static inline void check_header(Block *b, const char *where) {
+    if (header_checks() && !header_valid(b)) report_corrupted_header(b, where);
+}
+
 // -------- Block manipulation utilities -----------
 
 static inline size_t get_size(Block *b) {
-    //The operation is an AND between the header and a
-    // literal that represents a negated 3 (unsigned long)
-    return b->header & ~3UL;
+    //The operation is an AND between the header and the size mask,
+    // which clears the flags and the checksum
+    return load_header(b) & SIZE_MASK;
 }
 
 static inline bool is_used(Block *b) {
     //The is_used flag is in the last bit of the header,
     // the operation is performed between the header and the literal 1
-    return b->header & 1;
+    return load_header(b) & 1;
 }
 
 static inline void set_size(Block *b, size_t size) {
@@ -36,47 +157,156 @@ static inline void set_size(Block *b, size_t size) {
     // are set to 0. On the right side of the OR, only the last 3 bits
     // (the flags) of the header are taken. The OR operation
     // merges the clean size with the clean flags.
-    b->header = (size & SIZE_MASK) | (b->header & 3);
+    store_header(b, make_header(b, (size & SIZE_MASK) | (load_header(b) & 7)));
 }
 
 static inline void set_used(Block *b, bool used) {
-    if (used) {
-        b->header |= 1;
-    } else {
-        b->header &= ~1UL;
-    }
+    size_t fields = load_header(b) & HEADER_FIELDS_MASK;
+    store_header(b, make_header(b, used ? (fields | 1) : (fields & ~1UL)));
 }
 
 static inline void set_header(Block *b, size_t size, bool used) {
     // Similar to set_size() with the difference that the last flag
     // is chosen on the spot
-    b->header = (size & SIZE_MASK) | (used ? 1 : 0);
+    store_header(b, make_header(b, (size & SIZE_MASK) | (used ? 1 : 0)));
 }
 
-// -------- Gap checking utility -----------
+// Mark a used block as kept in a per-cpu cache or in a fast list (or not anymore)
+static inline void set_cached(Block *b, bool cached) {
+    size_t fields = load_header(b) & HEADER_FIELDS_MASK;
+    store_header(b, make_header(b, cached ? (fields | CACHED_FLAG) : (fields & ~CACHED_FLAG)));
+}
 
-static inline bool is_in_gap(void *addr) {
-    if (gap_start == NULL || gap_end == NULL) {
-        return false;  // No gap exists yet
-    }
-    unsigned char *ptr = (unsigned char *)addr;
-    return (ptr >= gap_start && ptr < gap_end);
+// Mark a used block as sampled by the leak report (or not anymore)
+static inline void set_sampled(Block *b, bool sampled) {
+    size_t fields = load_header(b) & HEADER_FIELDS_MASK;
+    store_header(b, make_header(b, sampled ? (fields | SAMPLED_FLAG) : (fields & ~SAMPLED_FLAG)));
+}
+
+static inline bool is_sampled(Block *b) {
+    return load_header(b) & SAMPLED_FLAG;
+}
+
+// Called on every block popped from a list, before its links are followed
+static inline void check_popped_block(Block *b, const char *where) {
+    check_header(b, where);
+    if (load_header(b) & CACHED_FLAG) set_cached(b, false);
+}
+
+// -------- Heap top access -----------
+
+// heap_state.top is written only while holding the growth lock, but coalesce reads it
+// without the lock to know where the heap ends. For this reason it's published
+// only after the header of the new top block has been written.
+static inline unsigned char* get_heap_top() {
+    return __atomic_load_n(&heap_state.top, __ATOMIC_ACQUIRE);
+}
+
+static inline void set_heap_top(unsigned char *top) {
+    __atomic_store_n(&heap_state.top, top, __ATOMIC_RELEASE);
 }
 
-// Check if a block is in a valid heap region
+// -------- Heap regions -----------
+
+// Check if a block is in a valid heap region: the static heap and, once sbrk
+// returned memory that is not contiguous with it, the sbrk region after the gap.
+// The sbrk region is usually above the static heap, but not when the allocator
+// is a shared library: then the static heap is mapped with the library, above
+// the program break. So the two regions are checked separately.
 static inline bool is_valid_heap_address(void *addr) {
     unsigned char *ptr = (unsigned char *)addr;
-    
-    // Must be within overall heap bounds
-    if (ptr < (unsigned char *)heap_start || ptr >= heap_top) {
-        return false;
+    unsigned char *top = get_heap_top();
+
+    if (heap_state.gap_end == NULL) {
+        return ptr >= (unsigned char *)heap_state.start && ptr < top;
     }
-    
-    if (is_in_gap(ptr)) {
-        return false;
+    return (ptr >= (unsigned char *)heap_state.start && ptr < heap_state.gap_start) ||
+           (ptr >= heap_state.gap_end && ptr < top);
+}
+
+// ----------- Free list links ---------
+// The links of a free block are read and written only through these functions,
+// since with COMPRESSED_LINKS they are stored as offsets (see data_structure.h)
+/*
+    Safe-linking: the links live in the payload of free blocks, so a write after
+    free (or an overflow) can replace them, and the next pops hand out memory
+    chosen by whoever wrote there. Like glibc, the stored links are mangled: they
+    are XORed with the address where they are stored (without its 12 low bits,
+    the ones that ASLR doesn't randomize) and with the secret of the process. A
+    link written without knowing the secret decodes to a random address, and
+    since blocks are aligned to a word, a misaligned link is detected when it's
+    read (check_link()) and the process is aborted. It costs a few ALU operations
+    per link.
+    Compressed links are mangled too, but every offset decodes to an aligned
+    block, so for them the check can't be done.
+*/
+
+#ifdef COMPRESSED_LINKS
+static inline uint32_t mangle_link(const void *pos, uint32_t link) {
+    return link ^ (uint32_t)(((uintptr_t)pos >> 12) ^ link_secret);
+}
+
+static inline uint32_t encode_link(Block *b) {
+    return b ? (uint32_t)((((unsigned char*)b - heap) >> LINK_SHIFT) + 1) : 0;
+}
+
+static inline Block* decode_link(uint32_t link) {
+    return link ? (Block*)(heap + ((uintptr_t)(link - 1) << LINK_SHIFT)) : NULL;
+}
+
+static inline Block* check_link(Block *b, Block *link) { (void)b; return link; }
+static inline Block* peek_next_free(Block *b) { return decode_link(mangle_link(&b->next_link, b->next_link)); }
+static inline Block* peek_prev_free(Block *b) { return decode_link(mangle_link(&b->prev_link, b->prev_link)); }
+static inline void set_next_free(Block *b, Block *next) { b->next_link = mangle_link(&b->next_link, encode_link(next)); }
+static inline void set_prev_free(Block *b, Block *prev) { b->prev_link = mangle_link(&b->prev_link, encode_link(prev)); }
+#else
+static void report_corrupted_link(Block *b, Block *link) {
+    fprintf(stderr, "corrupted free list link %p in block %p\n", (void*)link, (void*)b);
+    abort();
+}
+
+// The address bits are moved above the alignment bits, so those are always
+// flipped by the secret: a plain pointer (or zero) written on a link always
+// decodes to a misaligned address
+static inline uintptr_t mangle_link(const void *pos, uintptr_t link) {
+    return link ^ (((uintptr_t)pos >> 12) << LINK_SHIFT) ^ link_secret;
+}
+
+static inline Block* check_link(Block *b, Block *link) {
+    if ((uintptr_t)link & (sizeof(word_t) - 1)) report_corrupted_link(b, link);
+    return link;
+}
+
+static inline Block* peek_next_free(Block *b) { return (Block*)mangle_link(&b->next_free, (uintptr_t)b->next_free); }
+static inline Block* peek_prev_free(Block *b) { return (Block*)mangle_link(&b->prev_free, (uintptr_t)b->prev_free); }
+static inline void set_next_free(Block *b, Block *next) { b->next_free = (Block*)mangle_link(&b->next_free, (uintptr_t)next); }
+static inline void set_prev_free(Block *b, Block *prev) { b->prev_free = (Block*)mangle_link(&b->prev_free, (uintptr_t)prev); }
+#endif
+
+// peek_next_free() doesn't check the link: it's used only where the block may be
+// reused by another thread while we read it (see fast_pop())
+static inline Block* get_next_free(Block *b) { return check_link(b, peek_next_free(b)); }
+static inline Block* get_prev_free(Block *b) { return check_link(b, peek_prev_free(b)); }
+
+// ----------- Prefetching ---------
+// A pop from a list makes the next block the new head, and the next pop reads
+// its link: that is a cache miss if the block was freed long ago. The pops ask
+// the cpu to load it in the background (__builtin_prefetch) while the current
+// block is returned to the user. Prefetching is enabled by default and can be
+// turned off at runtime to compare the two (see the prefetch test).
+
+static bool prefetch_enabled = true;
+
+void set_prefetch(bool enabled) {
+    __atomic_store_n(&prefetch_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+// Prefetch the cache line at addr, which is going to be written soon.
+// It never faults, so addr may be NULL or a block that is being reused.
+static inline void prefetch_block(const void *addr) {
+    if (__atomic_load_n(&prefetch_enabled, __ATOMIC_RELAXED)) {
+        __builtin_prefetch(addr, 1, 3);
     }
-    
-    return true;
 }
 
 // ----------- List manipulation utilities ---------
@@ -91,43 +321,71 @@ static inline int get_list_index(size_t size) {
     return 5; // > 512
 }
 
+static inline void lock_list(int idx) {
+    pthread_mutex_lock(&segregatedLists[idx].lock);
+}
+
+static inline void unlock_list(int idx) {
+    pthread_mutex_unlock(&segregatedLists[idx].lock);
+}
+
+// Take every list lock, in ascending order (see heap_free_block())
+static inline void lock_all_lists() {
+    for (int i = 0; i < NUM_LISTS; i++) {
+        lock_list(i);
+    }
+}
+
+static inline void unlock_all_lists() {
+    for (int i = NUM_LISTS - 1; i >= 0; i--) {
+        unlock_list(i);
+    }
+}
+
+// Note: the lock of the list of the block must be held
 static void remove_from_free_list(Block *block) {
+    Block *prev = get_prev_free(block);
+    Block *next = get_next_free(block);
+
     //If the block has a predecessor, the next of the predecessor
     // becomes the next of the current block
-    if (block->prev_free) {
-        block->prev_free->next_free = block->next_free;
+    if (prev) {
+        set_next_free(prev, next);
     } else {
         //If there is no predecessor, it means that the block
         // is the head of the list, so the next of the block becomes
         // the new head
         int idx = get_list_index(get_size(block));
-        segregatedLists[idx] = block->next_free;
+        segregatedLists[idx].head = next;
+        // The next pop from this list will unlink the successor of the new head
+        if (next) prefetch_block(get_next_free(next));
     }
 
-    if (block->next_free) {
-        block->next_free->prev_free = block->prev_free;
+    if (next) {
+        set_prev_free(next, prev);
     }
 
     // Clean the pointers
-    block->next_free = NULL;
-    block->prev_free = NULL;
+    set_next_free(block, NULL);
+    set_prev_free(block, NULL);
 }
 
+// Note: the lock of the list of the block must be held
 static void insert_into_free_list(Block *block) {
     int idx = get_list_index(get_size(block));
     
     // Insert the block at the front of the list
-    block->next_free = segregatedLists[idx];
-    block->prev_free = NULL;
+    set_next_free(block, segregatedLists[idx].head);
+    set_prev_free(block, NULL);
     
     //If the new block is not the first one to be placed into
     // the list, the predecessor of the former head becomes the new block
-    if (segregatedLists[idx] != NULL) {
-        segregatedLists[idx]->prev_free = block;
+    if (segregatedLists[idx].head != NULL) {
+        set_prev_free(segregatedLists[idx].head, block);
     }
     
     // The new block becomes the head of the list
-    segregatedLists[idx] = block;
+    segregatedLists[idx].head = block;
 }
 
 // ------------- Footer related utilities ---------------------
@@ -143,7 +401,7 @@ static inline Footer* get_footer(Block* b) {
 static inline Block* get_prev_physical_block(Block* b) {
     Footer* prev_footer = (Footer*)((unsigned char*)b - sizeof(Footer));
     
-    size_t prev_size = *prev_footer & SIZE_MASK;
+    size_t prev_size = load_footer(prev_footer) & SIZE_MASK;
     
     //Return the header of the block by subtracting the entire block size
     return (Block*)((unsigned char*)b - prev_size);
@@ -168,8 +426,20 @@ static inline Block* get_block_from_payload(void *ptr) {
 // Set up the header and footer of the block
 static inline void setup_block(Block* b, size_t size, bool used) {
     set_header(b, size, used);
-    Footer* f = get_footer(b);
-    *f = b->header;
+    store_footer(get_footer(b), load_header(b));
+}
+
+// ------------- Locked free list operations ---------------------
+
+// Mark a block owned by the calling thread as free and insert it in its list.
+// The tags are written while holding the lock, see coalesce().
+static void release_free_block(Block *block, size_t size) {
+    int idx = get_list_index(size);
+
+    lock_list(idx);
+    setup_block(block, size, false);
+    insert_into_free_list(block);
+    unlock_list(idx);
 }
 
 // Get the current machine page size using the sysconf system call